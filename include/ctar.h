@@ -2,6 +2,14 @@
 #define _CTAR_H
 
 #include "typedef.h"
+#include "ctar_pipeline.h"
+#include "ctar_reader.h"
+#include "ctar_cache.h"
+#include "ctar_dcache.h"
+#include <sys/stat.h>
+
+#define CTAR_PREALLOC_SIZE 1048576 // Represents the size from which extracted regular files are preallocated
+#define CTAR_KERNEL_COPY_SIZE 1048576 // Represents the size from which files are extracted from a mapped archive by the kernel
 
 /**
  * @brief Open an archive in the correct mode.
@@ -32,10 +40,11 @@ int ctar_list(ctar_args *args, int fd);
  * @brief Print a ctar entry.
  *
  * @param header The header of the entry.
+ * @param in The reader of the archive.
  * @param verbose Whether to print verbose information.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_list_entry(ctar_header *header, bool verbose);
+int ctar_list_entry(ctar_header *header, ctar_reader *in, bool verbose);
 
 
 /**
@@ -59,39 +68,104 @@ int ctar_extract(ctar_args *args, int fd);
 /**
  * @brief Extract a ctar entry.
  *
+ * @param args The arguments of the program.
  * @param header The header of the entry.
- * @param verbose Whether to print verbose information.
- * @param fd The file descriptor of the archive.
+ * @param in The reader of the archive.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_extract_entry(ctar_header *header, bool verbose, int fd);
+int ctar_extract_entry(ctar_args *args, ctar_header *header, ctar_reader *in);
 
 /**
  * @brief Extract a regular file.
  *
+ * @param args The arguments of the program.
  * @param header The header of the entry.
- * @param fd The file descriptor of the archive, pointing to the beginning of the data.
+ * @param in The reader of the archive, pointing to the beginning of the data.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_extract_regular(ctar_args *args, ctar_header *header, ctar_reader *in);
+
+/**
+ * @brief Create the parent directory of a regular file being extracted, and open it for writing.
+ *
+ * @param dirs The directories kept open by the calling thread.
+ * @param name The name of the file.
+ * @param mode The permissions of the file.
+ * @param size The size of the file, to preallocate it, 0 to not preallocate it.
+ * @return int the file descriptor of the file, -1 on failure.
+ */
+int ctar_extract_open(ctar_dcache *dirs, const char *name, int mode, long size);
+
+/**
+ * @brief Write the data of a regular file from memory (the mapping of the archive, or a copy of the data).
+ *
+ * @param data The data.
+ * @param size The size of the data.
+ * @param out The cache dropper of the output file, written from its beginning.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_extract_regular(ctar_header *header, int fd);
+int ctar_extract_buffer(const unsigned char *data, size_t size, ctar_cache *out);
+
+/**
+ * @brief Make an extracted regular file durable according to args->sync_mode, and close it.
+ *
+ * @param args The arguments of the program.
+ * @param out The cache dropper of the output file, closed with the file.
+ * @param size The size of the file.
+ * @param status The status of the extraction of the file so far.
+ * @return int 0 if the file was extracted and closed, -1 otherwise.
+ */
+int ctar_extract_close(ctar_args *args, ctar_cache *out, long size, int status);
+
+/**
+ * @brief Copy the data of a regular file from an archive that is not mapped.
+ *
+ * @param args The arguments of the program.
+ * @param header The header of the entry.
+ * @param in The reader of the archive, pointing to the beginning of the data.
+ * @param out The cache dropper of the output file, written from its beginning.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_extract_data(ctar_args *args, ctar_header *header, ctar_reader *in, ctar_cache *out);
+
+/**
+ * @brief Extract a sparse file, recreating its holes.
+ *
+ * @param args The arguments of the program.
+ * @param header The header of the entry.
+ * @param in The reader of the archive, pointing to the beginning of the data (see ctar_reader::sparse_size).
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_extract_sparse(ctar_args *args, ctar_header *header, ctar_reader *in);
 
 /**
  * @brief Extract a symbolic link.
  * 
+ * @param args The arguments of the program.
+ * @param header The header of the entry.
+ * @param in The reader of the archive, pointing to the beginning of the data.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_extract_symlink(ctar_args *args, ctar_header *header, ctar_reader *in);
+
+/**
+ * @brief Create the symbolic link of an entry whose data blocks were skipped.
+ *
+ * @param dirs The directories kept open by the calling thread.
  * @param header The header of the entry.
- * @param fd The file descriptor of the archive, pointing to the beginning of the data.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_extract_symlink(ctar_header *header, int fd);
+int ctar_extract_link(ctar_dcache *dirs, ctar_header *header);
 
 /**
  * @brief Extract a directory.
  * 
+ * @param args The arguments of the program.
  * @param header The header of the entry.
- * @param fd The file descriptor of the archive, pointing to the beginning of the data.
+ * @param in The reader of the archive, pointing to the beginning of the data.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_extract_directory(ctar_header *header, int fd);
+int ctar_extract_directory(ctar_args *args, ctar_header *header, ctar_reader *in);
 
 /**
  * @brief Create an archive.
@@ -102,50 +176,99 @@ int ctar_extract_directory(ctar_header *header, int fd);
  */
 int ctar_create(ctar_args *args, int fd);
 
+/**
+ * @brief Add the files to archive as they are walked by several threads, see @ref ctar_walk.
+ *
+ * @param args The arguments of the program.
+ * @param out The pipeline writing the archive.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_create_walk(ctar_args *args, ctar_pipeline *out);
+
 /**
  * @brief Create the end of the archive.
  *
- * @param fd The file descriptor of the archive.
+ * @param out The pipeline writing the archive.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_create_end_of_archive(int fd);
+int ctar_create_end_of_archive(ctar_pipeline *out);
 
 /**
  * @brief Create a ctar entry.
  *
+ * @param args The arguments of the program.
+ * @param path The path of the entry.
+ * @param out The pipeline writing the archive.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_create_entry(ctar_args *args, char *path, ctar_pipeline *out);
+
+/**
+ * @brief Create a ctar entry from a file of a directory.
+ *
+ * @param args The arguments of the program.
+ * @param dir_fd The file descriptor of the directory, or AT_FDCWD.
+ * @param name The name of the file in the directory.
  * @param path The path of the entry.
- * @param verbose Whether to print verbose information.
- * @param fd The file descriptor of the archive.
+ * @param out The pipeline writing the archive.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_create_entry(char *path, bool verbose, int fd);
+int ctar_create_at(ctar_args *args, int dir_fd, const char *name, char *path, ctar_pipeline *out);
+
+/**
+ * @brief Create a ctar entry from a file already stat'ed.
+ *
+ * @param args The arguments of the program.
+ * @param path The path of the entry.
+ * @param st The status of the file, from lstat().
+ * @param in_fd The file descriptor of the file if it is a regular file or a directory already opened, -1 otherwise.
+ * It is closed once the file is archived.
+ * @param out The pipeline writing the archive.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_create_file(ctar_args *args, char *path, struct stat *st, int in_fd, ctar_pipeline *out);
 
 /**
  * @brief Create a regular file.
  *
+ * @param args The arguments of the program.
  * @param header The header of the entry.
- * @param fd The file descriptor of the archive.
+ * @param in_fd The file descriptor of the file if already opened, -1 to open it. It is closed once the file is archived.
+ * @param out The pipeline writing the archive.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_create_regular(ctar_header *header, int fd);
+int ctar_create_regular(ctar_args *args, ctar_header *header, int in_fd, ctar_pipeline *out);
+
+/**
+ * @brief Append data of a regular file to the archive, without padding it.
+ *
+ * @param args The arguments of the program.
+ * @param header The header of the entry.
+ * @param in The cache dropper of the file, read from its current offset.
+ * @param size The number of bytes to append, the missing ones are replaced by zeros if the file shrank.
+ * @param out The pipeline writing the archive.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_create_data(ctar_args *args, ctar_header *header, ctar_cache *in, long size, ctar_pipeline *out);
 
 /**
  * @brief Create a symbolic link.
  *
  * @param header The header of the entry.
- * @param fd The file descriptor of the archive.
+ * @param out The pipeline writing the archive.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_create_symlink(ctar_header *header, int fd);
+int ctar_create_symlink(ctar_header *header, ctar_pipeline *out);
 
 /**
  * @brief Create a directory.
  *
+ * @param args The arguments of the program.
  * @param header The header of the entry.
- * @param verbose Whether to print verbose information.
- * @param fd The file descriptor of the archive.
+ * @param dir_fd The file descriptor of the directory if already opened, -1 to open it. It is closed once the directory is archived.
+ * @param out The pipeline writing the archive.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_create_directory(ctar_header *header, bool verbose, int fd);
+int ctar_create_directory(ctar_args *args, ctar_header *header, int dir_fd, ctar_pipeline *out);
 
 #endif // _CTAR_H
\ No newline at end of file
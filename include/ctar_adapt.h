@@ -0,0 +1,83 @@
+#ifndef _CTAR_ADAPT_H_
+#define _CTAR_ADAPT_H_
+
+#include "typedef.h"
+#include <sys/types.h>
+
+#define CTAR_ADAPT_SAMPLE_SIZE 32768 // Represents the number of bytes sampled at the start of a regular file
+#define CTAR_ADAPT_MIN_SIZE 65536    // Represents the size under which regular files are not sampled
+#define CTAR_ADAPT_STORED_RATIO 95   // Represents the compressed size (in % of the sample) from which data is stored
+#define CTAR_ADAPT_FAST_RATIO 85     // Represents the compressed size (in % of the sample) from which data is compressed at level 1
+
+/** @brief Compression level of the uncompressed archive from a given offset */
+typedef struct ctar_adapt_change
+{
+  long offset;
+  int level; // -1 for the level of the archive
+} ctar_adapt_change;
+
+/** @brief Compression levels chosen by the archive writer, followed by the compression thread */
+typedef struct ctar_adapt
+{
+  pthread_mutex_t lock;
+  ctar_adapt_change *changes; // Sorted by offset, from the one in effect where the compressor is (see ctar_adapt_consume())
+  size_t count;
+  size_t capacity;
+} ctar_adapt;
+
+/**
+ * @brief Allocate an empty level map, where the whole archive is compressed at its own level.
+ *
+ * @return ctar_adapt* the level map if successful, NULL otherwise.
+ */
+ctar_adapt *ctar_adapt_new(void);
+
+/**
+ * @brief Free a level map.
+ *
+ * @param adapt The level map, may be NULL.
+ */
+void ctar_adapt_free(ctar_adapt *adapt);
+
+/**
+ * @brief Choose the compression level of a regular file by compressing a sample of its first bytes.
+ *
+ * @param fd The file descriptor of the file, its offset is left untouched.
+ * @param size The size of the file.
+ * @param level The compression level of the archive, -1 for the default one.
+ * @param ratio Set to the compressed size of the sample in percent, if the file was sampled.
+ * @return int the compression level of the file, -1 to keep the level of the archive.
+ */
+int ctar_adapt_sample(int fd, long size, int level, int *ratio);
+
+/**
+ * @brief Compress the uncompressed archive at level from offset on.
+ *
+ * @param adapt The level map.
+ * @param offset The offset in the uncompressed archive, not lower than the previous ones.
+ * @param level The compression level, -1 for the level of the archive.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_adapt_push(ctar_adapt *adapt, long offset, int level);
+
+/**
+ * @brief Get the longest segment of the uncompressed archive compressed at a single level.
+ *
+ * @param adapt The level map, NULL to compress everything at level.
+ * @param offset The offset of the segment in the uncompressed archive.
+ * @param len The number of bytes available from offset.
+ * @param level The compression level of the archive.
+ * @param segment_level Set to the compression level of the segment.
+ * @return size_t the length of the segment, at most len.
+ */
+size_t ctar_adapt_segment(ctar_adapt *adapt, long offset, size_t len, int level, int *segment_level);
+
+/**
+ * @brief Drop the changes of the level map the compressor is done with, so that the map stays small.
+ *
+ * @param adapt The level map, may be NULL.
+ * @param offset The offset in the uncompressed archive up to which the data is compressed, and will not be asked for again.
+ */
+void ctar_adapt_consume(ctar_adapt *adapt, long offset);
+
+#endif // _CTAR_ADAPT_H_
@@ -0,0 +1,52 @@
+#ifndef _CTAR_CACHE_H_
+#define _CTAR_CACHE_H_
+
+#include "typedef.h"
+#include <sys/types.h>
+
+#define CTAR_CACHE_DROP_SIZE 8388608 // Represents the amount of data read or written between two drops from the page cache
+
+/**
+ * @brief Drops the data of a file from the page cache behind a read or write cursor.
+ *
+ * Written data is dropped one step late: its writeback is started once written,
+ * and waited for before dropping it, so that writing rarely waits for the disk.
+ */
+typedef struct ctar_cache
+{
+  int fd;
+  bool enabled;
+  bool dirty;                // Whether the data is written, so it must be written back before being dropped
+  const unsigned char *map;  // Mapping of the file, unmapped from the process before being dropped, may be NULL
+  off_t start;               // Offset of the first byte not dropped yet
+  off_t flushed;             // Offset up to which writeback was started, if dirty
+} ctar_cache;
+
+/**
+ * @brief Start following a cursor in a file.
+ *
+ * @param cache The cache dropper to initialize.
+ * @param fd The file descriptor of the file.
+ * @param offset The offset of the cursor.
+ * @param enabled Whether to drop anything (see ctar_args::drop_cache).
+ * @param dirty Whether the cursor writes the file.
+ */
+void ctar_cache_open(ctar_cache *cache, int fd, off_t offset, bool enabled, bool dirty);
+
+/**
+ * @brief Move the cursor forward, dropping the data behind it every CTAR_CACHE_DROP_SIZE bytes.
+ *
+ * @param cache The cache dropper.
+ * @param offset The new offset of the cursor.
+ */
+void ctar_cache_advance(ctar_cache *cache, off_t offset);
+
+/**
+ * @brief Drop all the data before the cursor, waiting for its writeback if it is dirty.
+ *
+ * @param cache The cache dropper.
+ * @param offset The final offset of the cursor.
+ */
+void ctar_cache_close(ctar_cache *cache, off_t offset);
+
+#endif // _CTAR_CACHE_H_
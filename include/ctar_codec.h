@@ -0,0 +1,78 @@
+#ifndef _CTAR_CODEC_H_
+#define _CTAR_CODEC_H_
+
+#include "typedef.h"
+#include <pthread.h>
+
+#define CTAR_CODEC_MAGIC_SIZE 4   // Represents the maximum size of the magic bytes of a compression format
+#define CTAR_CODEC_COPY_SIZE 65536 // Represents the size of the buffer used to copy an uncompressed stream
+
+/** @brief Compression format of an archive */
+typedef struct ctar_codec
+{
+  ctar_codec_id id;
+  char *name;
+  unsigned char magic[CTAR_CODEC_MAGIC_SIZE];
+  size_t magic_size;
+  int max_level;
+  bool adaptive; // Whether compress() follows the levels chosen per entry in args->adapt
+
+  /**
+   * @brief Compress from fd_in into fd_out, closing fd_out but not fd_in.
+   * @return int 0 if successful, -1 otherwise.
+   */
+  int (*compress)(int fd_out, int fd_in, ctar_args *args);
+
+  /**
+   * @brief Decompress from fd_in into fd_out, closing fd_in but not fd_out.
+   * @return int 0 if successful, -1 otherwise.
+   */
+  int (*decompress)(int fd_in, int fd_out, ctar_args *args);
+} ctar_codec;
+
+/**
+ * @brief Get a compression format.
+ *
+ * @param id The identifier of the compression format.
+ * @return const ctar_codec* the compression format, NULL if ctar was built without it.
+ */
+const ctar_codec *ctar_codec_get(ctar_codec_id id);
+
+/**
+ * @brief Detect the compression format of a file from its magic bytes.
+ *
+ * @param magic The first bytes of the file.
+ * @param size The number of bytes in magic, at most CTAR_CODEC_MAGIC_SIZE.
+ * @return const ctar_codec* the compression format, NULL if the file is not compressed.
+ */
+const ctar_codec *ctar_codec_detect(const unsigned char *magic, size_t size);
+
+/**
+ * @brief Start compressing into fd_out in a background thread.
+ *
+ * @param args The arguments of the program, args->stream_thread is set to the compression thread.
+ * @param fd_out The file descriptor of the compressed archive, closed by the thread.
+ * @return int file descriptor to write the uncompressed archive to if successful, -1 otherwise.
+ */
+int ctar_compress_stream(ctar_args *args, int fd_out);
+
+/**
+ * @brief Start decompressing fd_in in a background thread, or copying it if args->compress is false.
+ *
+ * @param args The arguments of the program, args->stream_thread is set to the decompression thread.
+ * @param fd_in The file descriptor of the archive, closed by the thread.
+ * @param prefix The first bytes of the archive if they were already read from fd_in, may be NULL.
+ * @param prefix_len The number of bytes in prefix, at most CTAR_CODEC_MAGIC_SIZE.
+ * @return int file descriptor to read the uncompressed archive from if successful, -1 otherwise.
+ */
+int ctar_decompress_stream(ctar_args *args, int fd_in, const unsigned char *prefix, size_t prefix_len);
+
+/**
+ * @brief Wait for the stream thread to finish.
+ *
+ * @param args The arguments of the program, holding the thread started by ctar_compress_stream() or ctar_decompress_stream().
+ * @return int 0 if the thread succeeded, -1 otherwise.
+ */
+int ctar_stream_join(ctar_args *args);
+
+#endif // _CTAR_CODEC_H_
@@ -0,0 +1,56 @@
+#ifndef _CTAR_DCACHE_H_
+#define _CTAR_DCACHE_H_
+
+#include "typedef.h"
+#include <sys/types.h>
+
+#define CTAR_DCACHE_SIZE 64 // Represents the number of directories kept open by a directory cache
+
+/** @brief Directory kept open by a directory cache */
+typedef struct ctar_dcache_slot
+{
+  int fd;             // Opened with O_PATH, -1 if the slot is free
+  size_t len;         // Length of path
+  unsigned long used; // Value of ctar_dcache::clock when the directory was last used
+  char path[CTAR_NAME_SIZE + 1];
+} ctar_dcache_slot;
+
+/**
+ * @brief Least recently used directories of the files being extracted, kept open.
+ *
+ * Files are created relative to their parent directory (openat(), mkdirat(), symlinkat()...),
+ * so the kernel does not resolve their whole path, and the missing directories are created once
+ * instead of trying to create every ancestor of every file. A directory cache is used by a single thread.
+ */
+typedef struct ctar_dcache
+{
+  ctar_dcache_slot slots[CTAR_DCACHE_SIZE];
+  unsigned long clock; // Incremented whenever a directory is used
+  int last;            // Slot of the last directory used, checked first
+} ctar_dcache;
+
+/**
+ * @brief Initialize an empty directory cache.
+ *
+ * @param cache The cache.
+ */
+void ctar_dcache_open(ctar_dcache *cache);
+
+/**
+ * @brief Get the parent directory of a path, creating the missing directories (with mode 0755).
+ *
+ * @param cache The cache.
+ * @param path The path, relative to the current working directory or absolute.
+ * @param name Set to the last component of path, in path.
+ * @return int the file descriptor of the parent directory (AT_FDCWD if none), valid until the next call, -1 on failure.
+ */
+int ctar_dcache_parent(ctar_dcache *cache, const char *path, const char **name);
+
+/**
+ * @brief Close the directories of a cache.
+ *
+ * @param cache The cache.
+ */
+void ctar_dcache_close(ctar_dcache *cache);
+
+#endif // _CTAR_DCACHE_H_
@@ -0,0 +1,76 @@
+#ifndef _CTAR_DIR_H_
+#define _CTAR_DIR_H_
+
+#include "typedef.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define CTAR_DIR_BATCH_SIZE 262144 // Represents the size of the batches of entries read from a directory
+
+/** @brief Entry of a directory read in inode order, at an offset of ctar_dir::buf */
+typedef struct ctar_dir_slot
+{
+  ino_t ino;
+  size_t offset;
+} ctar_dir_slot;
+
+/**
+ * @brief Directory read with getdents64(), in batches of CTAR_DIR_BATCH_SIZE bytes.
+ *
+ * The entries are returned in the order of the directory, or sorted by inode number:
+ * on most file systems, inodes are laid out on the disk in the order of their numbers,
+ * so stat'ing and reading the files in that order seeks less on spinning disks.
+ * Sorting needs all the entries, so the whole directory is read at once.
+ */
+typedef struct ctar_dir
+{
+  int fd;
+  unsigned char *buf;   // Batches of entries read, all of them if sorted
+  size_t len;           // Number of bytes read in buf
+  size_t pos;           // Offset of the next entry in buf, if not sorted
+  bool sorted;          // Whether the entries are returned in inode order
+  ctar_dir_slot *slots; // Entries sorted by inode number
+  size_t count;         // Number of entries sorted
+  size_t index;         // Index of the next entry sorted
+} ctar_dir;
+
+/**
+ * @brief Start reading a directory.
+ *
+ * @param dir The directory to initialize.
+ * @param fd The file descriptor of the directory, which must stay open until ctar_dir_close().
+ * @param sort Whether to return the entries in inode order.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_dir_open(ctar_dir *dir, int fd, bool sort);
+
+/**
+ * @brief Read the next entry of a directory, "." and ".." excluded.
+ *
+ * @param dir The directory.
+ * @param name Set to the name of the entry, valid until the next call.
+ * @param type Set to the type of the entry (DT_DIR, DT_REG...), DT_UNKNOWN if the file system does not tell it.
+ * @return int 1 if an entry was read, 0 at the end of the directory, -1 on failure.
+ */
+int ctar_dir_next(ctar_dir *dir, const char **name, unsigned char *type);
+
+/**
+ * @brief Stop reading a directory, its file descriptor is left open.
+ *
+ * @param dir The directory.
+ */
+void ctar_dir_close(ctar_dir *dir);
+
+/**
+ * @brief Get the status of a file in a directory, without following symbolic links.
+ *
+ * Only the fields ctar archives are requested (see statx()), the other ones are zero.
+ *
+ * @param dir_fd The file descriptor of the directory, or AT_FDCWD.
+ * @param name The name of the file in the directory.
+ * @param st Set to the status of the file.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_dir_stat(int dir_fd, const char *name, struct stat *st);
+
+#endif // _CTAR_DIR_H_
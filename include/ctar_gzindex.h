@@ -0,0 +1,51 @@
+#ifndef _CTAR_GZINDEX_H_
+#define _CTAR_GZINDEX_H_
+
+#include "typedef.h"
+#include "ctar_adapt.h"
+#include <stdint.h>
+#include <zlib.h>
+
+#define CTAR_GZINDEX_FIELD_SIZE 65531 // Represents the maximum size of a gzip extra subfield
+#define CTAR_GZINDEX_FOOTER_SIZE 34   // Represents the size of the gzip member locating the index
+
+/** @brief Location of an entry in a seekable archive */
+typedef struct ctar_gzindex_entry
+{
+  uint64_t member_offset; // Offset of the gzip member holding the header in the archive
+  uint64_t skip;          // Offset of the header in the uncompressed data of the member
+  char name[CTAR_NAME_SIZE + 1];
+} ctar_gzindex_entry;
+
+/** @brief Index of a seekable archive */
+typedef struct ctar_gzindex
+{
+  ctar_gzindex_entry *entries;
+  size_t count;
+  size_t capacity;
+} ctar_gzindex;
+
+/**
+ * @brief Compress from fd_in into fd_out, starting a new gzip member at entry boundaries
+ * and appending an index of the entries.
+ *
+ * @param fd_out The file descriptor of the compressed file to write.
+ * @param fd_in The file descriptor of the uncompressed archive.
+ * @param member_size The uncompressed size after which a new member is started.
+ * @param level The compression level, -1 for the default one.
+ * @param adapt The compression levels chosen per entry, NULL to compress everything at level.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_compress_seekable(int fd_out, int fd_in, long member_size, int level, ctar_adapt *adapt);
+
+/**
+ * @brief Decompress only the entries of fd_in selected by files into fd_out, using the index of the archive.
+ *
+ * @param fd_in The file descriptor of the compressed archive.
+ * @param fd_out The file descriptor of the uncompressed archive.
+ * @param files The selected files, see is_selected().
+ * @return int 0 if successful, 1 if the archive has no index, -1 otherwise.
+ */
+int ctar_decompress_indexed(int fd_in, int fd_out, char **files);
+
+#endif // _CTAR_GZINDEX_H_
@@ -0,0 +1,78 @@
+#ifndef _CTAR_JOBS_H_
+#define _CTAR_JOBS_H_
+
+#include "typedef.h"
+#include "ctar_reader.h"
+
+#define CTAR_JOBS_SLOTS_PER_THREAD 4  // Represents the number of files queued per extraction thread
+#define CTAR_JOBS_FILE_SIZE 1048576   // Represents the size up to which files of an archive that is not mapped are copied to the threads
+#define CTAR_JOBS_LINKS_MAX 256       // Represents the number of symbolic links deferred at once
+
+/**
+ * @brief Extraction threads writing regular files in parallel, fed by the thread walking the headers.
+ *
+ * The thread walking the headers keeps the order of the archive where it matters:
+ * - directories, and files that cannot be queued, are extracted by it, in order
+ * - an entry with the name of a file still queued waits for all the queued files
+ * - symbolic links are deferred until no queued file can be written through them,
+ *   and created in order before any entry whose path goes through one of them
+ */
+typedef struct ctar_jobs ctar_jobs;
+
+/**
+ * @brief Start args->jobs extraction threads.
+ *
+ * @param args The arguments of the program, which must outlive the threads.
+ * @return ctar_jobs* the threads, NULL on failure.
+ */
+ctar_jobs *ctar_jobs_new(ctar_args *args);
+
+/**
+ * @brief Wait for the queued files and create the deferred symbolic links if an entry depends on them.
+ *
+ * @param jobs The threads.
+ * @param header The header of the entry.
+ * @return int 0 if successful, -1 if a file or link could not be extracted.
+ */
+int ctar_jobs_wait_name(ctar_jobs *jobs, ctar_header *header);
+
+/**
+ * @brief Check if a regular file can be queued.
+ *
+ * @param header The header of the entry.
+ * @param in The reader of the archive.
+ * @return true If the file can be extracted by the threads: the archive is mapped, or the file is small enough to be copied.
+ * @return false If the file must be extracted in order.
+ */
+bool ctar_jobs_accepts(ctar_header *header, ctar_reader *in);
+
+/**
+ * @brief Queue the extraction of a regular file, see ctar_jobs_accepts().
+ *
+ * @param jobs The threads.
+ * @param header The header of the entry.
+ * @param in The reader of the archive, pointing to the beginning of the data.
+ * The data of a mapped archive is written from the mapping, which must outlive the threads.
+ * @return int 0 if successful, -1 if this file or a previous one could not be extracted.
+ */
+int ctar_jobs_extract(ctar_jobs *jobs, ctar_header *header, ctar_reader *in);
+
+/**
+ * @brief Defer the creation of a symbolic link.
+ *
+ * @param jobs The threads.
+ * @param header The header of the entry.
+ * @param in The reader of the archive, pointing to the beginning of the data.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_jobs_symlink(ctar_jobs *jobs, ctar_header *header, ctar_reader *in);
+
+/**
+ * @brief Wait for the queued files, create the deferred symbolic links and stop the threads.
+ *
+ * @param jobs The threads, may be NULL.
+ * @return int 0 if every file and link was extracted, -1 otherwise.
+ */
+int ctar_jobs_finish(ctar_jobs *jobs);
+
+#endif // _CTAR_JOBS_H_
@@ -0,0 +1,109 @@
+#ifndef _CTAR_PIPELINE_H_
+#define _CTAR_PIPELINE_H_
+
+#include "typedef.h"
+#include <sys/stat.h>
+
+#define CTAR_PIPELINE_SLOTS 4             // Represents the number of slots of the ring
+#define CTAR_PIPELINE_COPY_MIN_SIZE 262144 // Represents the size from which file data is worth copying by the kernel
+
+/** @brief Ways of copying file data to the archive, from the cheapest one */
+typedef enum ctar_pipeline_copy_method
+{
+  CTAR_PIPELINE_COPY_FILE_RANGE, // copy_file_range(), may share the data blocks (reflink) or copy on the server
+  CTAR_PIPELINE_SENDFILE,        // sendfile(), copies in the kernel, also to pipes and sockets
+  CTAR_PIPELINE_USER,            // Through the slots of the ring
+} ctar_pipeline_copy_method;
+
+/** @brief Part of the archive being filled or written */
+typedef struct ctar_pipeline_slot
+{
+  unsigned char *data;
+  size_t len;
+} ctar_pipeline_slot;
+
+/**
+ * @brief Archive writing stage, fed through a bounded ring of slots.
+ *
+ * The thread creating the archive reads the input files straight into the slots,
+ * while the writer thread writes the filled slots to the archive (or to the compression stage).
+ *
+ * If the archive is opened with O_DIRECT (see ctar_args::direct_io), the slots are aligned and
+ * written whole, the last one padded with zeros, and the padding is truncated when finishing.
+ */
+typedef struct ctar_pipeline
+{
+  int fd;
+  struct stat st;   // Status of the archive, to never add it to itself
+  long offset;      // Number of bytes given to the pipeline
+  size_t slot_size; // Size of a slot of the ring, a multiple of CTAR_BLOCK_SIZE (and of CTAR_DIRECT_ALIGN if direct)
+  bool direct;      // Whether the archive is written with O_DIRECT
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // Broadcast whenever a slot is filled or written
+  ctar_pipeline_slot slots[CTAR_PIPELINE_SLOTS];
+  long filled;  // Number of slots handed to the writer thread
+  long written; // Number of slots written by the writer thread
+  bool closing;
+  int status; // -1 once the writer thread failed
+  ctar_pipeline_copy_method copy_method; // Cheapest copy not known to be unsupported by the files
+  pthread_t writer;
+} ctar_pipeline;
+
+/**
+ * @brief Start the writer thread of a pipeline.
+ *
+ * @param pipeline The pipeline to initialize.
+ * @param fd The file descriptor of the archive.
+ * @param slot_size The size of a slot of the ring, a multiple of CTAR_BLOCK_SIZE.
+ * It is raised to at least CTAR_DIRECT_BUFFER_SIZE, in multiples of CTAR_DIRECT_ALIGN, for direct I/O.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_pipeline_start(ctar_pipeline *pipeline, int fd, size_t slot_size);
+
+/**
+ * @brief Get free space at the end of the pipeline, waiting for the writer thread if the ring is full.
+ *
+ * @param pipeline The pipeline.
+ * @param size Set to the size of the free space, non zero.
+ * @return unsigned char* the free space, NULL if the writer thread failed.
+ */
+unsigned char *ctar_pipeline_reserve(ctar_pipeline *pipeline, size_t *size);
+
+/**
+ * @brief Append the first bytes of the space returned by ctar_pipeline_reserve() to the archive.
+ *
+ * @param pipeline The pipeline.
+ * @param size The number of bytes to append, at most the size of the free space.
+ */
+void ctar_pipeline_commit(ctar_pipeline *pipeline, size_t size);
+
+/**
+ * @brief Append a buffer to the archive.
+ *
+ * @param pipeline The pipeline.
+ * @param buf The buffer.
+ * @param size The size of the buffer.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_pipeline_write(ctar_pipeline *pipeline, const void *buf, size_t size);
+
+/**
+ * @brief Append file data to the archive without going through user space, if the kernel can copy it.
+ *
+ * @param pipeline The pipeline.
+ * @param fd The file descriptor of the file, read from its current offset.
+ * @param size The number of bytes to append.
+ * @return long the number of bytes appended (less than size if the file cannot be copied
+ * by the kernel or is shorter than size, the caller appends the rest), -1 on failure.
+ */
+long ctar_pipeline_copy(ctar_pipeline *pipeline, int fd, long size);
+
+/**
+ * @brief Write the rest of the archive and stop the writer thread.
+ *
+ * @param pipeline The pipeline, freed even if unsuccessful.
+ * @return int 0 if the whole archive was written, -1 otherwise.
+ */
+int ctar_pipeline_finish(ctar_pipeline *pipeline);
+
+#endif // _CTAR_PIPELINE_H_
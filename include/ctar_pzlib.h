@@ -0,0 +1,37 @@
+#ifndef _CTAR_PZLIB_H_
+#define _CTAR_PZLIB_H_
+
+#include "typedef.h"
+#include "ctar_adapt.h"
+#include <zlib.h>
+
+#define CTAR_PZLIB_BLOCK 131072 // Represents the size of the blocks compressed independently
+#define CTAR_PZLIB_SLOTS_PER_THREAD 2 // Represents the number of blocks in flight per thread
+#define CTAR_PZLIB_OUT_SIZE (compressBound(CTAR_PZLIB_BLOCK) + 64) // Represents the size of a compressed block, with room for flushes
+#define CTAR_PZLIB_CHUNK 1048576        // Represents the compressed size of the chunks of members inflated independently
+#define CTAR_PZLIB_SCAN_LIMIT 67108864  // Represents how far the second member is looked for before inflating on a single thread
+#define CTAR_PZLIB_OUT_LIMIT 16777216   // Represents the decompressed size of a chunk kept in memory, larger chunks are inflated again in order
+
+/**
+ * @brief Compress from fd_in into fd_out using several threads.
+ *
+ * @param fd_out The file descriptor of the compressed file to write.
+ * @param fd_in The file descriptor of the uncompressed file.
+ * @param threads The number of compression threads.
+ * @param level The compression level, -1 for the default one.
+ * @param adapt The compression levels chosen per entry, NULL to compress everything at level.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_compress_parallel(int fd_out, int fd_in, int threads, int level, ctar_adapt *adapt);
+
+/**
+ * @brief Decompress from fd_in into fd_out using several threads, if fd_in is made of several gzip members.
+ *
+ * @param fd_in The file descriptor of the compressed file, which must be a regular file.
+ * @param fd_out The file descriptor of the uncompressed file.
+ * @param threads The number of decompression threads.
+ * @return int 0 if successful, 1 if fd_in is not a regular file made of several members, -1 otherwise.
+ */
+int ctar_decompress_parallel(int fd_in, int fd_out, int threads);
+
+#endif // _CTAR_PZLIB_H_
@@ -0,0 +1,104 @@
+#ifndef _CTAR_READER_H_
+#define _CTAR_READER_H_
+
+#include "typedef.h"
+#include "ctar_cache.h"
+#include <sys/types.h>
+
+/**
+ * @brief Archive reading stage, walking the headers of the archive.
+ *
+ * An uncompressed archive stored in a regular file is mapped in memory, so its headers
+ * are read in place and the data of its entries is handed out without any syscall but
+ * an fstat() per entry, which stops at the end of the file if it is truncated meanwhile.
+ * An archive opened with O_DIRECT (see ctar_args::direct_io) is read in aligned windows instead.
+ * Other archives (pipes, compressed archives...) are read with read().
+ *
+ * Extended headers (XHDTYPE) are applied to the header following them, and never returned:
+ * the entries of sparse files are returned under their real name (see @ref ctar_sparse).
+ */
+typedef struct ctar_reader
+{
+  int fd;
+  const unsigned char *map; // Mapping of the whole archive file, NULL if the archive is read with read()
+  size_t map_len;           // Length of the mapping
+  size_t size;              // Size of the archive in the mapping, less than map_len if the file was truncated since
+  size_t pos;               // Offset of the next block in the mapping
+  unsigned char *window;    // Aligned buffer of an archive read with O_DIRECT, NULL otherwise
+  size_t window_len;        // Number of bytes read in the window
+  size_t window_pos;        // Offset of the next block in the window
+  ctar_header header;       // Copy of the last header, if the archive is not mapped or if the header was extended
+  long sparse_size;         // Real size of the last entry if it is a sparse file, -1 otherwise
+  ctar_cache cache;         // Drops the mapped archive from the page cache behind the headers
+} ctar_reader;
+
+/**
+ * @brief Prepare the reading of an archive from the current offset of its file descriptor.
+ *
+ * @param reader The reader to initialize.
+ * @param fd The file descriptor of the archive.
+ * @param drop_cache Whether to drop the archive from the page cache once read.
+ */
+void ctar_reader_open(ctar_reader *reader, int fd, bool drop_cache);
+
+/**
+ * @brief Read the next header of the archive.
+ *
+ * @param reader The reader.
+ * @param header Set to the header, only valid until the next call. It must not be modified,
+ * it may be mapped read-only.
+ * @return int 1 if a header was read, 0 at the end of the archive, -1 on failure.
+ */
+int ctar_reader_next(ctar_reader *reader, ctar_header **header);
+
+/**
+ * @brief Skip the data blocks of the last header.
+ *
+ * @param reader The reader.
+ * @param header The last header.
+ * @return int 0 on success, -1 on failure.
+ */
+int ctar_reader_skip(ctar_reader *reader, ctar_header *header);
+
+/**
+ * @brief Read the data blocks of the last header.
+ *
+ * @param reader The reader.
+ * @param buf The buffer to fill.
+ * @param count The number of bytes to read.
+ * @return ssize_t the number of bytes read, less than count only at the end of the archive, -1 on failure.
+ */
+ssize_t ctar_reader_read(ctar_reader *reader, void *buf, size_t count);
+
+/**
+ * @brief Copy the data blocks of the last header to a file in the kernel, see copy_in_kernel().
+ *
+ * The data of a mapped archive is copied from the archive file, at the offset of the mapping.
+ * Nothing is copied from an archive read with O_DIRECT.
+ *
+ * @param reader The reader.
+ * @param fd_out The file descriptor to write to, at its current offset.
+ * @param count The number of bytes to copy.
+ * @return long the number of bytes copied, less than count at the end of the archive or if the kernel cannot copy them,
+ * -1 on failure.
+ */
+long ctar_reader_copy(ctar_reader *reader, int fd_out, size_t count);
+
+/**
+ * @brief Get the data of the last header in the mapping of the archive, and skip its data blocks.
+ *
+ * @param reader The reader, with a mapped archive.
+ * @param header The last header.
+ * @param size Set to the size of the data, less than the size in the header if the archive is truncated.
+ * @return const unsigned char* the data, valid until ctar_reader_close().
+ */
+const unsigned char *ctar_reader_data(ctar_reader *reader, ctar_header *header, size_t *size);
+
+/**
+ * @brief Release the mapping or the window of the archive, if any. The file descriptor is left open.
+ *
+ * @param reader The reader.
+ */
+void ctar_reader_close(ctar_reader *reader);
+
+#endif // _CTAR_READER_H_
@@ -0,0 +1,52 @@
+#ifndef _CTAR_SHARD_H_
+#define _CTAR_SHARD_H_
+
+#include "typedef.h"
+#include <pthread.h>
+
+#define CTAR_SHARD_MAX 256            // Represents the maximum number of shards of an archive
+#define CTAR_SHARD_MAGIC "ctar-shards" // Represents the first word of a shard manifest
+
+/**
+ * @brief Archive of a set of shards, written or read by its own thread.
+ *
+ * Creating an archive with args->shards shards writes the archives ARCHIVE.0 to ARCHIVE.N-1 in parallel,
+ * and a manifest at ARCHIVE: a first line "ctar-shards N", then a line per file, with the index of
+ * the shard holding it (or * for the directories, added to every shard so that each shard can be
+ * extracted alone) and its path, separated by a tab (backslashes and newlines in paths are escaped).
+ *
+ * The files are balanced between the shards by their size in the archive (from their status):
+ * from the largest, each file goes to the smallest shard so far. Each shard keeps the order of a recursive walk.
+ *
+ * Listing or extracting the manifest lists the shards in order, or extracts them in parallel.
+ */
+typedef struct ctar_shard
+{
+  ctar_args args;   // Arguments of the shard, args.archive being its path
+  int fd;           // File descriptor opened by ctar_open()
+  char **files;     // Files added to the shard when creating it, NULL-terminated
+  size_t nfiles;    // Number of files assigned to the shard, directories excluded
+  long bytes;       // Size of the files of the shard in the archive, estimated from their status
+  int status;       // Status of the creation or extraction of the shard
+  pthread_t thread;
+} ctar_shard;
+
+/**
+ * @brief Get the number of shards of the archive to list or extract.
+ *
+ * @param args The arguments of the program.
+ * @return int the number of shards if args->archive is a shard manifest, 0 if it is an archive
+ * (or cannot be read, which ctar_open() reports), -1 if the manifest is invalid.
+ */
+int ctar_shard_count(ctar_args *args);
+
+/**
+ * @brief Create, list or extract a set of shards, in place of ctar_open(), ctar_create()... and ctar_close().
+ *
+ * @param args The arguments of the program.
+ * @param count The number of shards.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_shard_run(ctar_args *args, int count);
+
+#endif // _CTAR_SHARD_H_
@@ -0,0 +1,87 @@
+#ifndef _CTAR_SPARSE_H_
+#define _CTAR_SPARSE_H_
+
+#include "typedef.h"
+#include "ctar_pipeline.h"
+#include "ctar_reader.h"
+#include <sys/types.h>
+
+#define CTAR_SPARSE_DIR "GNUSparseFile.0"   // Represents the directory holding sparse files for readers not supporting them
+#define CTAR_SPARSE_RECORDS_SIZE 4096       // Represents the maximum size of the extended header of a sparse file
+#define CTAR_SPARSE_REGIONS_MAX 1048576     // Represents the maximum number of data regions of a sparse file read from an archive
+
+/** @brief Data region of a sparse file, the bytes between two regions are a hole */
+typedef struct ctar_sparse_region
+{
+  long offset;
+  long size;
+} ctar_sparse_region;
+
+/**
+ * @brief Map of the data regions of a regular file.
+ *
+ * A sparse file is stored in the GNU sparse format 1.0, a POSIX archive extension also read by GNU tar and bsdtar:
+ * - an extended header (XHDTYPE) gives its real name and size
+ * - it is followed by a regular header named CTAR_SPARSE_DIR/name, whose data starts with the map
+ *   (the number of regions, then the offset and size of each region, in decimal, one per line, padded to a block)
+ * - the data of the regions follows, one region after the other, without the holes
+ *
+ * Readers not supporting the format extract the data and the map as is, under CTAR_SPARSE_DIR.
+ */
+typedef struct ctar_sparse
+{
+  ctar_sparse_region *regions; // Sorted by offset
+  long count;
+  long capacity;
+  long size;   // Real size of the file
+  long stored; // Size of the data of the regions
+} ctar_sparse;
+
+/**
+ * @brief Find the data regions of a file being archived.
+ *
+ * @param sparse The map to fill, freed by ctar_sparse_free().
+ * @param fd The file descriptor of the file.
+ * @return int 1 if the file has holes, 0 if it does not (a single region covers the whole file), -1 on failure.
+ */
+int ctar_sparse_scan(ctar_sparse *sparse, int fd);
+
+/**
+ * @brief Append the headers and the map of a sparse file to the archive.
+ *
+ * @param sparse The map of the file.
+ * @param header The header of the file, renamed into CTAR_SPARSE_DIR and resized.
+ * @param out The pipeline of the archive.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_sparse_write_header(ctar_sparse *sparse, ctar_header *header, ctar_pipeline *out);
+
+/**
+ * @brief Get the real name and size of a sparse file from the records of an extended header.
+ *
+ * @param records The records of the extended header.
+ * @param size The size of the records.
+ * @param name Set to the real name of the file, CTAR_NAME_SIZE bytes.
+ * @param realsize Set to the real size of the file.
+ * @return int 1 if the records describe a sparse file in a supported format, 0 otherwise.
+ */
+int ctar_sparse_parse(const char *records, size_t size, char *name, long *realsize);
+
+/**
+ * @brief Read the map at the beginning of the data of a sparse file.
+ *
+ * @param sparse The map to fill, freed by ctar_sparse_free().
+ * @param in The reader of the archive, pointing to the beginning of the data.
+ * @param realsize The real size of the file, see ctar_reader::sparse_size.
+ * @return long the number of bytes read, -1 on failure.
+ */
+long ctar_sparse_read_map(ctar_sparse *sparse, ctar_reader *in, long realsize);
+
+/**
+ * @brief Free a map.
+ *
+ * @param sparse The map.
+ */
+void ctar_sparse_free(ctar_sparse *sparse);
+
+#endif // _CTAR_SPARSE_H_
@@ -0,0 +1,77 @@
+#ifndef _CTAR_SYNC_H_
+#define _CTAR_SYNC_H_
+
+#include "typedef.h"
+#include <sys/types.h>
+#include <pthread.h>
+
+#define CTAR_SYNC_BATCH_SIZE 67108864 // Represents the amount of data extracted between two sweeps of the batched policy
+#define CTAR_SYNC_BATCH_FILES 1024    // Represents the number of files extracted between two sweeps of the batched policy
+// The thresholds are fixed, and documented in the help of -S and in the README
+
+/** @brief Durability of the files being extracted */
+typedef struct ctar_sync
+{
+  ctar_sync_mode mode;
+  int fd;     // Directory extracted to, its file system is synced by syncfs()
+  long bytes; // Bytes extracted since the last sweep
+  long files; // Files extracted since the last sweep
+  long calls;   // Number of fsync(), sync_file_range() and syncfs() calls, see ctar_sync_report()
+  double wait;  // Seconds spent in these calls
+  double start; // Time the extraction started, in seconds
+  pthread_mutex_t lock; // Protects the counters, files may be extracted by several threads (see @ref ctar_jobs)
+} ctar_sync;
+
+/**
+ * @brief Get a durability policy from its name.
+ *
+ * @param name The name of the policy: none, per-file, batched or end.
+ * @return int the policy, -1 if the name is unknown.
+ */
+int ctar_sync_parse(const char *name);
+
+/**
+ * @brief Start following the files extracted to the current working directory.
+ *
+ * @param sync The durability to initialize.
+ * @param mode The durability policy.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_sync_open(ctar_sync *sync, ctar_sync_mode mode);
+
+/**
+ * @brief Make an extracted file durable according to the policy, before closing it.
+ *
+ * @param sync The durability.
+ * @param fd The file descriptor of the file.
+ * @param size The size of the file.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_sync_file(ctar_sync *sync, int fd, long size);
+
+/**
+ * @brief Account for a file whose writeback was already started (see ctar_uring_extract()).
+ *
+ * @param sync The durability.
+ * @param size The size of the file.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_sync_written(ctar_sync *sync, long size);
+
+/**
+ * @brief Make every extracted file durable, unless the policy is CTAR_SYNC_NONE.
+ *
+ * @param sync The durability, released even if unsuccessful.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_sync_close(ctar_sync *sync);
+
+/**
+ * @brief Print the cost of the policy on the standard error: the number of sync calls and the time spent in them,
+ * out of the time spent extracting. The calls submitted through io_uring are not counted (see @ref ctar_uring).
+ *
+ * @param sync The durability, after ctar_sync_close().
+ */
+void ctar_sync_report(ctar_sync *sync);
+
+#endif // _CTAR_SYNC_H_
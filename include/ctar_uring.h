@@ -0,0 +1,56 @@
+#ifndef _CTAR_URING_H_
+#define _CTAR_URING_H_
+
+#include "typedef.h"
+#include "ctar_reader.h"
+#include "ctar_dcache.h"
+
+#define CTAR_URING_DEPTH 64         // Represents the number of regular files being extracted at once
+#define CTAR_URING_FILE_SIZE 65536  // Represents the size up to which regular files are extracted through io_uring
+
+/**
+ * @brief Extraction engine batching the opening, writing and closing of small regular files with io_uring.
+ *
+ * Only available if ctar was built with liburing (`make URING=1`).
+ */
+typedef struct ctar_uring ctar_uring;
+
+/**
+ * @brief Start an extraction engine.
+ *
+ * @param sync_mode The durability policy of the extracted files, see @ref ctar_sync.
+ * @return ctar_uring* the engine, NULL if io_uring is not available (extract with blocking syscalls instead).
+ */
+ctar_uring *ctar_uring_new(ctar_sync_mode sync_mode);
+
+/**
+ * @brief Wait for the files being extracted if one of them has the name of an entry,
+ * so that entries are extracted in the order of the archive.
+ *
+ * @param uring The engine.
+ * @param header The header of the entry.
+ * @return int 0 if successful, -1 if a file could not be extracted.
+ */
+int ctar_uring_wait_name(ctar_uring *uring, ctar_header *header);
+
+/**
+ * @brief Queue the extraction of a regular file of at most CTAR_URING_FILE_SIZE bytes.
+ *
+ * @param uring The engine.
+ * @param dirs The directories kept open by the calling thread, to create the parent directory.
+ * @param header The header of the entry.
+ * @param in The reader of the archive, pointing to the beginning of the data.
+ * The data of a mapped archive is written from the mapping, which must outlive the engine.
+ * @return int 0 if successful, -1 if this file or a previous one could not be extracted.
+ */
+int ctar_uring_extract(ctar_uring *uring, ctar_dcache *dirs, ctar_header *header, ctar_reader *in);
+
+/**
+ * @brief Wait for the files being extracted and stop an engine.
+ *
+ * @param uring The engine, may be NULL.
+ * @return int 0 if every file was extracted, -1 otherwise.
+ */
+int ctar_uring_finish(ctar_uring *uring);
+
+#endif // _CTAR_URING_H_
@@ -0,0 +1,71 @@
+#ifndef _CTAR_WALK_H_
+#define _CTAR_WALK_H_
+
+#include "typedef.h"
+#include <sys/stat.h>
+
+#define CTAR_WALK_AHEAD 256          // Represents the number of entries walked ahead of the archive writer
+#define CTAR_WALK_READAHEAD 1048576  // Represents how much of each regular file walked ahead is read ahead
+#define CTAR_WALK_PATH_SIZE (CTAR_NAME_SIZE + NAME_MAX + 2) // Represents the size of a path, or of a path too long to be archived
+
+/** @brief Kinds of the entries of a walk */
+typedef enum ctar_walk_kind
+{
+  CTAR_WALK_FILE,     // A file to archive
+  CTAR_WALK_TOO_LONG, // A file whose path is too long to be archived
+  CTAR_WALK_ERROR,    // A directory that could not be opened or read
+  CTAR_WALK_END,      // The end of the walk
+} ctar_walk_kind;
+
+/** @brief File met by a walk, in the order of a recursive walk of the files to archive */
+typedef struct ctar_walk_entry
+{
+  ctar_walk_kind kind;
+  bool ready;                     // Whether the file was stat'ed
+  char path[CTAR_WALK_PATH_SIZE];
+  const char *name;               // Name of the file in its directory, in path
+  struct ctar_walk_dir *dir;      // Directory of the file until it is stat'ed, NULL for the files given by the user
+  int err;                        // errno of the status of a file, or of an error, 0 otherwise
+  const char *message;            // Message of an error
+  struct stat st;
+  int fd;                         // Regular file opened and read ahead, -1 if it could not be opened
+} ctar_walk_entry;
+
+/**
+ * @brief Walk of the files to archive, ahead of the thread writing the archive.
+ *
+ * A listing thread walks the directories in the order ctar_create_directory() does (see @ref ctar_dir),
+ * and args->jobs threads stat the files listed relative to their directory, open the regular ones and read their beginning ahead,
+ * so that many files are stat'ed and read from the disk at once. The entries are handed to the
+ * writer in the order of the listing, so the archive is the same as without walking ahead.
+ */
+typedef struct ctar_walk ctar_walk;
+
+/**
+ * @brief Start walking the files to archive.
+ *
+ * @param args The arguments of the program, with the files to archive, which must outlive the walk.
+ * @return ctar_walk* the walk, NULL on failure.
+ */
+ctar_walk *ctar_walk_start(ctar_args *args);
+
+/**
+ * @brief Get the next file to archive, and release the previous one.
+ *
+ * Warnings and errors met by the walk are printed in order.
+ *
+ * @param walk The walk.
+ * @param entry Set to the next file to archive, valid until the next call.
+ * The caller takes ownership of its file descriptor.
+ * @return int 1 if a file was returned, 0 at the end of the walk, -1 on failure.
+ */
+int ctar_walk_next(ctar_walk *walk, ctar_walk_entry **entry);
+
+/**
+ * @brief Stop a walk and free it, even if it did not reach its end.
+ *
+ * @param walk The walk.
+ */
+void ctar_walk_stop(ctar_walk *walk);
+
+#endif // _CTAR_WALK_H_
@@ -2,26 +2,50 @@
 #define _CTAR_ZLIB_H_
 
 #include "typedef.h"
+#include "ctar_adapt.h"
 #include <zlib.h>
 
 #define CTAR_ZLIB_CHUNK 16384 // Represents the size of the buffer used to read/write data
+#define CTAR_ZLIB_MAX_LEVEL 9 // Represents the highest gzip compression level
 
 /**
- * @brief Compress from fd_in into path.
+ * @brief Compress from fd_in into fd_out.
  * 
- * @param path The path of the compressed file to create.
+ * @param fd_out The file descriptor of the compressed file to write.
  * @param fd_in The file descriptor of the uncompressed file.
+ * @param level The compression level, -1 for the default one.
+ * @param adapt The compression levels chosen per entry, NULL to compress everything at level.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_compress(char *path, int fd_in);
+int ctar_compress(int fd_out, int fd_in, int level, ctar_adapt *adapt);
 
 /**
- * @brief Decompress from path into fd_out.
+ * @brief Decompress from fd_in into fd_out.
  * 
- * @param path The path of the compressed file to decompress.
+ * @param fd_in The file descriptor of the compressed file to decompress.
  * @param fd_out The file descriptor of the uncompressed file.
  * @return int 0 if successful, -1 otherwise.
  */
-int ctar_decompress(char *path, int fd_out);
+int ctar_decompress(int fd_in, int fd_out);
 
-#endif // _CTAR_ZLIB_H_
\ No newline at end of file
+/**
+ * @brief Compress from fd_in into fd_out in gzip format, see @ref ctar_codec.
+ *
+ * @param fd_out The file descriptor of the compressed file to write.
+ * @param fd_in The file descriptor of the uncompressed file.
+ * @param args The arguments of the program.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_gzip_compress(int fd_out, int fd_in, ctar_args *args);
+
+/**
+ * @brief Decompress from fd_in into fd_out in gzip format, see @ref ctar_codec.
+ *
+ * @param fd_in The file descriptor of the compressed file to decompress.
+ * @param fd_out The file descriptor of the uncompressed file.
+ * @param args The arguments of the program.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_gzip_decompress(int fd_in, int fd_out, ctar_args *args);
+
+#endif // _CTAR_ZLIB_H_
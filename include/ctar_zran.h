@@ -0,0 +1,76 @@
+#ifndef _CTAR_ZRAN_H_
+#define _CTAR_ZRAN_H_
+
+#include "typedef.h"
+#include <stdint.h>
+#include <zlib.h>
+
+#define CTAR_ZRAN_SUFFIX ".ctaridx"  // Represents the suffix added to the archive path to get its checkpoint index
+#define CTAR_ZRAN_MAGIC "CTARIDX2"   // Represents the first bytes of a checkpoint index
+#define CTAR_ZRAN_HEADER_SIZE 48     // Represents the size of the header of a checkpoint index
+#define CTAR_ZRAN_WINSIZE 32768      // Represents the size of the inflate window saved at each checkpoint
+#define CTAR_ZRAN_META_SIZE 17       // Represents the size of a checkpoint without its window
+#define CTAR_ZRAN_UNKNOWN UINT64_MAX // Represents the size of an archive read from a pipe
+
+/** @brief Position in a gzip stream from which inflate can be resumed */
+typedef struct ctar_zran_checkpoint
+{
+  uint64_t in;     // Offset of the first full byte to inflate in the archive
+  uint8_t bits;    // Number of bits of the previous byte to inflate
+  uint64_t out;    // Offset in the uncompressed archive
+} ctar_zran_checkpoint;
+
+/** @brief Location of an entry in the uncompressed archive */
+typedef struct ctar_zran_entry
+{
+  uint64_t offset;
+  char name[CTAR_NAME_SIZE + 1];
+} ctar_zran_entry;
+
+/** @brief Checkpoints and entries of a gzip compressed archive */
+typedef struct ctar_zran_index
+{
+  ctar_zran_checkpoint *checkpoints;
+  size_t ncheckpoints;
+  size_t checkpoints_capacity;
+  ctar_zran_entry *entries;
+  size_t nentries;
+  size_t entries_capacity;
+  uint64_t size;    // Size of the archive the index was built from
+  uint64_t mtime;   // Modification time of the archive, in nanoseconds
+  uint64_t trailer; // Last 8 bytes of the archive, the CRC-32 and size of its last gzip member
+} ctar_zran_index;
+
+/**
+ * @brief Open the checkpoint index of args->archive into args->index_fd, before the current working directory changes.
+ *
+ * The index is created if args->index_span is set, and opened to be used if files are selected.
+ *
+ * @param args The arguments of the program.
+ * @return int 0 if successful (args->index_fd being -1 if there is no index to use), -1 if the index cannot be created.
+ */
+int ctar_zran_open(ctar_args *args);
+
+/**
+ * @brief Decompress from fd_in into fd_out, writing a checkpoint index of fd_in to fd_idx.
+ *
+ * @param fd_in The file descriptor of the compressed archive.
+ * @param fd_out The file descriptor of the uncompressed archive.
+ * @param span The number of uncompressed bytes between two checkpoints.
+ * @param fd_idx The file descriptor of the checkpoint index to write, see ctar_zran_open().
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_zran_build(int fd_in, int fd_out, long span, int fd_idx);
+
+/**
+ * @brief Decompress only the entries of fd_in selected by files into fd_out, using the checkpoint index fd_idx.
+ *
+ * @param fd_in The file descriptor of the compressed archive.
+ * @param fd_out The file descriptor of the uncompressed archive.
+ * @param files The selected files, see is_selected().
+ * @param fd_idx The file descriptor of the checkpoint index created by ctar_zran_build(), see ctar_zran_open().
+ * @return int 0 if successful, 1 if there is no checkpoint index or if it was built from another archive, -1 otherwise.
+ */
+int ctar_zran_decompress(int fd_in, int fd_out, char **files, int fd_idx);
+
+#endif // _CTAR_ZRAN_H_
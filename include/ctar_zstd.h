@@ -0,0 +1,32 @@
+#ifndef _CTAR_ZSTD_H_
+#define _CTAR_ZSTD_H_
+
+#include "typedef.h"
+
+#ifdef CTAR_ZSTD
+
+#define CTAR_ZSTD_MAX_LEVEL 19 // Represents the highest zstd compression level without --ultra
+
+/**
+ * @brief Compress from fd_in into fd_out in zstd format, see @ref ctar_codec.
+ *
+ * @param fd_out The file descriptor of the compressed file to write.
+ * @param fd_in The file descriptor of the uncompressed file.
+ * @param args The arguments of the program.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_zstd_compress(int fd_out, int fd_in, ctar_args *args);
+
+/**
+ * @brief Decompress from fd_in into fd_out in zstd format, see @ref ctar_codec.
+ *
+ * @param fd_in The file descriptor of the compressed file to decompress.
+ * @param fd_out The file descriptor of the uncompressed file.
+ * @param args The arguments of the program.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int ctar_zstd_decompress(int fd_in, int fd_out, ctar_args *args);
+
+#endif // CTAR_ZSTD
+
+#endif // _CTAR_ZSTD_H_
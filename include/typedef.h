@@ -4,9 +4,17 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <linux/limits.h>
+#include <pthread.h>
 
 #define CTAR_ARGS_ARCHIVE_SIZE PATH_MAX
 #define CTAR_ARGS_DIR_SIZE PATH_MAX
+#define CTAR_ARGS_STDIO "-" // Represents the archive name of the standard input or output
+#define CTAR_ARGS_RECORD_SIZE 1048576        // Represents the default size of the records copying entry data
+#define CTAR_ARGS_RECORD_SIZE_MAX 1073741824 // Represents the maximum size of the records copying entry data
+#define CTAR_ARGS_THREADS_MAX 1024           // Represents the maximum number of threads of -t and -j
+#define CTAR_ARGS_SPAN_MAX 1048576           // Represents the maximum number of MiB of -s and -i, so that the size in bytes fits in a long
+#define CTAR_DIRECT_ALIGN 4096            // Represents the alignment of the buffers, offsets and sizes of direct I/O
+#define CTAR_DIRECT_BUFFER_SIZE 4194304   // Represents the minimum size of the buffers reading or writing an archive with direct I/O
 
 #define CTAR_NAME_SIZE 100
 #define CTAR_MODE_SIZE 8
@@ -36,6 +44,23 @@
 #define DIRTYPE  '5'            /* directory */
 #define FIFOTYPE '6'            /* FIFO special */
 #define CONTTYPE '7'            /* reserved */
+#define XHDTYPE  'x'            /* extended header (POSIX.1-2001) */
+
+/** @brief Compression formats, see @ref ctar_codec */
+typedef enum ctar_codec_id
+{
+  CTAR_CODEC_GZIP,
+  CTAR_CODEC_ZSTD,
+} ctar_codec_id;
+
+/** @brief Durability policies of the extracted files, see @ref ctar_sync */
+typedef enum ctar_sync_mode
+{
+  CTAR_SYNC_NONE,    // Never sync, the kernel writes the files back when it sees fit
+  CTAR_SYNC_FILE,    // fsync() each file before closing it
+  CTAR_SYNC_BATCHED, // Start the writeback of each file once written, and wait for it every few files
+  CTAR_SYNC_END,     // Sync the whole file system once, at the end of the extraction
+} ctar_sync_mode;
 
 /** @brief Default values for @ref ctar_args */
 #define CTAR_ARGS_INIT \
@@ -46,7 +71,29 @@
     .create = false,   \
     .compress = false, \
     .verbose = false,  \
+    .codec = CTAR_CODEC_GZIP, \
+    .level = -1,       \
+    .threads = 1,      \
+    .jobs = 1,         \
+    .member_size = 0,  \
+    .index_span = 0,   \
+    .index_fd = -1,    \
+    .record_size = CTAR_ARGS_RECORD_SIZE, \
+    .drop_cache = false, \
+    .direct_io = false, \
+    .sync_mode = CTAR_SYNC_NONE, \
+    .inode_order = false, \
+    .shards = 1,       \
+    .recursive = true, \
+    .list_dirs = true, \
     .files = NULL,     \
+    .stream = false,   \
+    .adapt = NULL,     \
+    .uring = NULL,     \
+    .workers = NULL,   \
+    .walk = NULL,      \
+    .sync = NULL,      \
+    .dirs = NULL,      \
   }
 
 /** @brief Binary options structure */
@@ -57,9 +104,32 @@ typedef struct ctar_args
   bool create;
   bool compress;
   bool verbose;
+  ctar_codec_id codec; // Compression format used when compress is set
+  int level; // Compression level, -1 for the default level of the codec
+  int threads; // Number of compression threads
+  int jobs; // Number of threads extracting regular files
+  long member_size; // Uncompressed size of the gzip members of a seekable archive, 0 if not seekable
+  long index_span; // Uncompressed size between two checkpoints of the index to build, 0 to not build one
+  int index_fd; // Checkpoint index of the archive opened by ctar_open(), to build or to use, -1 if none
+  long record_size; // Size of the records copying entry data to and from the archive, a multiple of CTAR_BLOCK_SIZE
+  bool drop_cache; // Whether to drop the data of the archive and of the files from the page cache once read or written
+  bool direct_io; // Whether to read or write the archive with O_DIRECT, bypassing the page cache
+  ctar_sync_mode sync_mode; // Durability policy of the extracted files
+  bool inode_order; // Whether to add the files of each directory in the order of their inode numbers
+  int shards; // Number of archives the files are split into when creating, see @ref ctar_shard
+  bool recursive; // Whether the directories to archive are added with the files inside them
+  bool list_dirs; // Whether the directories are listed, false for the shards repeating the directories of the first one
   char **files;
   char archive[CTAR_ARGS_ARCHIVE_SIZE];
   char dir[CTAR_ARGS_DIR_SIZE];
+  bool stream; // Whether ctar_open() started stream_thread
+  pthread_t stream_thread; // (De)compression thread started by ctar_open()
+  struct ctar_adapt *adapt; // Compression levels chosen per entry, NULL to compress everything at level
+  struct ctar_uring *uring; // Engine extracting small regular files in batches, NULL to extract with blocking syscalls
+  struct ctar_jobs *workers; // Threads extracting regular files in parallel, NULL to extract them one at a time
+  struct ctar_walk *walk; // Threads walking the files to archive ahead of the archive writer, NULL to walk them recursively
+  struct ctar_sync *sync; // Durability of the files being extracted
+  struct ctar_dcache *dirs; // Directories of the files being extracted by this thread, kept open
 } ctar_args;
 
 #define CTAR_HEADER_INIT   \
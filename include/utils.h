@@ -3,24 +3,35 @@
 
 #include "typedef.h"
 #include <sys/types.h>
+#include <stdint.h>
+
+#define CTAR_PASSWD_BUF_SIZE 4096 // Represents the size of the buffer of a user or group database entry
 
 /**
- * @brief Convert an octal string to a decimal integer.
+ * @brief Convert an octal string (or a base-256 field) to a decimal integer.
  *
  * @param oct The octal string.
  * @param size The size of the string,
- * @return int The decimal integer.
+ * @return long long The decimal integer.
  */
-int oct2dec(char *oct, int size);
+long long oct2dec(char *oct, int size);
 
 /**
- * @brief Convert a decimal integer to an octal string.
+ * @brief Parse a strictly positive decimal integer.
+ *
+ * @param str The string to parse.
+ * @return long The integer, -1 if str is not a strictly positive integer.
+ */
+long parse_positive(char *str);
+
+/**
+ * @brief Convert a decimal integer to an octal string, or to a base-256 field if it is too large.
  *
  * @param dec The decimal integer.
  * @param oct The octal output string.
  * @param size The size of the string.
  */
-void dec2oct(int dec, char *oct, int size);
+void dec2oct(long long dec, char *oct, int size);
 
 /**
  * @brief Check if a header is blank.
@@ -31,6 +42,39 @@ void dec2oct(int dec, char *oct, int size);
  */
 bool is_header_blank(ctar_header *header);
 
+/**
+ * @brief Check if an entry is selected by the files given on the command line.
+ *
+ * @param name The name of the entry.
+ * @param files The selected files, NULL to select every entry.
+ * @return true If the entry is one of files or lies in one of them.
+ * @return false If the entry is not selected.
+ */
+bool is_selected(char *name, char **files);
+
+/**
+ * @brief Check if the entry of a header is selected by the files given on the command line.
+ *
+ * @param header The header of the entry.
+ * @param files The selected files, NULL to select every entry.
+ * @return true If the entry is selected, see is_selected().
+ * @return false If the entry is not selected.
+ */
+bool is_header_selected(ctar_header *header, char **files);
+
+/**
+ * @brief Check if an entry of an archive index is selected, including the two entries of a sparse file.
+ *
+ * The extended header and the data of a sparse file are stored as DIR/PaxHeaders/NAME and DIR/GNUSparseFile.0/NAME
+ * (or with a process id, by GNU tar), both selected by DIR/NAME.
+ *
+ * @param name The name of the entry.
+ * @param files The selected files, NULL to select every entry.
+ * @return true If the entry is selected, see is_selected().
+ * @return false If the entry is not selected.
+ */
+bool is_name_selected(char *name, char **files);
+
 /**
  * @brief Recursively create a directory.
  *
@@ -49,13 +93,84 @@ int mkdir_recursive(char *path, mode_t mode);
  */
 int skip_data_blocks(int fd, ctar_header *header);
 
+/**
+ * @brief Read exactly count bytes unless end of file is reached.
+ *
+ * @param fd The file descriptor to read from.
+ * @param buf The output buffer.
+ * @param count The number of bytes to read.
+ * @return ssize_t The number of bytes read (less than count only at end of file), -1 on failure.
+ */
+ssize_t read_full(int fd, void *buf, size_t count);
+
+/**
+ * @brief Write exactly count bytes, retrying after partial writes.
+ *
+ * @param fd The file descriptor to write to.
+ * @param buf The input buffer.
+ * @param count The number of bytes to write.
+ * @return int 0 on success, -1 on failure.
+ */
+int write_full(int fd, const void *buf, size_t count);
+
+/**
+ * @brief Copy bytes between file descriptors in the kernel, without going through user space.
+ *
+ * @param fd_in The file descriptor to read from, at its current offset.
+ * @param fd_out The file descriptor to write to, at its current offset.
+ * @param size The number of bytes to copy.
+ * @return long The number of bytes copied (less than size at end of file or if the kernel
+ * cannot copy between these files), -1 on failure.
+ */
+long copy_in_kernel(int fd_in, int fd_out, long size);
+
+/**
+ * @brief Stop using direct I/O on a file whose file system rejected it.
+ *
+ * @param fd The file descriptor, whose last read or write failed.
+ * @return int 0 if O_DIRECT was cleared so the I/O can be retried, -1 otherwise (errno is left untouched).
+ */
+int clear_direct_io(int fd);
+
+/**
+ * @brief Store a 64 bits integer in little endian order.
+ *
+ * @param buf The 8 bytes output buffer.
+ * @param value The integer to store.
+ */
+void put_le64(unsigned char *buf, uint64_t value);
+
+/**
+ * @brief Load a 64 bits integer stored in little endian order.
+ *
+ * @param buf The 8 bytes input buffer.
+ * @return uint64_t The integer.
+ */
+uint64_t get_le64(unsigned char *buf);
+
 /**
  * @brief Get the number of data blocks of a header.
  *
  * @param header The header to get the number of data blocks of.
- * @return int The number of data blocks.
+ * @return long long The number of data blocks.
  */
-int get_nblocks(ctar_header *header);
+long long get_nblocks(ctar_header *header);
+
+/**
+ * @brief Get the name of a user, remembering the last one found by the calling thread.
+ *
+ * @param uid The user ID.
+ * @return const char* The name of the user, valid until the next call of the thread, NULL if not found.
+ */
+const char *get_user_name(uid_t uid);
+
+/**
+ * @brief Get the name of a group, remembering the last one found by the calling thread.
+ *
+ * @param gid The group ID.
+ * @return const char* The name of the group, valid until the next call of the thread, NULL if not found.
+ */
+const char *get_group_name(gid_t gid);
 
 /**
  * @brief Compute the checksum of a header.
@@ -74,11 +189,4 @@ void compute_checksum(ctar_header *header);
  */
 bool is_checksum_valid(ctar_header *header);
 
-/**
- * @brief Create a temporary file.
- *
- * @return int The file descriptor of the temporary file.
- */
-int ctar_mkstemp();
-
 #endif // _UTILS_H
\ No newline at end of file
@@ -2,7 +2,13 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include "argparse.h"
+#include "utils.h"
+#include "ctar_zran.h"
+#include "ctar_codec.h"
+#include "ctar_sync.h"
+#include "ctar_shard.h"
 
 /**
  * @brief Binary options declaration
@@ -18,6 +24,18 @@ static const struct option options[] =
         {"create", required_argument, NULL, 'c'},
         {"directory", required_argument, NULL, 'd'},
         {"compress", no_argument, NULL, 'z'},
+        {"zstd", no_argument, NULL, 'Z'},
+        {"level", required_argument, NULL, 'L'},
+        {"threads", required_argument, NULL, 't'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"seekable", required_argument, NULL, 's'},
+        {"build-index", required_argument, NULL, 'i'},
+        {"record-size", required_argument, NULL, 'b'},
+        {"drop-cache", no_argument, NULL, 'D'},
+        {"direct-io", no_argument, NULL, 'o'},
+        {"sync", required_argument, NULL, 'S'},
+        {"inode-order", no_argument, NULL, 'O'},
+        {"shards", required_argument, NULL, 'n'},
         {"verbose", no_argument, NULL, 'v'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}};
@@ -28,20 +46,32 @@ static const struct option options[] =
  *
  * @see man 3 getopt_long or getopt
  */
-static const char *optstr = "l:e:c:d:zvh";
+static const char *optstr = "l:e:c:d:zZL:t:j:s:i:b:S:n:DoOvh";
 
 void print_usage(char *bin_name)
 {
-  char *syntax = "{-l|-e|-c} ARCHIVE [-d DIR] [-zvh] [FILES...]";
+  char *syntax = "{-l|-e|-c} ARCHIVE [-d DIR] [-L N] [-t N] [-j N] [-s N] [-i N] [-b N] [-S MODE] [-n N] [-zZDoOvh] [FILES...]";
   char *params = "  -l, --list: List files in archive\n"
                  "  -e, --extract: Extract files from archive\n"
                  "  -c, --create: Create archive\n"
                  "  -d, --directory DIR: Change to DIR before performing any operations.\n"
-                 "  -z, --compress: Compress or decompress the archive using gzip\n"
+                 "  -z, --compress: Compress the archive using gzip (compressed archives are detected when reading)\n"
+                 "  -Z, --zstd: Compress the archive using zstd\n"
+                 "  -L, --level N: Compress the archive at level N (default: codec default)\n"
+                 "  -t, --threads N: Compress the archive, or decompress its gzip members, using N threads (default: 1)\n"
+                 "  -j, --jobs N: Extract regular files, or stat and read ahead the files to add, using N threads (default: 1)\n"
+                 "  -s, --seekable N: Compress the archive in gzip members of about N MiB, with an index of the entries\n"
+                 "  -i, --build-index N: While decompressing, write ARCHIVE" CTAR_ZRAN_SUFFIX " with a checkpoint every N MiB\n"
+                 "  -b, --record-size N: Copy entry data to and from the archive in records of N KiB (default: 1024)\n"
+                 "  -D, --drop-cache: Drop the data of the archive and of the files from the page cache once read or written\n"
+                 "  -o, --direct-io: Read or write the archive with direct I/O, bypassing the page cache (uncompressed archives)\n"
+                 "  -S, --sync MODE: Make extracted files durable: none (default), per-file, batched (syncfs every 64 MiB or 1024 files) or end\n"
+                 "  -O, --inode-order: Add the files of each directory in the order of their inode numbers\n"
+                 "  -n, --shards N: Split the files into N archives ARCHIVE.0 to ARCHIVE.N-1 written in parallel, ARCHIVE listing them\n"
                  "  -v, --verbose: enable verbose mode\n"
                  "  -h, --help: display this help\n"
-                 "  ARCHIVE: archive file\n"
-                 "  FILES: files to be added to the archive\n";
+                 "  ARCHIVE: archive file, - for the standard input or output\n"
+                 "  FILES: files to be added to the archive, or to be listed or extracted from it\n";
   printf("USAGE: %s %s\n%s", bin_name, syntax, params);
 }
 
@@ -50,6 +80,15 @@ void print_usage(char *bin_name)
  * - the user specifies more than one of -l, -e, -c
  * - the user specifies -c without specifying any files
  * - the user specifies an invalid option
+ * - the user specifies an invalid number of threads, or more than CTAR_ARGS_THREADS_MAX
+ * - the user specifies an invalid number of extraction threads, or more than CTAR_ARGS_THREADS_MAX
+ * - the user specifies an invalid member size, or more than CTAR_ARGS_SPAN_MAX MiB
+ * - the user specifies an invalid checkpoint span, or more than CTAR_ARGS_SPAN_MAX MiB
+ * - the user specifies an invalid record size
+ * - the user specifies an unknown durability policy
+ * - the user specifies an invalid number of shards, or shards of the standard output
+ * - the user specifies a compression level without -z or -Z, or a level or format not supported by the codec
+ * - the user asks for a checkpoint index of the standard input
  * 
  * @note If the user specifies -h (or --help), the function prints the usage and exits with EXIT_SUCCESS.
  */
@@ -79,6 +118,105 @@ int parse_args(int argc, char **argv, ctar_args *args)
       break;
     case 'z':
       args->compress = true;
+      args->codec = CTAR_CODEC_GZIP;
+      break;
+    case 'Z':
+      args->compress = true;
+      args->codec = CTAR_CODEC_ZSTD;
+      break;
+    case 'L':
+    {
+      char *end;
+      errno = 0;
+      long level = strtol(optarg, &end, 10);
+      if (errno != 0 || end == optarg || *end != '\0' || level < 0 || level > INT_MAX)
+      {
+        fprintf(stderr, "Invalid compression level '%s'.\n", optarg);
+        return -1;
+      }
+      args->level = level;
+      break;
+    }
+    case 't':
+    {
+      // Checked before being narrowed to an int
+      long threads = parse_positive(optarg);
+      if (threads == -1 || threads > CTAR_ARGS_THREADS_MAX)
+      {
+        fprintf(stderr, "Invalid number of threads '%s' (at most %d).\n", optarg, CTAR_ARGS_THREADS_MAX);
+        return -1;
+      }
+      args->threads = threads;
+      break;
+    }
+    case 'j':
+    {
+      long jobs = parse_positive(optarg);
+      if (jobs == -1 || jobs > CTAR_ARGS_THREADS_MAX)
+      {
+        fprintf(stderr, "Invalid number of extraction threads '%s' (at most %d).\n", optarg, CTAR_ARGS_THREADS_MAX);
+        return -1;
+      }
+      args->jobs = jobs;
+      break;
+    }
+    case 's':
+      args->member_size = parse_positive(optarg);
+      if (args->member_size == -1 || args->member_size > CTAR_ARGS_SPAN_MAX)
+      {
+        fprintf(stderr, "Invalid member size '%s' (at most %d MiB).\n", optarg, CTAR_ARGS_SPAN_MAX);
+        return -1;
+      }
+      args->member_size *= 1024 * 1024;
+      break;
+    case 'i':
+      args->index_span = parse_positive(optarg);
+      if (args->index_span == -1 || args->index_span > CTAR_ARGS_SPAN_MAX)
+      {
+        fprintf(stderr, "Invalid checkpoint span '%s' (at most %d MiB).\n", optarg, CTAR_ARGS_SPAN_MAX);
+        return -1;
+      }
+      args->index_span *= 1024 * 1024;
+      break;
+    case 'b':
+      args->record_size = parse_positive(optarg);
+      if (args->record_size == -1 || args->record_size > CTAR_ARGS_RECORD_SIZE_MAX / 1024)
+      {
+        fprintf(stderr, "Invalid record size '%s'.\n", optarg);
+        return -1;
+      }
+      args->record_size *= 1024;
+      break;
+    case 'S':
+    {
+      int mode = ctar_sync_parse(optarg);
+      if (mode == -1)
+      {
+        fprintf(stderr, "Invalid durability policy '%s'.\n", optarg);
+        return -1;
+      }
+      args->sync_mode = mode;
+      break;
+    }
+    case 'n':
+    {
+      long shards = parse_positive(optarg);
+      if (shards == -1 || shards > CTAR_SHARD_MAX)
+      {
+        fprintf(stderr, "Invalid number of shards '%s' (at most %d).\n", optarg, CTAR_SHARD_MAX);
+        return -1;
+      }
+      args->shards = shards;
+      break;
+    }
+    case 'D':
+      args->drop_cache = true;
+      break;
+    case 'o':
+      args->direct_io = true;
+      break;
+    case 'O':
+      args->inode_order = true;
       break;
     case 'v':
       args->verbose = true;
@@ -97,11 +235,51 @@ int parse_args(int argc, char **argv, ctar_args *args)
     return -1;
   }
 
+  if (args->level != -1 && !args->compress)
+  {
+    fprintf(stderr, "A compression level requires -z or -Z.\n");
+    return -1;
+  }
+
+  if (args->compress)
+  {
+    const ctar_codec *codec = ctar_codec_get(args->codec);
+    if (codec == NULL)
+    {
+      fprintf(stderr, "This compression format is not supported by this build of ctar.\n");
+      return -1;
+    }
+
+    if (args->level > codec->max_level)
+    {
+      fprintf(stderr, "Compression level must be at most %d with %s.\n", codec->max_level, codec->name);
+      return -1;
+    }
+
+    if (args->codec != CTAR_CODEC_GZIP && args->member_size > 0)
+    {
+      fprintf(stderr, "Seekable archives are only supported with gzip.\n");
+      return -1;
+    }
+  }
+
   if (argc > optind)
   {
     args->files = argv + optind;
   }
 
+  if (args->index_span > 0 && strcmp(args->archive, CTAR_ARGS_STDIO) == 0)
+  {
+    fprintf(stderr, "Cannot write a checkpoint index next to the standard input.\n");
+    return -1;
+  }
+
+  if (args->shards > 1 && strcmp(args->archive, CTAR_ARGS_STDIO) == 0)
+  {
+    fprintf(stderr, "Cannot write shards to the standard output.\n");
+    return -1;
+  }
+
   if (args->create && args->files == NULL)
   {
     fprintf(stderr, "Cowardly refusing to create an empty archive.\n");
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // fallocate()
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -6,103 +7,180 @@
 #include <fcntl.h>
 #include <time.h>
 #include <string.h>
-#include <libgen.h>
+#include <errno.h>
 #include <dirent.h>
-#include <pwd.h>
-#include <grp.h>
 #include <linux/limits.h>
 #include "ctar.h"
-#include "ctar_zlib.h"
+#include "ctar_codec.h"
+#include "ctar_adapt.h"
+#include "ctar_pipeline.h"
+#include "ctar_reader.h"
+#include "ctar_cache.h"
+#include "ctar_dir.h"
+#include "ctar_jobs.h"
+#include "ctar_sparse.h"
+#include "ctar_sync.h"
+#include "ctar_uring.h"
+#include "ctar_walk.h"
 #include "utils.h"
 
+/**
+ * @brief Switch an archive to direct I/O (see ctar_args::direct_io).
+ *
+ * Only uncompressed archive files can be, the codecs and pipes read and write unaligned buffers.
+ * The archive is read or written through the page cache otherwise, or if its file system rejects O_DIRECT.
+ */
+static void ctar_open_direct(ctar_args *args, int fd)
+{
+  struct stat st;
+  if (args->compress || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+  {
+    fprintf(stderr, "Warning: direct I/O is only used for uncompressed archive files\n");
+    return;
+  }
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1)
+  {
+    fprintf(stderr, "Warning: direct I/O is not supported by the file system of the archive, using the page cache\n");
+  }
+}
+
 /**
  * If args->list or args->extract is true, the archive is opened in read-only mode.
  * Otherwise, the archive is opened in write-only mode.
+ * If args->archive is CTAR_ARGS_STDIO, the standard input or output is used instead.
+ *
+ * When reading, the compression format is detected from the magic bytes of the archive,
+ * so compressed archives are decompressed even without args->compress.
+ * If the archive is not seekable, these bytes are consumed, so the archive is read
+ * through a stream thread replaying them.
+ *
+ * O_DIRECT is only set once the compression format is known, the magic bytes being read unaligned.
  */
 int ctar_open(ctar_args *args)
 {
-  if (args->compress && args->create)
+  int fd;
+  if (strcmp(args->archive, CTAR_ARGS_STDIO) == 0 && args->create)
   {
-    // Create a tmp file to work on
-    return ctar_mkstemp();
+    // Messages go to the standard error, so that they do not mix with the archive
+    fd = dup(STDOUT_FILENO);
+    if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+    {
+      perror("Unable to use standard output");
+      return -1;
+    }
   }
-
-  if (args->compress && (args->list || args->extract))
+  else if (strcmp(args->archive, CTAR_ARGS_STDIO) == 0)
   {
-    // Create a tmp file to work on
-    int tmp_fd = ctar_mkstemp();
-    if (tmp_fd == -1)
+    fd = STDIN_FILENO;
+  }
+  else
+  {
+    int flags = args->list || args->extract ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+    fd = open(args->archive, flags, 0644);
+    if (fd == -1)
     {
+      perror("Unable to open archive");
       return -1;
     }
+  }
 
-    // Decompress archive into the tmp file
-    if (ctar_decompress(args->archive, tmp_fd) == -1)
+  if (args->create)
+  {
+    if (args->direct_io)
     {
-      return -1;
+      ctar_open_direct(args, fd);
     }
 
-    return tmp_fd;
+    // Compress on the fly into the archive
+    return args->compress ? ctar_compress_stream(args, fd) : fd;
   }
 
-  int flags = args->list || args->extract ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
-  int fd = open(args->archive, flags, 0644);
-  if (fd == -1)
+  unsigned char magic[CTAR_CODEC_MAGIC_SIZE];
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  ssize_t nbytes = offset == -1 ? read_full(fd, magic, sizeof(magic)) : pread(fd, magic, sizeof(magic), offset);
+  if (nbytes == -1)
   {
-    perror("Unable to open archive");
+    perror("Unable to read archive");
+    close(fd);
     return -1;
   }
 
-  return fd;
-}
+  // Like gzip, an uncompressed archive is read as is
+  const ctar_codec *codec = ctar_codec_detect(magic, nbytes);
+  args->compress = codec != NULL;
+  if (codec != NULL)
+  {
+    args->codec = codec->id;
+  }
 
-int ctar_close(ctar_args *args, int fd)
-{
-  if (args->compress && args->create)
+  if (args->direct_io)
   {
-    // Compress the tmp file into the original archive path
-    if (ctar_compress(args->archive, fd) == -1)
-    {
-      return -1;
-    }
+    ctar_open_direct(args, fd);
   }
 
+  if (offset == -1)
+  {
+    return ctar_decompress_stream(args, fd, magic, nbytes);
+  }
+
+  // Decompress on the fly from the archive
+  return args->compress ? ctar_decompress_stream(args, fd, NULL, 0) : fd;
+}
+
+int ctar_close(ctar_args *args, int fd)
+{
   if (close(fd) == -1)
   {
     perror("Unable to close archive");
     return -1;
   }
 
+  if (args->stream)
+  {
+    // Closing fd flushed the end of the archive to the compression thread,
+    // or released the decompression thread if the archive was not read entirely
+    return ctar_stream_join(args);
+  }
+
   return 0;
 }
 
 int ctar_list(ctar_args *args, int fd)
 {
-  ctar_header header;
-  int nbytes;
+  ctar_reader in;
+  ctar_reader_open(&in, fd, args->drop_cache);
+
+  ctar_header *header;
+  int status;
   int blank_header_count = 0;
 
-  while ((nbytes = read(fd, &header, sizeof(ctar_header))) > 0 && blank_header_count < 2)
+  while ((status = ctar_reader_next(&in, &header)) == 1 && blank_header_count < 2)
   {
-    if (is_header_blank(&header))
+    if (is_header_blank(header))
     {
       blank_header_count++;
       continue;
     }
 
-    if (ctar_list_entry(&header, args->verbose) == -1)
+    bool listed = args->list_dirs || header->typeflag[0] != DIRTYPE;
+    if (listed && is_header_selected(header, args->files) && ctar_list_entry(header, &in, args->verbose) == -1)
     {
+      ctar_reader_close(&in);
       return -1;
     }
 
-    if (skip_data_blocks(fd, &header) == -1)
+    if (ctar_reader_skip(&in, header) == -1)
     {
       perror("Unable to skip data blocks");
+      ctar_reader_close(&in);
       return -1;
     }
   }
+  ctar_reader_close(&in);
 
-  if (nbytes == -1)
+  if (status == -1)
   {
     perror("Unable to read archive");
     return -1;
@@ -130,7 +208,7 @@ int ctar_list(ctar_args *args, int fd)
  * - directory (DIRTYPE): 'd'
  * - FIFO special (FIFOTYPE): 'p'
  */
-int ctar_list_entry(ctar_header *header, bool verbose)
+int ctar_list_entry(ctar_header *header, ctar_reader *in, bool verbose)
 {
   if (!is_checksum_valid(header))
   {
@@ -159,24 +237,24 @@ int ctar_list_entry(ctar_header *header, bool verbose)
 
     // Owner and group
     // Get user and group from header->uid and header->gid
-    struct passwd *pw = getpwuid(oct2dec(header->uid, CTAR_UID_SIZE));
-    if (pw == NULL)
+    const char *user = get_user_name(oct2dec(header->uid, CTAR_UID_SIZE));
+    if (user == NULL)
     {
       perror("Unable to get user");
       return -1;
     }
 
-    struct group *gr = getgrgid(oct2dec(header->gid, CTAR_GID_SIZE));
-    if (gr == NULL)
+    const char *group = get_group_name(oct2dec(header->gid, CTAR_GID_SIZE));
+    if (group == NULL)
     {
       perror("Unable to get group");
       return -1;
     }
 
-    printf("%.*s/%.*s ", CTAR_UNAME_SIZE, pw->pw_name, CTAR_GNAME_SIZE, gr->gr_name);
+    printf("%.*s/%.*s ", CTAR_UNAME_SIZE, user, CTAR_GNAME_SIZE, group);
 
-    // File size
-    printf("%7d ", oct2dec(header->size, CTAR_SIZE_SIZE));
+    // File size, the real one for sparse files
+    printf("%7ld ", in->sparse_size != -1 ? in->sparse_size : (long)oct2dec(header->size, CTAR_SIZE_SIZE));
 
     // Last modification time
     time_t mtime = (time_t)oct2dec(header->mtime, CTAR_MTIME_SIZE);
@@ -237,33 +315,94 @@ int ctar_chdir(ctar_args *args)
   return 0;
 }
 
+/**
+ * With args->jobs threads, regular files are extracted in parallel (see @ref ctar_jobs).
+ * Otherwise, if io_uring is available (see @ref ctar_uring), small regular files are extracted in batches.
+ * The extracted files are made durable according to args->sync_mode (see @ref ctar_sync).
+ */
 int ctar_extract(ctar_args *args, int fd)
 {
-  ctar_header header;
-  int nbytes;
+  ctar_sync sync;
+  if (ctar_sync_open(&sync, args->sync_mode) == -1)
+  {
+    return -1;
+  }
+  args->sync = &sync;
+
+  ctar_dcache dirs;
+  ctar_dcache_open(&dirs);
+  args->dirs = &dirs;
+
+  if (args->jobs > 1 && (args->workers = ctar_jobs_new(args)) == NULL)
+  {
+    ctar_sync_close(&sync);
+    args->sync = NULL;
+    return -1;
+  }
+
+  ctar_reader in;
+  ctar_reader_open(&in, fd, args->drop_cache);
+  if (args->workers == NULL)
+  {
+    args->uring = ctar_uring_new(args->sync_mode);
+  }
+
+  ctar_header *header;
+  int nread = 0;
+  int status = 0;
   int blank_header_count = 0;
 
-  while ((nbytes = read(fd, &header, sizeof(ctar_header))) > 0 && blank_header_count < 2)
+  while (status == 0 && (nread = ctar_reader_next(&in, &header)) == 1 && blank_header_count < 2)
   {
-    if (is_header_blank(&header))
+    if (is_header_blank(header))
     {
       blank_header_count++;
       continue;
     }
 
-    if (ctar_extract_entry(&header, args->verbose, fd) == -1)
+    if (!is_header_selected(header, args->files))
     {
-      return -1;
+      if (ctar_reader_skip(&in, header) == -1)
+      {
+        perror("Unable to skip data blocks");
+        status = -1;
+      }
+      continue;
     }
+
+    status = ctar_extract_entry(args, header, &in);
   }
 
-  if (nbytes == -1)
+  if (status == 0 && nread == -1)
   {
     perror("Unable to read archive");
-    return -1;
+    status = -1;
   }
 
-  return 0;
+  // The files being extracted may still be written from the mapping of the archive
+  if (ctar_uring_finish(args->uring) == -1 || ctar_jobs_finish(args->workers) == -1)
+  {
+    status = -1;
+  }
+  args->uring = NULL;
+  args->workers = NULL;
+  ctar_reader_close(&in);
+  ctar_dcache_close(&dirs);
+  args->dirs = NULL;
+
+  // Only report success once the files are durable
+  if (ctar_sync_close(&sync) == -1)
+  {
+    status = -1;
+  }
+  args->sync = NULL;
+
+  if (args->verbose)
+  {
+    ctar_sync_report(&sync);
+  }
+
+  return status;
 }
 
 /**
@@ -272,7 +411,7 @@ int ctar_extract(ctar_args *args, int fd)
  * - symbolic link (SYMTYPE): 'l'
  * - directory (DIRTYPE): 'd'
  */
-int ctar_extract_entry(ctar_header *header, bool verbose, int fd)
+int ctar_extract_entry(ctar_args *args, ctar_header *header, ctar_reader *in)
 {
   if (!is_checksum_valid(header))
   {
@@ -280,88 +419,395 @@ int ctar_extract_entry(ctar_header *header, bool verbose, int fd)
     return 0;
   }
   
-  if (verbose)
+  if (args->verbose)
   {
     printf("%.*s\n", CTAR_NAME_SIZE, header->name);
   }
 
+  // Never extract an entry over a file still being extracted
+  if (args->uring != NULL && ctar_uring_wait_name(args->uring, header) == -1)
+  {
+    return -1;
+  }
+  if (args->workers != NULL && ctar_jobs_wait_name(args->workers, header) == -1)
+  {
+    return -1;
+  }
+
   switch (header->typeflag[0])
   {
   case REGTYPE:
   case AREGTYPE:
   case CONTTYPE:
-    return ctar_extract_regular(header, fd);
+    return ctar_extract_regular(args, header, in);
   case SYMTYPE:
-    return ctar_extract_symlink(header, fd);
+    if (args->workers != NULL)
+    {
+      return ctar_jobs_symlink(args->workers, header, in);
+    }
+    return ctar_extract_symlink(args, header, in);
   case DIRTYPE:
-    return ctar_extract_directory(header, fd);
+    return ctar_extract_directory(args, header, in);
   default:
     fprintf(stderr, "Warning: unsupported file type '%c', skipping entry\n", header->typeflag[0]);
     return 0;
   }
 }
 
-int ctar_extract_regular(ctar_header *header, int fd)
+/**
+ * Sparse files are extracted by ctar_extract_sparse().
+ * Files are handed to the extraction threads if any, small files to the io_uring engine if any.
+ * If the archive is mapped (see @ref ctar_reader), the data of small files is written straight from the mapping.
+ * Otherwise it is copied by ctar_extract_data(), in the kernel when possible: for large files, that saves
+ * faulting the pages of the mapping in, and file systems supporting reflinks share the data blocks.
+ *
+ * Large files are preallocated, so that they are not fragmented by being written piece by piece.
+ * With args->drop_cache, the written data is dropped from the page cache behind the write cursor.
+ */
+int ctar_extract_regular(ctar_args *args, ctar_header *header, ctar_reader *in)
 {
+  if (in->sparse_size != -1)
+  {
+    return ctar_extract_sparse(args, header, in);
+  }
+
+  if (args->workers != NULL && ctar_jobs_accepts(header, in))
+  {
+    return ctar_jobs_extract(args->workers, header, in);
+  }
+
+  long size = oct2dec(header->size, CTAR_SIZE_SIZE);
+  if (args->uring != NULL && size <= CTAR_URING_FILE_SIZE)
+  {
+    if (ctar_uring_extract(args->uring, args->dirs, header, in) == -1)
+    {
+      return -1;
+    }
+
+    // io_uring syncs the file, or starts its writeback
+    return ctar_sync_written(args->sync, size);
+  }
+
+  int out_fd = ctar_extract_open(args->dirs, header->name, oct2dec(header->mode, CTAR_MODE_SIZE), size);
+  if (out_fd == -1)
+  {
+    return -1;
+  }
+
+  ctar_cache out;
+  ctar_cache_open(&out, out_fd, 0, args->drop_cache, true);
+
+  int status = 0;
+  if (in->map != NULL && size < CTAR_KERNEL_COPY_SIZE)
+  {
+    size_t available;
+    const unsigned char *data = ctar_reader_data(in, header, &available);
+    status = ctar_extract_buffer(data, available, &out);
+    if (status == 0 && available < size)
+    {
+      fprintf(stderr, "Unexpected end of archive\n");
+      status = -1;
+    }
+  }
+  else
+  {
+    status = ctar_extract_data(args, header, in, &out);
+  }
+
+  return ctar_extract_close(args, &out, size, status);
+}
+
+/**
+ * The file is opened relative to its parent directory, kept open by dirs.
+ * Large files are preallocated, so that they are not fragmented by being written piece by piece.
+ */
+int ctar_extract_open(ctar_dcache *dirs, const char *name, int mode, long size)
+{
+  // The name of a header may not be terminated
+  char path[CTAR_NAME_SIZE + 1];
+  snprintf(path, sizeof(path), "%.*s", CTAR_NAME_SIZE, name);
+
   // Prepare directory
-  // Create a copy of header name because dirname() may modify it
-  char *dir = strdup(header->name);
-  if (mkdir_recursive(dirname(dir), 0755) == -1)
+  const char *base;
+  int dir_fd = ctar_dcache_parent(dirs, path, &base);
+  if (dir_fd == -1)
   {
     perror("Unable to create parent directory");
     return -1;
   }
-  free(dir);
 
   // Open output file
-  int mode = oct2dec(header->mode, CTAR_MODE_SIZE);
-  int out_fd = open(header->name, O_WRONLY | O_CREAT | O_TRUNC, mode);
+  int out_fd = openat(dir_fd, base, O_WRONLY | O_CREAT | O_TRUNC, mode);
   if (out_fd == -1)
   {
     perror("Unable to open output file");
     return -1;
   }
 
+  // Reserve the blocks without changing the size, which still grows as the data is written
+  // (errors are ignored, e.g. if the file system does not support it)
+  if (size >= CTAR_PREALLOC_SIZE)
+  {
+    fallocate(out_fd, FALLOC_FL_KEEP_SIZE, 0, size);
+  }
+
+  return out_fd;
+}
+
+/**
+ * The data is written in steps of CTAR_CACHE_DROP_SIZE bytes, so that the cache dropper follows the write cursor.
+ */
+int ctar_extract_buffer(const unsigned char *data, size_t size, ctar_cache *out)
+{
+  for (size_t pos = 0; pos < size; pos += CTAR_CACHE_DROP_SIZE)
+  {
+    size_t len = size - pos < CTAR_CACHE_DROP_SIZE ? size - pos : CTAR_CACHE_DROP_SIZE;
+    if (write_full(out->fd, data + pos, len) == -1)
+    {
+      perror("Unable to write to output file");
+      return -1;
+    }
+    ctar_cache_advance(out, pos + len);
+  }
+
+  return 0;
+}
+
+/**
+ * The file is only made durable (see @ref ctar_sync) if it was fully written.
+ */
+int ctar_extract_close(ctar_args *args, ctar_cache *out, long size, int status)
+{
+  int out_fd = out->fd;
+  if (status == 0 && ctar_sync_file(args->sync, out_fd, size) == -1)
+  {
+    status = -1;
+  }
+  ctar_cache_close(out, size);
+
+  // Close output file
+  if (close(out_fd) == -1 && status == 0)
+  {
+    perror("Unable to close output file");
+    return -1;
+  }
+
+  return status;
+}
+
+/**
+ * The data is copied by the kernel when the archive is a regular file or a pipe (see ctar_reader_copy()),
+ * unless it is read with O_DIRECT.
+ * Otherwise, and for the padding of the last block, the data blocks are read in records
+ * of args->record_size bytes, so copying a large file costs a few syscalls per record
+ * instead of a read() and a write() per block.
+ * Only the padding of the last block is left out of the output file.
+ */
+int ctar_extract_data(ctar_args *args, ctar_header *header, ctar_reader *in, ctar_cache *out)
+{
+  // Let the kernel copy the data, without its padding
+  long size = oct2dec(header->size, CTAR_SIZE_SIZE);
+  long padded = (long)get_nblocks(header) * CTAR_BLOCK_SIZE;
+  long copied = 0;
+  while (copied < size)
+  {
+    long len = size - copied < CTAR_CACHE_DROP_SIZE ? size - copied : CTAR_CACHE_DROP_SIZE;
+    long nbytes = ctar_reader_copy(in, out->fd, len);
+    if (nbytes == -1)
+    {
+      perror("Unable to copy archive to output file");
+      return -1;
+    }
+
+    copied += nbytes;
+    ctar_cache_advance(out, copied);
+    if (nbytes < len)
+    {
+      break;
+    }
+  }
+  long remaining = size - copied;
+  padded -= copied;
+
+  // Small files do not need a whole record
+  size_t record_size = padded < args->record_size ? padded : args->record_size;
+  char *buf = malloc(record_size > 0 ? record_size : 1);
+  if (buf == NULL)
+  {
+    perror("Unable to allocate record");
+    return -1;
+  }
+
   // Copy data blocks
-  int remaining = oct2dec(header->size, CTAR_SIZE_SIZE);
-  char buf[CTAR_BLOCK_SIZE];
-  while (remaining > 0)
+  int status = 0;
+  while (status == 0 && padded > 0)
   {
-    int nbytes = read(fd, buf, CTAR_BLOCK_SIZE);
+    size_t len = padded < record_size ? padded : record_size;
+    ssize_t nbytes = ctar_reader_read(in, buf, len);
     if (nbytes == -1)
     {
       perror("Unable to read archive");
-      return -1;
+      status = -1;
+      break;
     }
 
-    int nbytes_to_write = nbytes < remaining ? nbytes : remaining;
-    if (write(out_fd, buf, nbytes_to_write) == -1)
+    size_t nbytes_to_write = nbytes < remaining ? nbytes : remaining;
+    if (write_full(out->fd, buf, nbytes_to_write) == -1)
     {
       perror("Unable to write to output file");
-      return -1;
+      status = -1;
+    }
+    else if (nbytes < len)
+    {
+      fprintf(stderr, "Unexpected end of archive\n");
+      status = -1;
+    }
+
+    remaining -= nbytes_to_write;
+    padded -= len;
+    ctar_cache_advance(out, size - remaining);
+  }
+  free(buf);
+
+  return status;
+}
+
+/**
+ * The output file is created empty, so writing each region at its offset leaves holes between them,
+ * and truncating the file to its real size leaves a hole at its end.
+ */
+int ctar_extract_sparse(ctar_args *args, ctar_header *header, ctar_reader *in)
+{
+  long padded = (long)get_nblocks(header) * CTAR_BLOCK_SIZE;
+  long realsize = in->sparse_size;
+
+  // Not preallocated, that would fill the holes
+  int out_fd = ctar_extract_open(args->dirs, header->name, oct2dec(header->mode, CTAR_MODE_SIZE), 0);
+  if (out_fd == -1)
+  {
+    return -1;
+  }
+
+  ctar_sparse sparse;
+  long consumed = ctar_sparse_read_map(&sparse, in, realsize);
+  char *buf = malloc(args->record_size);
+  if (buf == NULL)
+  {
+    perror("Unable to allocate record");
+    consumed = -1;
+  }
+
+  ctar_cache out;
+  ctar_cache_open(&out, out_fd, 0, args->drop_cache, true);
+
+  // Copy each region at its offset
+  int status = consumed == -1 ? -1 : 0;
+  for (long i = 0; status == 0 && i < sparse.count; i++)
+  {
+    ctar_sparse_region *region = &sparse.regions[i];
+    if (lseek(out_fd, region->offset, SEEK_SET) == -1)
+    {
+      perror("Unable to seek output file");
+      status = -1;
     }
-    remaining -= nbytes;
+
+    for (long done = 0; status == 0 && done < region->size;)
+    {
+      size_t len = region->size - done < args->record_size ? region->size - done : args->record_size;
+      ssize_t nbytes = ctar_reader_read(in, buf, len);
+      if (nbytes == -1)
+      {
+        perror("Unable to read archive");
+        status = -1;
+      }
+      else if (write_full(out_fd, buf, nbytes) == -1)
+      {
+        perror("Unable to write to output file");
+        status = -1;
+      }
+      else if (nbytes < len)
+      {
+        fprintf(stderr, "Unexpected end of archive\n");
+        status = -1;
+      }
+
+      done += len;
+      consumed += len;
+      ctar_cache_advance(&out, region->offset + done);
+    }
+  }
+
+  // Skip the padding of the last block
+  while (status == 0 && consumed < padded)
+  {
+    size_t len = padded - consumed < args->record_size ? padded - consumed : args->record_size;
+    ssize_t nbytes = ctar_reader_read(in, buf, len);
+    if (nbytes == -1)
+    {
+      perror("Unable to read archive");
+      status = -1;
+    }
+    else if (nbytes < len)
+    {
+      fprintf(stderr, "Unexpected end of archive\n");
+      status = -1;
+    }
+    consumed += len;
+  }
+  free(buf);
+  long sparse_stored = sparse.stored;
+  ctar_sparse_free(&sparse);
+
+  if (status == 0 && ftruncate(out_fd, realsize) == -1)
+  {
+    perror("Unable to resize output file");
+    status = -1;
+  }
+
+  if (status == 0 && ctar_sync_file(args->sync, out_fd, sparse_stored) == -1)
+  {
+    status = -1;
   }
+  ctar_cache_close(&out, realsize);
 
   // Close output file
-  if (close(out_fd) == -1)
+  if (close(out_fd) == -1 && status == 0)
   {
     perror("Unable to close output file");
     return -1;
   }
 
-  return 0;
+  return status;
 }
 
-int ctar_extract_symlink(ctar_header *header, int fd)
+int ctar_extract_symlink(ctar_args *args, ctar_header *header, ctar_reader *in)
 {
-  if (skip_data_blocks(fd, header) == -1)
+  if (ctar_reader_skip(in, header) == -1)
   {
     perror("Unable to skip data blocks");
     return -1;
   }
 
-  if (symlink(header->linkname, header->name) == -1)
+  return ctar_extract_link(args->dirs, header);
+}
+
+int ctar_extract_link(ctar_dcache *dirs, ctar_header *header)
+{
+  char path[CTAR_NAME_SIZE + 1];
+  char target[CTAR_LINKNAME_SIZE + 1];
+  snprintf(path, sizeof(path), "%.*s", CTAR_NAME_SIZE, header->name);
+  snprintf(target, sizeof(target), "%.*s", CTAR_LINKNAME_SIZE, header->linkname);
+
+  // Prepare directory, it may not be in the archive if only some entries are extracted
+  const char *base;
+  int dir_fd = ctar_dcache_parent(dirs, path, &base);
+  if (dir_fd == -1)
+  {
+    perror("Unable to create parent directory");
+    return -1;
+  }
+
+  if (symlinkat(target, dir_fd, base) == -1)
   {
     perror("Unable to create symbolic link");
     return -1;
@@ -370,16 +816,21 @@ int ctar_extract_symlink(ctar_header *header, int fd)
   return 0;
 }
 
-int ctar_extract_directory(ctar_header *header, int fd)
+int ctar_extract_directory(ctar_args *args, ctar_header *header, ctar_reader *in)
 {
-  if (skip_data_blocks(fd, header) == -1)
+  if (ctar_reader_skip(in, header) == -1)
   {
     perror("Unable to skip data blocks");
     return -1;
   }
 
+  // The missing parents are created with mode 0755, like those of the other entries
+  char path[CTAR_NAME_SIZE + 1];
+  snprintf(path, sizeof(path), "%.*s", CTAR_NAME_SIZE, header->name);
+  const char *base;
+  int dir_fd = ctar_dcache_parent(args->dirs, path, &base);
   int mode = oct2dec(header->mode, CTAR_MODE_SIZE);
-  if (mkdir_recursive(header->name, mode) == -1)
+  if (dir_fd == -1 || (mkdirat(dir_fd, base, mode) == -1 && errno != EEXIST))
   {
     perror("Unable to create directory");
     return -1;
@@ -388,28 +839,87 @@ int ctar_extract_directory(ctar_header *header, int fd)
   return 0;
 }
 
+/**
+ * The archive is created in stages connected by bounded buffers:
+ * - this thread walks the files and reads them straight into the slots of a @ref ctar_pipeline
+ * - the writer thread of the pipeline writes the filled slots to fd
+ * - if the archive is compressed, fd is a pipe to the compression thread, see ctar_open()
+ *
+ * So reading the files, compressing and writing the archive overlap.
+ * With args->jobs threads, the files are also stat'ed and read ahead of this thread (see @ref ctar_walk).
+ */
 int ctar_create(ctar_args *args, int fd)
 {
-  for (int i = 0; args->files != NULL && args->files[i] != NULL; i++)
+  ctar_pipeline out;
+  if (ctar_pipeline_start(&out, fd, args->record_size) == -1)
+  {
+    return -1;
+  }
+
+  int status = 0;
+  if (args->jobs > 1)
+  {
+    status = ctar_create_walk(args, &out);
+  }
+  else
+  {
+    for (int i = 0; status == 0 && args->files != NULL && args->files[i] != NULL; i++)
+    {
+      status = ctar_create_entry(args, args->files[i], &out);
+    }
+  }
+
+  if (status == 0)
+  {
+    status = ctar_create_end_of_archive(&out);
+  }
+
+  if (ctar_pipeline_finish(&out) == -1)
+  {
+    return -1;
+  }
+
+  return status;
+}
+
+/**
+ * The walk lists the files in the order ctar_create_entry() adds them, so the archive is the same.
+ */
+int ctar_create_walk(ctar_args *args, ctar_pipeline *out)
+{
+  args->walk = ctar_walk_start(args);
+  if (args->walk == NULL)
   {
-    if (ctar_create_entry(args->files[i], args->verbose, fd) == -1)
+    return -1;
+  }
+
+  int status;
+  ctar_walk_entry *entry;
+  while ((status = ctar_walk_next(args->walk, &entry)) == 1)
+  {
+    if (ctar_create_file(args, entry->path, &entry->st, entry->fd, out) == -1)
     {
-      return -1;
+      status = -1;
+      break;
     }
   }
-  return ctar_create_end_of_archive(fd);
+
+  ctar_walk_stop(args->walk);
+  args->walk = NULL;
+
+  return status;
 }
 
 /**
  * The end of archive is marked by two consecutive blank headers.
  */
-int ctar_create_end_of_archive(int fd)
+int ctar_create_end_of_archive(ctar_pipeline *out)
 {
   char buf[2 * CTAR_BLOCK_SIZE];
   memset(buf, 0, sizeof(buf));
-  if (write(fd, buf, sizeof(buf)) == -1)
+  if (ctar_pipeline_write(out, buf, sizeof(buf)) == -1)
   {
-    perror("Unable to write end of archive");
+    fprintf(stderr, "Unable to write end of archive\n");
     return -1;
   }
 
@@ -429,117 +939,271 @@ int ctar_create_end_of_archive(int fd)
  * - devminor
  * - prefix
  */
-int ctar_create_entry(char *path, bool verbose, int fd)
+int ctar_create_entry(ctar_args *args, char *path, ctar_pipeline *out)
 {
-  // Check if path is not the same as the archive
-  struct stat st_archive;
-  if (fstat(fd, &st_archive) == -1)
+  return ctar_create_at(args, AT_FDCWD, path, path, out);
+}
+
+/**
+ * The file is stat'ed and opened relative to its directory, so the kernel does not resolve its whole path again.
+ * Paths are only limited by the size of the name of the header (there is no prefix nor extended header for long names).
+ */
+int ctar_create_at(ctar_args *args, int dir_fd, const char *name, char *path, ctar_pipeline *out)
+{
+  if (strlen(path) >= CTAR_NAME_SIZE)
   {
-    perror("Unable to stat archive");
-    return -1;
+    fprintf(stderr, "Warning: path '%s' is too long, skipping entry\n", path);
+    return 0;
   }
 
   struct stat st;
-  if (lstat(path, &st) == -1)
+  if (ctar_dir_stat(dir_fd, name, &st) == -1)
   {
     perror("Unable to stat file");
     return -1;
   }
 
-  if (st_archive.st_dev == st.st_dev && st_archive.st_ino == st.st_ino)
+  // Errors are reported by ctar_create_regular() and ctar_create_directory(), which open the file by path instead
+  int fd = -1;
+  if (S_ISREG(st.st_mode))
+  {
+    fd = openat(dir_fd, name, O_RDONLY);
+  }
+  else if (S_ISDIR(st.st_mode) && args->walk == NULL && args->recursive)
+  {
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+  }
+
+  return ctar_create_file(args, path, &st, fd, out);
+}
+
+int ctar_create_file(ctar_args *args, char *path, struct stat *st, int in_fd, ctar_pipeline *out)
+{
+  // Check if path is not the same as the archive
+  if (out->st.st_dev == st->st_dev && out->st.st_ino == st->st_ino)
   {
     fprintf(stderr, "Warning: archive and file '%s' are the same, skipping entry\n", path);
+    if (in_fd != -1)
+    {
+      close(in_fd);
+    }
     return 0;
   }
 
   ctar_header header = CTAR_HEADER_INIT;
   strncpy(header.name, path, CTAR_NAME_SIZE);
-  dec2oct(st.st_mode, header.mode, CTAR_MODE_SIZE);
-  dec2oct(st.st_uid, header.uid, CTAR_UID_SIZE);
-  dec2oct(st.st_gid, header.gid, CTAR_GID_SIZE);
-  dec2oct(st.st_size, header.size, CTAR_SIZE_SIZE);
-  dec2oct(st.st_mtime, header.mtime, CTAR_MTIME_SIZE);
-  strncpy(header.uname, getpwuid(st.st_uid)->pw_name, CTAR_UNAME_SIZE);
-  strncpy(header.gname, getgrgid(st.st_gid)->gr_name, CTAR_GNAME_SIZE);
-
-  if (verbose)
+  dec2oct(st->st_mode, header.mode, CTAR_MODE_SIZE);
+  dec2oct(st->st_uid, header.uid, CTAR_UID_SIZE);
+  dec2oct(st->st_gid, header.gid, CTAR_GID_SIZE);
+  dec2oct(st->st_size, header.size, CTAR_SIZE_SIZE);
+  dec2oct(st->st_mtime, header.mtime, CTAR_MTIME_SIZE);
+  const char *user = get_user_name(st->st_uid);
+  const char *group = get_group_name(st->st_gid);
+  strncpy(header.uname, user != NULL ? user : "", CTAR_UNAME_SIZE);
+  strncpy(header.gname, group != NULL ? group : "", CTAR_GNAME_SIZE);
+
+  if (args->verbose)
   {
     printf("%.*s\n", CTAR_NAME_SIZE, header.name);
   }
 
-  if (S_ISREG(st.st_mode))
+  if (S_ISREG(st->st_mode))
   {
-    return ctar_create_regular(&header, fd);
+    return ctar_create_regular(args, &header, in_fd, out);
   }
 
-  if (S_ISLNK(st.st_mode))
+  if (S_ISLNK(st->st_mode))
   {
-    return ctar_create_symlink(&header, fd);
+    return ctar_create_symlink(&header, out);
   }
 
-  if (S_ISDIR(st.st_mode))
+  if (S_ISDIR(st->st_mode))
   {
-    return ctar_create_directory(&header, verbose, fd);
+    return ctar_create_directory(args, &header, in_fd, out);
   }
 
   fprintf(stderr, "Warning: unsupported file type '%c', skipping entry\n", header.typeflag[0]);
   return 0;
 }
 
-int ctar_create_regular(ctar_header *header, int fd)
+/**
+ * Files with holes are stored as sparse files (see @ref ctar_sparse), only the data of their regions
+ * is read and appended to the archive. Other files are a single region.
+ *
+ * If the archive is compressed with a level map (args->adapt), a sample of the file
+ * decides whether its data is compressed at a lower level or stored,
+ * so that already compressed data does not waste compression time.
+ */
+int ctar_create_regular(ctar_args *args, ctar_header *header, int in_fd, ctar_pipeline *out)
 {
-  // Write header
-  header->typeflag[0] = REGTYPE;
-  compute_checksum(header);
-  if (write(fd, header, sizeof(ctar_header)) == -1)
+  if (in_fd == -1)
   {
-    perror("Unable to write header");
-    return -1;
+    in_fd = open(header->name, O_RDONLY);
   }
-
-  // Write data blocks
-  int in_fd = open(header->name, O_RDONLY);
   if (in_fd == -1)
   {
     perror("Unable to open input file");
     return -1;
   }
 
-  // Copy data blocks
-  int nbytes;
-  char buf[CTAR_BLOCK_SIZE];
-  while ((nbytes = read(in_fd, buf, CTAR_BLOCK_SIZE)) > 0)
+  // Write header
+  ctar_sparse sparse;
+  int status = ctar_sparse_scan(&sparse, in_fd);
+  if (status == 1)
   {
-    if (nbytes < CTAR_BLOCK_SIZE)
+    status = ctar_sparse_write_header(&sparse, header, out);
+  }
+  else if (status == 0)
+  {
+    // Never copy more than the header size, the file may grow while being archived
+    // (e.g. a compressed archive created inside the archived directory)
+    header->typeflag[0] = REGTYPE;
+    dec2oct(sparse.size, header->size, CTAR_SIZE_SIZE);
+    compute_checksum(header);
+    if (ctar_pipeline_write(out, header, sizeof(ctar_header)) == -1)
     {
-      // Pad last block with zeros
-      memset(buf + nbytes, 0, CTAR_BLOCK_SIZE - nbytes);
+      fprintf(stderr, "Unable to write header\n");
+      status = -1;
     }
+  }
+
+  if (status == -1)
+  {
+    ctar_sparse_free(&sparse);
+    close(in_fd);
+    return -1;
+  }
 
-    if (write(fd, buf, CTAR_BLOCK_SIZE) == -1)
+  // The level must be known before the data reaches the compression thread
+  long padded = (sparse.stored + CTAR_BLOCK_SIZE - 1) / CTAR_BLOCK_SIZE * CTAR_BLOCK_SIZE;
+  int ratio;
+  int level = args->adapt != NULL ? ctar_adapt_sample(in_fd, sparse.stored, args->level, &ratio) : -1;
+  if (level != -1)
+  {
+    if (ctar_adapt_push(args->adapt, out->offset, level) == -1 || ctar_adapt_push(args->adapt, out->offset + padded, -1) == -1)
     {
-      perror("Unable to write to archive");
+      ctar_sparse_free(&sparse);
+      close(in_fd);
       return -1;
     }
+
+    if (args->verbose)
+    {
+      printf("  %s (sample compressed to %d%%)\n", level == 0 ? "stored" : "compressed at level 1", ratio);
+    }
   }
 
-  if (nbytes == -1)
+  // Large files are read from start to end, and dropped from the page cache behind the read cursor
+  // with args->drop_cache, so that archiving them does not evict the data of other processes
+  if (sparse.stored >= CTAR_PIPELINE_COPY_MIN_SIZE)
   {
-    perror("Unable to read input file");
-    return -1;
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  ctar_cache in;
+  ctar_cache_open(&in, in_fd, 0, args->drop_cache, false);
+
+  for (long i = 0; status == 0 && i < sparse.count; i++)
+  {
+    if (lseek(in_fd, sparse.regions[i].offset, SEEK_SET) == -1)
+    {
+      perror("Unable to seek input file");
+      status = -1;
+    }
+    else
+    {
+      status = ctar_create_data(args, header, &in, sparse.regions[i].size, out);
+    }
+  }
+  ctar_cache_close(&in, sparse.size);
+
+  // Pad last block with zeros
+  static const char zeros[CTAR_BLOCK_SIZE];
+  if (status == 0 && ctar_pipeline_write(out, zeros, padded - sparse.stored) == -1)
+  {
+    fprintf(stderr, "Unable to write to archive\n");
+    status = -1;
   }
+  ctar_sparse_free(&sparse);
 
   // Close input file
-  if (close(in_fd) == -1)
+  if (close(in_fd) == -1 && status == 0)
   {
     perror("Unable to close input file");
     return -1;
   }
 
+  return status;
+}
+
+/**
+ * If the archive is not compressed, the whole blocks of large data are copied by the kernel
+ * (see ctar_pipeline_copy()), only their last block goes through the pipeline.
+ * Otherwise, the data is read straight into the pipeline.
+ */
+int ctar_create_data(ctar_args *args, ctar_header *header, ctar_cache *in, long size, ctar_pipeline *out)
+{
+  off_t offset = lseek(in->fd, 0, SEEK_CUR);
+  long done = 0;
+
+  // Let the kernel copy the whole blocks of large files to uncompressed archives
+  if (!args->compress && size >= CTAR_PIPELINE_COPY_MIN_SIZE)
+  {
+    long wanted = size / CTAR_BLOCK_SIZE * CTAR_BLOCK_SIZE;
+    while (done < wanted)
+    {
+      long len = wanted - done < CTAR_CACHE_DROP_SIZE ? wanted - done : CTAR_CACHE_DROP_SIZE;
+      long copied = ctar_pipeline_copy(out, in->fd, len);
+      if (copied == -1)
+      {
+        return -1;
+      }
+
+      done += copied;
+      ctar_cache_advance(in, offset + done);
+      if (copied < len)
+      {
+        break;
+      }
+    }
+  }
+
+  // Read the rest of the data straight into the pipeline
+  bool shrank = false;
+  while (done < size)
+  {
+    size_t room;
+    unsigned char *dst = ctar_pipeline_reserve(out, &room);
+    if (dst == NULL)
+    {
+      fprintf(stderr, "Unable to write to archive\n");
+      return -1;
+    }
+
+    size_t len = size - done < room ? size - done : room;
+    ssize_t nbytes = shrank ? 0 : read_full(in->fd, dst, len);
+    if (nbytes == -1)
+    {
+      perror("Unable to read input file");
+      return -1;
+    }
+
+    if (nbytes < len && !shrank)
+    {
+      // Keep the archive consistent with the header
+      fprintf(stderr, "Warning: file '%.*s' shrank, padding it with zeros\n", CTAR_NAME_SIZE, header->name);
+      shrank = true;
+    }
+
+    memset(dst + nbytes, 0, len - nbytes);
+    ctar_pipeline_commit(out, len);
+    done += len;
+    ctar_cache_advance(in, offset + done);
+  }
+
   return 0;
 }
 
-int ctar_create_symlink(ctar_header *header, int fd)
+int ctar_create_symlink(ctar_header *header, ctar_pipeline *out)
 {
   // Read link name
   if (readlink(header->name, header->linkname, CTAR_LINKNAME_SIZE) == -1)
@@ -553,9 +1217,9 @@ int ctar_create_symlink(ctar_header *header, int fd)
   dec2oct(0, header->size, CTAR_SIZE_SIZE); // Size is always 0 for symbolic links
   compute_checksum(header);
 
-  if (write(fd, header, sizeof(ctar_header)) == -1)
+  if (ctar_pipeline_write(out, header, sizeof(ctar_header)) == -1)
   {
-    perror("Unable to write header");
+    fprintf(stderr, "Unable to write header\n");
     return -1;
   }
 
@@ -563,68 +1227,75 @@ int ctar_create_symlink(ctar_header *header, int fd)
 }
 
 /**
- * Adding a directory to the archive will recursively add all files and directories inside it.
+ * Adding a directory to the archive will recursively add all files and directories inside it,
+ * unless they are listed by a walk (see @ref ctar_walk).
+ * The entries are added in the order of the directory, or of their inode numbers (see @ref ctar_dir).
  */
-int ctar_create_directory(ctar_header *header, bool verbose, int fd)
+int ctar_create_directory(ctar_args *args, ctar_header *header, int dir_fd, ctar_pipeline *out)
 {
   // Write header
   header->typeflag[0] = DIRTYPE;
   dec2oct(0, header->size, CTAR_SIZE_SIZE); // Size is always 0 for directories
   compute_checksum(header);
 
-  if (write(fd, header, sizeof(ctar_header)) == -1)
+  if (ctar_pipeline_write(out, header, sizeof(ctar_header)) == -1)
   {
-    perror("Unable to write header");
+    fprintf(stderr, "Unable to write header\n");
+    if (dir_fd != -1)
+    {
+      close(dir_fd);
+    }
     return -1;
   }
 
-  // Add files and directories inside the directory
-  DIR *dir = opendir(header->name);
-  if (dir == NULL)
+  if (args->walk != NULL || !args->recursive)
   {
-    perror("Unable to open directory");
-    return -1;
+    return 0;
   }
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL)
+  // Add files and directories inside the directory
+  if (dir_fd == -1)
   {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-    {
-      continue;
-    }
-
-    // If header->name ends with a slash, we need to remove it
-    if (header->name[strlen(header->name) - 1] == '/')
-    {
-      header->name[strlen(header->name) - 1] = '\0';
-    }
-
-    char path[CTAR_NAME_SIZE];
-    int snprint_result = snprintf(path, sizeof(path), "%s/%s", header->name, entry->d_name);
-    if (snprint_result >= sizeof(path))
+    dir_fd = open(header->name, O_RDONLY | O_DIRECTORY);
+  }
+  ctar_dir dir;
+  if (dir_fd == -1 || ctar_dir_open(&dir, dir_fd, args->inode_order) == -1)
+  {
+    perror("Unable to open directory");
+    if (dir_fd != -1)
     {
-      fprintf(stderr, "Warning: path '%s/%s' is too long, skipping entry\n", header->name, entry->d_name);
-      continue;
+      close(dir_fd);
     }
+    return -1;
+  }
 
-    if (snprint_result < 0)
-    {
-      fprintf(stderr, "Warning: unable to create path '%s/%s', skipping entry\n", header->name, entry->d_name);
-      continue;
-    }
+  // If header->name ends with a slash, it is removed from the paths of the files
+  char parent[CTAR_NAME_SIZE + 1];
+  snprintf(parent, sizeof(parent), "%.*s", CTAR_NAME_SIZE, header->name);
+  size_t len = strlen(parent);
+  if (len > 0 && parent[len - 1] == '/')
+  {
+    parent[len - 1] = '\0';
+  }
 
-    if (ctar_create_entry(path, verbose, fd) == -1)
-    {
-      return -1;
-    }
+  int status = 0;
+  int nread;
+  const char *name;
+  unsigned char type;
+  while (status == 0 && (nread = ctar_dir_next(&dir, &name, &type)) == 1)
+  {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", parent, name);
+    status = ctar_create_at(args, dir_fd, name, path, out);
   }
 
-  if (closedir(dir) == -1)
+  if (status == 0 && nread == -1)
   {
-    perror("Unable to close directory");
-    return -1;
+    perror("Unable to read directory");
+    status = -1;
   }
+  ctar_dir_close(&dir);
+  close(dir_fd);
 
-  return 0;
+  return status;
 }
@@ -0,0 +1,192 @@
+#include "ctar_adapt.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <zlib.h>
+
+ctar_adapt *ctar_adapt_new(void)
+{
+  ctar_adapt *adapt = calloc(1, sizeof(ctar_adapt));
+  if (adapt == NULL)
+  {
+    perror("Unable to allocate level map");
+    return NULL;
+  }
+
+  pthread_mutex_init(&adapt->lock, NULL);
+  return adapt;
+}
+
+void ctar_adapt_free(ctar_adapt *adapt)
+{
+  if (adapt == NULL)
+  {
+    return;
+  }
+
+  pthread_mutex_destroy(&adapt->lock);
+  free(adapt->changes);
+  free(adapt);
+}
+
+/**
+ * The sample is compressed at level 1, the cheapest way to tell whether deflate pays off:
+ * - data hardly shrinking at level 1 (already compressed media, archives...) is stored
+ * - data shrinking a little is compressed at level 1
+ * - other data is compressed at the level of the archive
+ *
+ * Files smaller than CTAR_ADAPT_MIN_SIZE are not sampled, they cost little to compress anyway.
+ */
+int ctar_adapt_sample(int fd, long size, int level, int *ratio)
+{
+  if (size < CTAR_ADAPT_MIN_SIZE || level == 0)
+  {
+    return -1;
+  }
+
+  unsigned char in[CTAR_ADAPT_SAMPLE_SIZE];
+  unsigned char out[CTAR_ADAPT_SAMPLE_SIZE];
+  ssize_t nbytes = pread(fd, in, sizeof(in), 0);
+  if (nbytes <= 0)
+  {
+    return -1;
+  }
+
+  // Data not fitting in its own size once compressed is incompressible
+  uLongf out_len = sizeof(out);
+  int err = compress2(out, &out_len, in, nbytes, 1);
+  if (err != Z_OK && err != Z_BUF_ERROR)
+  {
+    return -1;
+  }
+  *ratio = err == Z_BUF_ERROR ? 100 : out_len * 100 / nbytes;
+
+  int chosen = -1;
+  if (*ratio >= CTAR_ADAPT_STORED_RATIO)
+  {
+    chosen = 0;
+  }
+  else if (*ratio >= CTAR_ADAPT_FAST_RATIO)
+  {
+    chosen = 1;
+  }
+
+  // Never compress harder than the archive
+  if (level != -1 && chosen >= level)
+  {
+    return -1;
+  }
+
+  return chosen;
+}
+
+int ctar_adapt_push(ctar_adapt *adapt, long offset, int level)
+{
+  pthread_mutex_lock(&adapt->lock);
+
+  int status = 0;
+  ctar_adapt_change *last = adapt->count > 0 ? &adapt->changes[adapt->count - 1] : NULL;
+  if (last != NULL && last->offset == offset)
+  {
+    last->level = level;
+  }
+  else if (last != NULL ? last->level != level : level != -1)
+  {
+    if (adapt->count == adapt->capacity)
+    {
+      size_t capacity = adapt->capacity ? 2 * adapt->capacity : 64;
+      ctar_adapt_change *changes = realloc(adapt->changes, capacity * sizeof(ctar_adapt_change));
+      if (changes == NULL)
+      {
+        perror("Unable to allocate level map");
+        status = -1;
+      }
+      else
+      {
+        adapt->changes = changes;
+        adapt->capacity = capacity;
+      }
+    }
+
+    if (status == 0)
+    {
+      adapt->changes[adapt->count].offset = offset;
+      adapt->changes[adapt->count].level = level;
+      adapt->count++;
+    }
+  }
+
+  pthread_mutex_unlock(&adapt->lock);
+  return status;
+}
+
+/**
+ * The writer pushes the level of an entry before writing its data,
+ * so the changes covering the bytes read by the compression thread are always known.
+ */
+size_t ctar_adapt_segment(ctar_adapt *adapt, long offset, size_t len, int level, int *segment_level)
+{
+  *segment_level = level;
+  if (adapt == NULL)
+  {
+    return len;
+  }
+
+  pthread_mutex_lock(&adapt->lock);
+
+  // Find the first change after offset
+  size_t lo = 0;
+  size_t hi = adapt->count;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (adapt->changes[mid].offset <= offset)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  if (lo > 0 && adapt->changes[lo - 1].level != -1)
+  {
+    *segment_level = adapt->changes[lo - 1].level;
+  }
+
+  if (lo < adapt->count && adapt->changes[lo].offset - offset < len)
+  {
+    len = adapt->changes[lo].offset - offset;
+  }
+
+  pthread_mutex_unlock(&adapt->lock);
+  return len;
+}
+
+/**
+ * The change in effect at offset is kept, it gives the level of the next bytes.
+ */
+void ctar_adapt_consume(ctar_adapt *adapt, long offset)
+{
+  if (adapt == NULL)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&adapt->lock);
+
+  size_t drop = 0;
+  while (drop + 1 < adapt->count && adapt->changes[drop + 1].offset <= offset)
+  {
+    drop++;
+  }
+
+  if (drop > 0)
+  {
+    memmove(adapt->changes, adapt->changes + drop, (adapt->count - drop) * sizeof(ctar_adapt_change));
+    adapt->count -= drop;
+  }
+
+  pthread_mutex_unlock(&adapt->lock);
+}
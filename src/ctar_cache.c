@@ -0,0 +1,80 @@
+#define _GNU_SOURCE // sync_file_range()
+#include "ctar_cache.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+void ctar_cache_open(ctar_cache *cache, int fd, off_t offset, bool enabled, bool dirty)
+{
+  cache->fd = fd;
+  cache->enabled = enabled;
+  cache->dirty = dirty;
+  cache->map = NULL;
+  cache->start = offset;
+  cache->flushed = offset;
+}
+
+/**
+ * @brief Drop [cache->start, end) from the page cache.
+ *
+ * Pages still mapped or dirty are not dropped by the kernel, so the range is unmapped
+ * from the process first, and its writeback waited for if it was written.
+ * The hints are best effort, their errors (e.g. on pipes) are ignored.
+ */
+static void ctar_cache_drop(ctar_cache *cache, off_t end)
+{
+  if (end <= cache->start)
+  {
+    return;
+  }
+
+  if (cache->map != NULL)
+  {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    off_t start = cache->start & ~(off_t)(page_size - 1);
+    madvise((void *)(cache->map + start), end - start, MADV_DONTNEED);
+  }
+
+  if (cache->dirty)
+  {
+    sync_file_range(cache->fd, cache->start, end - cache->start,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  }
+
+  posix_fadvise(cache->fd, cache->start, end - cache->start, POSIX_FADV_DONTNEED);
+  cache->start = end;
+}
+
+void ctar_cache_advance(ctar_cache *cache, off_t offset)
+{
+  if (!cache->enabled)
+  {
+    return;
+  }
+
+  if (!cache->dirty)
+  {
+    if (offset - cache->start >= CTAR_CACHE_DROP_SIZE)
+    {
+      ctar_cache_drop(cache, offset);
+    }
+    return;
+  }
+
+  if (offset - cache->flushed >= CTAR_CACHE_DROP_SIZE)
+  {
+    // Start writing back the last step, and drop the previous one, written back by now
+    sync_file_range(cache->fd, cache->flushed, offset - cache->flushed, SYNC_FILE_RANGE_WRITE);
+    ctar_cache_drop(cache, cache->flushed);
+    cache->flushed = offset;
+  }
+}
+
+void ctar_cache_close(ctar_cache *cache, off_t offset)
+{
+  if (cache->enabled)
+  {
+    ctar_cache_drop(cache, offset);
+  }
+}
@@ -0,0 +1,350 @@
+#include "ctar_codec.h"
+#include "ctar_zlib.h"
+#include "ctar_zstd.h"
+#include "ctar_zran.h"
+#include "ctar_adapt.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+
+/** @brief Supported compression formats */
+static const ctar_codec ctar_codecs[] = {
+    {CTAR_CODEC_GZIP, "gzip", {0x1f, 0x8b}, 2, CTAR_ZLIB_MAX_LEVEL, true, ctar_gzip_compress, ctar_gzip_decompress},
+#ifdef CTAR_ZSTD
+    {CTAR_CODEC_ZSTD, "zstd", {0x28, 0xb5, 0x2f, 0xfd}, 4, CTAR_ZSTD_MAX_LEVEL, false, ctar_zstd_compress, ctar_zstd_decompress},
+#endif
+};
+
+/** @brief Arguments of a stream thread */
+typedef struct ctar_codec_job
+{
+  int fd_in;
+  int fd_out;
+  const ctar_codec *codec; // NULL to copy fd_in as is
+  ctar_args *args;
+  unsigned char prefix[CTAR_CODEC_MAGIC_SIZE]; // Bytes already read from fd_in
+  size_t prefix_len;
+} ctar_codec_job;
+
+const ctar_codec *ctar_codec_get(ctar_codec_id id)
+{
+  for (size_t i = 0; i < sizeof(ctar_codecs) / sizeof(ctar_codec); i++)
+  {
+    if (ctar_codecs[i].id == id)
+    {
+      return &ctar_codecs[i];
+    }
+  }
+
+  return NULL;
+}
+
+const ctar_codec *ctar_codec_detect(const unsigned char *magic, size_t size)
+{
+  for (size_t i = 0; i < sizeof(ctar_codecs) / sizeof(ctar_codec); i++)
+  {
+    if (size >= ctar_codecs[i].magic_size && memcmp(magic, ctar_codecs[i].magic, ctar_codecs[i].magic_size) == 0)
+    {
+      return &ctar_codecs[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Body of the compression thread.
+ *
+ * @param arg The @ref ctar_codec_job of the thread, freed before returning.
+ * @return void* 0 if successful, -1 otherwise.
+ */
+static void *ctar_compress_worker(void *arg)
+{
+  ctar_codec_job *job = arg;
+  intptr_t status = job->codec->compress(job->fd_out, job->fd_in, job->args);
+
+  // Closing the read end makes any further write to the pipe fail with EPIPE
+  close(job->fd_in);
+  free(job);
+
+  return (void *)status;
+}
+
+/**
+ * @brief Copy prefix then fd_in into fd_out.
+ *
+ * @note This function will close fd_in but not fd_out.
+ * @note If the reader of fd_out goes away (EPIPE), copying stops successfully.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_codec_copy(int fd_in, int fd_out, unsigned char *prefix, size_t prefix_len)
+{
+  unsigned char *buf = malloc(CTAR_CODEC_COPY_SIZE);
+  if (buf == NULL)
+  {
+    perror("Unable to allocate copy buffer");
+    close(fd_in);
+    return -1;
+  }
+
+  int status = 0;
+  memcpy(buf, prefix, prefix_len);
+  ssize_t nbytes = prefix_len;
+  do
+  {
+    if (write_full(fd_out, buf, nbytes) == -1)
+    {
+      if (errno != EPIPE)
+      {
+        perror("Unable to write archive");
+        status = -1;
+      }
+      break;
+    }
+  } while ((nbytes = read(fd_in, buf, CTAR_CODEC_COPY_SIZE)) > 0);
+
+  if (nbytes == -1)
+  {
+    perror("Unable to read archive");
+    status = -1;
+  }
+
+  free(buf);
+  close(fd_in);
+  return status;
+}
+
+/**
+ * @brief Body of the thread replaying the prefix of a job in front of the rest of its input.
+ *
+ * @param arg The @ref ctar_codec_job of the decompression thread.
+ * @return void* 0 if successful, -1 otherwise.
+ */
+static void *ctar_replay_worker(void *arg)
+{
+  ctar_codec_job *job = arg;
+  intptr_t status = ctar_codec_copy(job->fd_in, job->fd_out, job->prefix, job->prefix_len);
+
+  // Closing the write end signals the end of the input to the decompression thread
+  close(job->fd_out);
+
+  return (void *)status;
+}
+
+/**
+ * @brief Decompress a job whose prefix was already read from its input.
+ *
+ * The codecs read their input from a file descriptor, so the prefix and the rest of the input
+ * are copied by another thread into a pipe read by the codec.
+ *
+ * @note This function will close job->fd_in but not job->fd_out.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_decompress_replayed(ctar_codec_job *job)
+{
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+  {
+    perror("Unable to create pipe");
+    close(job->fd_in);
+    return -1;
+  }
+
+  ctar_codec_job replay = *job;
+  replay.fd_out = pipefd[1];
+
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, ctar_replay_worker, &replay);
+  if (err != 0)
+  {
+    fprintf(stderr, "Unable to start replay thread: %s\n", strerror(err));
+    close(job->fd_in);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -1;
+  }
+
+  // Closing the read end once decompressed stops the replay thread if the input is not read entirely
+  int status = job->codec->decompress(pipefd[0], job->fd_out, job->args);
+
+  void *replay_status;
+  pthread_join(thread, &replay_status);
+  return status == 0 && (intptr_t)replay_status == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Body of the decompression thread.
+ *
+ * @param arg The @ref ctar_codec_job of the thread, freed before returning.
+ * @return void* 0 if successful, -1 otherwise.
+ */
+static void *ctar_decompress_worker(void *arg)
+{
+  ctar_codec_job *job = arg;
+  intptr_t status;
+  if (job->codec == NULL)
+  {
+    status = ctar_codec_copy(job->fd_in, job->fd_out, job->prefix, job->prefix_len);
+  }
+  else if (job->prefix_len > 0)
+  {
+    status = ctar_decompress_replayed(job);
+  }
+  else
+  {
+    status = job->codec->decompress(job->fd_in, job->fd_out, job->args);
+  }
+
+  // Closing the write end signals the end of the archive to the reader
+  close(job->fd_out);
+  free(job);
+
+  return (void *)status;
+}
+
+/**
+ * @brief Start a thread running worker with a job made of fd_in and fd_out.
+ *
+ * @param worker The body of the thread.
+ * @param fd_in The input file descriptor of the job.
+ * @param fd_out The output file descriptor of the job.
+ * @param prefix The bytes already read from fd_in, may be NULL.
+ * @param prefix_len The number of bytes already read from fd_in, at most CTAR_CODEC_MAGIC_SIZE.
+ * @param args The arguments of the program, args->stream_thread is set to the thread.
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_stream_start(void *(*worker)(void *), int fd_in, int fd_out, const unsigned char *prefix, size_t prefix_len, ctar_args *args)
+{
+  // Without compression, the job is a plain copy
+  const ctar_codec *codec = ctar_codec_get(args->codec);
+  if (args->compress && codec == NULL)
+  {
+    fprintf(stderr, "Unsupported compression format, ctar was built without it\n");
+    return -1;
+  }
+
+  ctar_codec_job *job = malloc(sizeof(ctar_codec_job));
+  if (job == NULL)
+  {
+    perror("Unable to allocate stream job");
+    return -1;
+  }
+  job->fd_in = fd_in;
+  job->fd_out = fd_out;
+  job->codec = args->compress ? codec : NULL;
+  job->args = args;
+  job->prefix_len = prefix_len;
+  if (prefix_len > 0)
+  {
+    memcpy(job->prefix, prefix, prefix_len);
+  }
+
+  // A stream thread writing to a closed pipe must get EPIPE instead of killing the process
+  signal(SIGPIPE, SIG_IGN);
+
+  int err = pthread_create(&args->stream_thread, NULL, worker, job);
+  if (err != 0)
+  {
+    fprintf(stderr, "Unable to start stream thread: %s\n", strerror(err));
+    free(job);
+    return -1;
+  }
+  args->stream = true;
+
+  return 0;
+}
+
+/**
+ * The archive is compressed on the fly by a thread reading the other end of a pipe,
+ * so the uncompressed archive never touches the disk and memory usage stays bounded
+ * by the pipe capacity and the buffers of the codec.
+ *
+ * If the codec supports it, args->adapt is allocated so that ctar_create() can lower
+ * the compression level of incompressible entries.
+ */
+int ctar_compress_stream(ctar_args *args, int fd_out)
+{
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+  {
+    perror("Unable to create pipe");
+    close(fd_out);
+    return -1;
+  }
+
+  const ctar_codec *codec = ctar_codec_get(args->codec);
+  if (codec != NULL && codec->adaptive && args->level != 0)
+  {
+    // Without a level map, every entry is compressed at the level of the archive
+    args->adapt = ctar_adapt_new();
+  }
+
+  if (ctar_stream_start(ctar_compress_worker, pipefd[0], fd_out, NULL, 0, args) == -1)
+  {
+    close(fd_out);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    ctar_adapt_free(args->adapt);
+    args->adapt = NULL;
+    return -1;
+  }
+
+  return pipefd[1];
+}
+
+/**
+ * The archive is decompressed on the fly by a thread writing to the other end of a pipe,
+ * so the reader gets the first headers as soon as they are inflated.
+ */
+int ctar_decompress_stream(ctar_args *args, int fd_in, const unsigned char *prefix, size_t prefix_len)
+{
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+  {
+    perror("Unable to create pipe");
+    close(fd_in);
+    return -1;
+  }
+
+  // The checkpoint index is opened before ctar_chdir() moves to args->dir
+  if ((args->codec == CTAR_CODEC_GZIP && ctar_zran_open(args) == -1) ||
+      ctar_stream_start(ctar_decompress_worker, fd_in, pipefd[1], prefix, prefix_len, args) == -1)
+  {
+    if (args->index_fd != -1)
+    {
+      close(args->index_fd);
+      args->index_fd = -1;
+    }
+    close(fd_in);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -1;
+  }
+
+  return pipefd[0];
+}
+
+int ctar_stream_join(ctar_args *args)
+{
+  void *status;
+  int err = pthread_join(args->stream_thread, &status);
+
+  // The compression thread was the last reader of the level map
+  ctar_adapt_free(args->adapt);
+  args->adapt = NULL;
+
+  if (err != 0)
+  {
+    fprintf(stderr, "Unable to join stream thread: %s\n", strerror(err));
+    return -1;
+  }
+
+  return (intptr_t)status == 0 ? 0 : -1;
+}
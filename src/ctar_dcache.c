@@ -0,0 +1,175 @@
+#define _GNU_SOURCE // O_PATH
+#include "ctar_dcache.h"
+#include <errno.h>
+#include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void ctar_dcache_open(ctar_dcache *cache)
+{
+  memset(cache, 0, sizeof(ctar_dcache));
+  for (int i = 0; i < CTAR_DCACHE_SIZE; i++)
+  {
+    cache->slots[i].fd = -1;
+  }
+}
+
+/**
+ * @brief Find an open directory.
+ *
+ * @return int the file descriptor of the directory, -1 if it is not open.
+ */
+static int ctar_dcache_find(ctar_dcache *cache, const char *path, size_t len)
+{
+  // Files of the same directory usually follow each other
+  ctar_dcache_slot *slot = &cache->slots[cache->last];
+  for (int i = -1; i < CTAR_DCACHE_SIZE; i++)
+  {
+    if (i >= 0)
+    {
+      slot = &cache->slots[i];
+    }
+
+    if (slot->fd != -1 && slot->len == len && memcmp(slot->path, path, len) == 0)
+    {
+      cache->last = slot - cache->slots;
+      slot->used = ++cache->clock;
+      return slot->fd;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Keep a directory open, in the place of the least recently used one.
+ */
+static void ctar_dcache_insert(ctar_dcache *cache, const char *path, size_t len, int fd)
+{
+  ctar_dcache_slot *victim = &cache->slots[0];
+  for (int i = 1; i < CTAR_DCACHE_SIZE && victim->fd != -1; i++)
+  {
+    if (cache->slots[i].fd == -1 || cache->slots[i].used < victim->used)
+    {
+      victim = &cache->slots[i];
+    }
+  }
+
+  if (victim->fd != -1)
+  {
+    close(victim->fd);
+  }
+  victim->fd = fd;
+  victim->len = len;
+  victim->used = ++cache->clock;
+  memcpy(victim->path, path, len);
+  victim->path[len] = '\0';
+  cache->last = victim - cache->slots;
+}
+
+/**
+ * @brief Get the directory of the first len bytes of a path, creating it and its missing ancestors.
+ *
+ * The directory is opened first, and only created if it does not exist,
+ * so extracting over an existing tree costs a single syscall per directory.
+ *
+ * @return int the file descriptor of the directory (AT_FDCWD for an empty path), -1 on failure.
+ */
+static int ctar_dcache_dir(ctar_dcache *cache, const char *path, size_t len)
+{
+  while (len > 1 && path[len - 1] == '/')
+  {
+    len--;
+  }
+
+  if (len == 0)
+  {
+    return AT_FDCWD;
+  }
+
+  int fd = ctar_dcache_find(cache, path, len);
+  if (fd != -1)
+  {
+    return fd;
+  }
+
+  // Split the last component
+  size_t start = len;
+  while (start > 0 && path[start - 1] != '/')
+  {
+    start--;
+  }
+
+  int parent_fd = AT_FDCWD;
+  char name[NAME_MAX + 1];
+  if (start == 0 || len - start > NAME_MAX)
+  {
+    snprintf(name, sizeof(name), "%.*s", (int)len, path);
+  }
+  else
+  {
+    // The root directory is its own parent
+    parent_fd = ctar_dcache_dir(cache, path, start == 1 ? 1 : start - 1);
+    if (parent_fd == -1)
+    {
+      return -1;
+    }
+    snprintf(name, sizeof(name), "%.*s", (int)(len - start), path + start);
+  }
+
+  fd = openat(parent_fd, name, O_PATH | O_DIRECTORY);
+  if (fd == -1 && errno == ENOENT)
+  {
+    if (mkdirat(parent_fd, name, 0755) == -1 && errno != EEXIST)
+    {
+      return -1;
+    }
+    fd = openat(parent_fd, name, O_PATH | O_DIRECTORY);
+  }
+
+  if (fd == -1)
+  {
+    return -1;
+  }
+
+  ctar_dcache_insert(cache, path, len, fd);
+  return fd;
+}
+
+int ctar_dcache_parent(ctar_dcache *cache, const char *path, const char **name)
+{
+  size_t len = strlen(path);
+  while (len > 1 && path[len - 1] == '/')
+  {
+    len--;
+  }
+
+  size_t start = len;
+  while (start > 0 && path[start - 1] != '/')
+  {
+    start--;
+  }
+  *name = path + start;
+
+  if (start == 0)
+  {
+    return AT_FDCWD;
+  }
+
+  return ctar_dcache_dir(cache, path, start == 1 ? 1 : start - 1);
+}
+
+void ctar_dcache_close(ctar_dcache *cache)
+{
+  for (int i = 0; i < CTAR_DCACHE_SIZE; i++)
+  {
+    if (cache->slots[i].fd != -1)
+    {
+      close(cache->slots[i].fd);
+      cache->slots[i].fd = -1;
+    }
+  }
+}
@@ -0,0 +1,165 @@
+#define _GNU_SOURCE // getdents64(), statx()
+#include "ctar_dir.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/sysmacros.h>
+
+/**
+ * @brief Read the next batch of entries, appended to the entries read if append is set.
+ *
+ * @return ssize_t the number of bytes read, 0 at the end of the directory, -1 on failure.
+ */
+static ssize_t ctar_dir_read(ctar_dir *dir, bool append)
+{
+  size_t start = append ? dir->len : 0;
+  unsigned char *buf = realloc(dir->buf, start + CTAR_DIR_BATCH_SIZE);
+  if (buf == NULL)
+  {
+    return -1;
+  }
+  dir->buf = buf;
+
+  ssize_t nbytes = getdents64(dir->fd, dir->buf + start, CTAR_DIR_BATCH_SIZE);
+  if (nbytes == -1)
+  {
+    return -1;
+  }
+
+  dir->len = start + nbytes;
+  dir->pos = start;
+  return nbytes;
+}
+
+static int ctar_dir_compare(const void *a, const void *b)
+{
+  ino_t ino_a = ((const ctar_dir_slot *)a)->ino;
+  ino_t ino_b = ((const ctar_dir_slot *)b)->ino;
+  return ino_a < ino_b ? -1 : ino_a > ino_b;
+}
+
+/**
+ * @brief Read all the entries, and sort them by inode number.
+ */
+static int ctar_dir_sort(ctar_dir *dir)
+{
+  ssize_t nbytes;
+  while ((nbytes = ctar_dir_read(dir, true)) > 0)
+  {
+  }
+
+  if (nbytes == -1)
+  {
+    return -1;
+  }
+
+  size_t capacity = 0;
+  for (size_t pos = 0; pos < dir->len;)
+  {
+    struct dirent64 *entry = (struct dirent64 *)(dir->buf + pos);
+    if (dir->count == capacity)
+    {
+      capacity = capacity == 0 ? 64 : 2 * capacity;
+      ctar_dir_slot *slots = realloc(dir->slots, capacity * sizeof(ctar_dir_slot));
+      if (slots == NULL)
+      {
+        return -1;
+      }
+      dir->slots = slots;
+    }
+
+    dir->slots[dir->count].ino = entry->d_ino;
+    dir->slots[dir->count].offset = pos;
+    dir->count++;
+    pos += entry->d_reclen;
+  }
+
+  if (dir->slots != NULL)
+  {
+    qsort(dir->slots, dir->count, sizeof(ctar_dir_slot), ctar_dir_compare);
+  }
+  return 0;
+}
+
+int ctar_dir_open(ctar_dir *dir, int fd, bool sort)
+{
+  memset(dir, 0, sizeof(ctar_dir));
+  dir->fd = fd;
+
+  dir->sorted = sort;
+  if (sort && ctar_dir_sort(dir) == -1)
+  {
+    int err = errno;
+    ctar_dir_close(dir);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+int ctar_dir_next(ctar_dir *dir, const char **name, unsigned char *type)
+{
+  struct dirent64 *entry;
+  do
+  {
+    if (dir->sorted)
+    {
+      if (dir->index == dir->count)
+      {
+        return 0;
+      }
+      entry = (struct dirent64 *)(dir->buf + dir->slots[dir->index++].offset);
+    }
+    else
+    {
+      if (dir->pos == dir->len)
+      {
+        ssize_t nbytes = ctar_dir_read(dir, false);
+        if (nbytes <= 0)
+        {
+          return nbytes;
+        }
+      }
+      entry = (struct dirent64 *)(dir->buf + dir->pos);
+      dir->pos += entry->d_reclen;
+    }
+  } while (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0);
+
+  *name = entry->d_name;
+  *type = entry->d_type;
+  return 1;
+}
+
+void ctar_dir_close(ctar_dir *dir)
+{
+  free(dir->slots);
+  free(dir->buf);
+  dir->slots = NULL;
+  dir->buf = NULL;
+}
+
+/**
+ * Falls back to fstatat() on kernels without statx() (before Linux 4.11).
+ */
+int ctar_dir_stat(int dir_fd, const char *name, struct stat *st)
+{
+  struct statx stx;
+  unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_INO | STATX_SIZE | STATX_MTIME;
+  if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, mask, &stx) == -1)
+  {
+    return errno == ENOSYS ? fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW) : -1;
+  }
+
+  memset(st, 0, sizeof(struct stat));
+  st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  st->st_ino = stx.stx_ino;
+  st->st_mode = stx.stx_mode;
+  st->st_uid = stx.stx_uid;
+  st->st_gid = stx.stx_gid;
+  st->st_size = stx.stx_size;
+  st->st_mtime = stx.stx_mtime.tv_sec;
+  return 0;
+}
@@ -0,0 +1,537 @@
+#include "ctar_gzindex.h"
+#include "ctar_zlib.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/** @brief Compressed output of ctar_compress_seekable() */
+typedef struct ctar_gzindex_writer
+{
+  int fd_out;
+  z_stream strm;
+  uint64_t offset;        // Number of compressed bytes written
+  uint64_t member_offset; // Offset of the current member
+  uint64_t member_in;     // Number of uncompressed bytes in the current member
+  long in;                // Number of uncompressed bytes compressed
+  int level;              // Compression level of the archive
+  int current;            // Compression level of the stream
+  ctar_adapt *adapt;
+  unsigned char out[CTAR_ZLIB_CHUNK];
+} ctar_gzindex_writer;
+
+static void ctar_gzindex_put16(unsigned char *buf, uint16_t value)
+{
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+}
+
+static uint16_t ctar_gzindex_get16(unsigned char *buf)
+{
+  return buf[0] | (buf[1] << 8);
+}
+
+static int ctar_gzindex_add(ctar_gzindex *index, uint64_t member_offset, uint64_t skip, char *name)
+{
+  if (index->count == index->capacity)
+  {
+    size_t capacity = index->capacity ? 2 * index->capacity : 64;
+    ctar_gzindex_entry *entries = realloc(index->entries, capacity * sizeof(ctar_gzindex_entry));
+    if (entries == NULL)
+    {
+      perror("Unable to allocate index");
+      return -1;
+    }
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+
+  ctar_gzindex_entry *entry = &index->entries[index->count++];
+  entry->member_offset = member_offset;
+  entry->skip = skip;
+  snprintf(entry->name, sizeof(entry->name), "%.*s", CTAR_NAME_SIZE, name);
+  return 0;
+}
+
+static int ctar_gzindex_deflate_segment(ctar_gzindex_writer *writer, unsigned char *buf, size_t len, int flush)
+{
+  writer->strm.next_in = buf;
+  writer->strm.avail_in = len;
+  writer->member_in += len;
+  writer->in += len;
+
+  do
+  {
+    writer->strm.next_out = writer->out;
+    writer->strm.avail_out = CTAR_ZLIB_CHUNK;
+    if (deflate(&writer->strm, flush) == Z_STREAM_ERROR)
+    {
+      fprintf(stderr, "Unable to compress archive\n");
+      return -1;
+    }
+
+    size_t have = CTAR_ZLIB_CHUNK - writer->strm.avail_out;
+    if (write_full(writer->fd_out, writer->out, have) == -1)
+    {
+      perror("Unable to write compressed file");
+      return -1;
+    }
+    writer->offset += have;
+  } while (writer->strm.avail_out == 0);
+
+  return 0;
+}
+
+/**
+ * The level of the stream is changed wherever the level map of the writer says so,
+ * after flushing the data compressed at the previous level.
+ */
+static int ctar_gzindex_deflate(ctar_gzindex_writer *writer, unsigned char *buf, size_t len, int flush)
+{
+  size_t pos = 0;
+  do
+  {
+    int level;
+    size_t segment = ctar_adapt_segment(writer->adapt, writer->in, len - pos, writer->level, &level);
+    if (level != writer->current)
+    {
+      if (ctar_gzindex_deflate_segment(writer, NULL, 0, Z_BLOCK) == -1)
+      {
+        return -1;
+      }
+
+      writer->strm.next_out = writer->out;
+      writer->strm.avail_out = CTAR_ZLIB_CHUNK;
+      if (deflateParams(&writer->strm, level, Z_DEFAULT_STRATEGY) != Z_OK ||
+          write_full(writer->fd_out, writer->out, CTAR_ZLIB_CHUNK - writer->strm.avail_out) == -1)
+      {
+        fprintf(stderr, "Unable to change compression level\n");
+        return -1;
+      }
+      writer->offset += CTAR_ZLIB_CHUNK - writer->strm.avail_out;
+      writer->current = level;
+    }
+
+    if (ctar_gzindex_deflate_segment(writer, buf + pos, segment, pos + segment == len ? flush : Z_NO_FLUSH) == -1)
+    {
+      return -1;
+    }
+    pos += segment;
+  } while (pos < len);
+
+  ctar_adapt_consume(writer->adapt, writer->in);
+  return 0;
+}
+
+/**
+ * @brief Finish the current gzip member and start a new one at the current offset.
+ */
+static int ctar_gzindex_new_member(ctar_gzindex_writer *writer)
+{
+  if (ctar_gzindex_deflate(writer, NULL, 0, Z_FINISH) == -1 || deflateReset(&writer->strm) != Z_OK)
+  {
+    return -1;
+  }
+
+  writer->member_offset = writer->offset;
+  writer->member_in = 0;
+  return 0;
+}
+
+/**
+ * The data of the member is empty, so the member adds nothing to the output of gunzip.
+ */
+static int ctar_gzindex_write_member(int fd_out, char id, unsigned char *data, uint16_t len)
+{
+  // Magic, deflate method, FEXTRA flag, no mtime, no extra flags, Unix OS, then a single subfield
+  unsigned char header[16] = {0x1f, 0x8b, Z_DEFLATED, 0x04, 0, 0, 0, 0, 0, 3};
+  ctar_gzindex_put16(header + 10, len + 4);
+  header[12] = 'C';
+  header[13] = id;
+  ctar_gzindex_put16(header + 14, len);
+
+  // Empty final block with fixed codes, then CRC32 and size of no data
+  unsigned char trailer[10] = {0x03, 0x00};
+
+  if (write_full(fd_out, header, sizeof(header)) == -1 ||
+      write_full(fd_out, data, len) == -1 ||
+      write_full(fd_out, trailer, sizeof(trailer)) == -1)
+  {
+    perror("Unable to write archive index");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * The index is stored in the extra field of empty gzip members ('C', 'T' subfields),
+ * followed by an empty member whose extra field holds the offset of the index ('C', 'F' subfield).
+ * Each record of the index is made of:
+ * - the offset of the member holding the header (64 bits, little endian)
+ * - the offset of the header in the uncompressed data of the member (64 bits, little endian)
+ * - the length of the name (8 bits) followed by the name
+ */
+static int ctar_gzindex_write(int fd_out, ctar_gzindex *index, uint64_t index_offset)
+{
+  unsigned char *field = malloc(CTAR_GZINDEX_FIELD_SIZE);
+  if (field == NULL)
+  {
+    perror("Unable to allocate archive index");
+    return -1;
+  }
+
+  size_t len = 0;
+  for (size_t i = 0; i <= index->count; i++)
+  {
+    size_t name_len = i < index->count ? strlen(index->entries[i].name) : 0;
+    size_t record_len = 8 + 8 + 1 + name_len;
+
+    // Flush the subfield when full, and at the end of the index
+    if (len > 0 && (i == index->count || len + record_len > CTAR_GZINDEX_FIELD_SIZE))
+    {
+      if (ctar_gzindex_write_member(fd_out, 'T', field, len) == -1)
+      {
+        free(field);
+        return -1;
+      }
+      len = 0;
+    }
+
+    if (i == index->count)
+    {
+      break;
+    }
+
+    put_le64(field + len, index->entries[i].member_offset);
+    put_le64(field + len + 8, index->entries[i].skip);
+    field[len + 16] = name_len;
+    memcpy(field + len + 17, index->entries[i].name, name_len);
+    len += record_len;
+  }
+  free(field);
+
+  unsigned char footer[8];
+  put_le64(footer, index_offset);
+  return ctar_gzindex_write_member(fd_out, 'F', footer, sizeof(footer));
+}
+
+/**
+ * The tar stream is followed block by block to find the headers.
+ * A new member is started before a header once the current member holds member_size bytes,
+ * so each entry lies in a single member which can be inflated on its own.
+ *
+ * @note This function will close fd_out but not fd_in.
+ */
+int ctar_compress_seekable(int fd_out, int fd_in, long member_size, int level, ctar_adapt *adapt)
+{
+  ctar_gzindex_writer writer;
+  memset(&writer, 0, sizeof(writer));
+  writer.fd_out = fd_out;
+  writer.level = level == -1 ? Z_DEFAULT_COMPRESSION : level;
+  writer.current = writer.level;
+  writer.adapt = adapt;
+  if (deflateInit2(&writer.strm, writer.level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    fprintf(stderr, "Unable to initialize compression\n");
+    close(fd_out);
+    return -1;
+  }
+
+  ctar_gzindex index = {NULL, 0, 0};
+  unsigned char buf[CTAR_ZLIB_CHUNK];
+  long long nblocks = 0; // Number of data blocks before the next header
+  int status = 0;
+  ssize_t nbytes;
+
+  while (status == 0 && (nbytes = read_full(fd_in, buf, CTAR_ZLIB_CHUNK)) > 0)
+  {
+    size_t start = 0;
+    for (size_t pos = 0; status == 0 && pos + CTAR_BLOCK_SIZE <= nbytes; pos += CTAR_BLOCK_SIZE)
+    {
+      ctar_header *header = (ctar_header *)(buf + pos);
+      if (nblocks > 0)
+      {
+        nblocks--;
+        continue;
+      }
+
+      if (is_header_blank(header))
+      {
+        continue;
+      }
+      nblocks = get_nblocks(header);
+
+      if (writer.member_in + (pos - start) >= member_size)
+      {
+        status = ctar_gzindex_deflate(&writer, buf + start, pos - start, Z_NO_FLUSH);
+        status = status == 0 ? ctar_gzindex_new_member(&writer) : -1;
+        start = pos;
+      }
+
+      if (status == 0)
+      {
+        status = ctar_gzindex_add(&index, writer.member_offset, writer.member_in + (pos - start), header->name);
+      }
+    }
+
+    if (status == 0)
+    {
+      status = ctar_gzindex_deflate(&writer, buf + start, nbytes - start, Z_NO_FLUSH);
+    }
+  }
+
+  if (status == 0 && nbytes == -1)
+  {
+    perror("Unable to read uncompressed file");
+    status = -1;
+  }
+
+  if (status == 0)
+  {
+    status = ctar_gzindex_deflate(&writer, NULL, 0, Z_FINISH);
+  }
+
+  if (status == 0)
+  {
+    status = ctar_gzindex_write(fd_out, &index, writer.offset);
+  }
+
+  deflateEnd(&writer.strm);
+  free(index.entries);
+
+  if (close(fd_out) == -1)
+  {
+    perror("Unable to close compressed file");
+    return -1;
+  }
+
+  return status;
+}
+
+/**
+ * @return int 0 if successful, 1 if fd has no index, -1 otherwise.
+ */
+static int ctar_gzindex_load(int fd, ctar_gzindex *index)
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < CTAR_GZINDEX_FOOTER_SIZE)
+  {
+    return 1;
+  }
+
+  unsigned char footer[CTAR_GZINDEX_FOOTER_SIZE];
+  off_t footer_offset = st.st_size - CTAR_GZINDEX_FOOTER_SIZE;
+  if (pread(fd, footer, sizeof(footer), footer_offset) != sizeof(footer))
+  {
+    return 1;
+  }
+
+  unsigned char magic[16] = {0x1f, 0x8b, Z_DEFLATED, 0x04, 0, 0, 0, 0, 0, 3, 12, 0, 'C', 'F', 8, 0};
+  uint64_t index_offset = get_le64(footer + 16);
+  if (memcmp(footer, magic, sizeof(magic)) != 0 || index_offset > footer_offset)
+  {
+    return 1;
+  }
+
+  size_t len = footer_offset - index_offset;
+  unsigned char *buf = malloc(len);
+  if (buf == NULL || pread(fd, buf, len, index_offset) != len)
+  {
+    perror("Unable to read archive index");
+    free(buf);
+    return -1;
+  }
+
+  int status = 0;
+  for (size_t pos = 0; status == 0 && pos < len;)
+  {
+    uint16_t field_len = pos + 16 <= len ? ctar_gzindex_get16(buf + pos + 14) : 0;
+    if (pos + 16 + field_len + 10 > len || buf[pos + 12] != 'C' || buf[pos + 13] != 'T')
+    {
+      fprintf(stderr, "Invalid archive index\n");
+      status = -1;
+      break;
+    }
+
+    unsigned char *field = buf + pos + 16;
+    for (size_t i = 0; status == 0 && i < field_len;)
+    {
+      // Each entry must lie in the field, names included
+      size_t name_len = i + 17 <= field_len ? field[i + 16] : 0;
+      if (i + 17 > field_len || i + 17 + name_len > field_len)
+      {
+        fprintf(stderr, "Invalid archive index\n");
+        status = -1;
+        break;
+      }
+
+      char name[CTAR_NAME_SIZE + 1];
+      snprintf(name, sizeof(name), "%.*s", (int)name_len, field + i + 17);
+      status = ctar_gzindex_add(index, get_le64(field + i), get_le64(field + i + 8), name);
+      i += 17 + name_len;
+    }
+
+    pos += 16 + field_len + 10;
+  }
+
+  free(buf);
+  return status;
+}
+
+/**
+ * @brief Open a gzip stream positioned at the header of an entry.
+ *
+ * @return gzFile the gzip stream if successful, NULL otherwise.
+ */
+static gzFile ctar_gzindex_seek(int fd, ctar_gzindex_entry *entry)
+{
+  int gz_fd = dup(fd);
+  if (gz_fd == -1 || lseek(gz_fd, entry->member_offset, SEEK_SET) == -1)
+  {
+    perror("Unable to seek archive");
+    return NULL;
+  }
+
+  gzFile file = gzdopen(gz_fd, "rb");
+  if (file == NULL)
+  {
+    perror("Unable to open compressed file");
+    close(gz_fd);
+    return NULL;
+  }
+
+  // Skip the entries preceding this one in the member
+  char buf[CTAR_ZLIB_CHUNK];
+  for (uint64_t skip = entry->skip; skip > 0;)
+  {
+    int nbytes = gzread(file, buf, skip < CTAR_ZLIB_CHUNK ? skip : CTAR_ZLIB_CHUNK);
+    if (nbytes <= 0)
+    {
+      fprintf(stderr, "Unable to seek compressed file\n");
+      gzclose(file);
+      return NULL;
+    }
+    skip -= nbytes;
+  }
+
+  return file;
+}
+
+/**
+ * @brief Copy the entry at the current position of file into fd_out.
+ *
+ * @return int 0 if successful, 1 if the reader of fd_out went away, -1 otherwise.
+ */
+static int ctar_gzindex_copy_entry(gzFile file, int fd_out)
+{
+  char buf[CTAR_ZLIB_CHUNK];
+  ctar_header *header = (ctar_header *)buf;
+  if (gzread(file, header, sizeof(ctar_header)) != sizeof(ctar_header))
+  {
+    fprintf(stderr, "Unable to read compressed file\n");
+    return -1;
+  }
+
+  uint64_t remaining = (uint64_t)get_nblocks(header) * CTAR_BLOCK_SIZE;
+  int nbytes = sizeof(ctar_header);
+  while (true)
+  {
+    if (write_full(fd_out, buf, nbytes) == -1)
+    {
+      if (errno == EPIPE)
+      {
+        return 1;
+      }
+
+      perror("Unable to write decompressed file");
+      return -1;
+    }
+
+    if (remaining == 0)
+    {
+      return 0;
+    }
+
+    nbytes = gzread(file, buf, remaining < CTAR_ZLIB_CHUNK ? remaining : CTAR_ZLIB_CHUNK);
+    if (nbytes <= 0)
+    {
+      fprintf(stderr, "Unable to read compressed file\n");
+      return -1;
+    }
+    remaining -= nbytes;
+  }
+}
+
+/**
+ * The output is a tar stream made of the selected entries only, followed by the end of archive.
+ * Consecutive entries are inflated in a single pass, otherwise the member of the entry is
+ * inflated from its beginning.
+ *
+ * @note This function will close fd_in unless it returns 1, in which case fd_in is left untouched.
+ */
+int ctar_decompress_indexed(int fd_in, int fd_out, char **files)
+{
+  ctar_gzindex index = {NULL, 0, 0};
+  int status = ctar_gzindex_load(fd_in, &index);
+  if (status != 0)
+  {
+    free(index.entries);
+    if (status == -1)
+    {
+      close(fd_in);
+    }
+    return status;
+  }
+
+  gzFile file = NULL;
+  size_t next = index.count; // Entry at the current position of file
+  for (size_t i = 0; status == 0 && i < index.count; i++)
+  {
+    if (!is_name_selected(index.entries[i].name, files))
+    {
+      continue;
+    }
+
+    if (file == NULL || next != i)
+    {
+      if (file != NULL)
+      {
+        gzclose(file);
+      }
+
+      file = ctar_gzindex_seek(fd_in, &index.entries[i]);
+      if (file == NULL)
+      {
+        status = -1;
+        break;
+      }
+    }
+
+    status = ctar_gzindex_copy_entry(file, fd_out);
+    next = i + 1;
+  }
+
+  if (file != NULL)
+  {
+    gzclose(file);
+  }
+  free(index.entries);
+  close(fd_in);
+
+  if (status == 0)
+  {
+    char end_of_archive[2 * CTAR_BLOCK_SIZE];
+    memset(end_of_archive, 0, sizeof(end_of_archive));
+    if (write_full(fd_out, end_of_archive, sizeof(end_of_archive)) == -1 && errno != EPIPE)
+    {
+      perror("Unable to write decompressed file");
+      status = -1;
+    }
+  }
+
+  // Status 1 means the reader does not need the rest of the archive
+  return status == -1 ? -1 : 0;
+}
@@ -0,0 +1,326 @@
+#include "ctar_jobs.h"
+#include "ctar.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/** @brief Regular file queued for the threads */
+typedef struct ctar_jobs_file
+{
+  bool busy; // Whether the file is queued or being extracted
+  char name[CTAR_NAME_SIZE + 1];
+  int mode;
+  long size;
+  const unsigned char *data; // Data of the file, in the mapping of the archive or in buf
+  size_t available;          // Size of the data, less than size if the archive is truncated
+  unsigned char *buf;        // Copy of the data, if the archive is not mapped
+} ctar_jobs_file;
+
+/** @brief Extraction threads and the ring of files they work on */
+struct ctar_jobs
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // Broadcast whenever a file is queued or extracted
+  ctar_jobs_file *files;
+  int nfiles;
+  long submitted; // Number of files handed to the threads
+  long taken;     // Number of files picked up by the threads
+  int busy;       // Number of files queued or being extracted
+  int status;     // -1 once a file could not be extracted
+  bool closing;
+  pthread_t *threads;
+  int nthreads;
+  ctar_args *args;
+  ctar_header *links; // Headers of the deferred symbolic links, in the order of the archive
+  int nlinks;
+};
+
+/**
+ * @brief Wait for a queued file.
+ *
+ * @return ctar_jobs_file* the file to extract, NULL if the threads are stopping.
+ */
+static ctar_jobs_file *ctar_jobs_take(ctar_jobs *jobs)
+{
+  pthread_mutex_lock(&jobs->lock);
+  while (jobs->taken == jobs->submitted && !jobs->closing)
+  {
+    pthread_cond_wait(&jobs->cond, &jobs->lock);
+  }
+
+  ctar_jobs_file *file = NULL;
+  if (jobs->taken < jobs->submitted)
+  {
+    file = &jobs->files[jobs->taken % jobs->nfiles];
+    jobs->taken++;
+  }
+  pthread_mutex_unlock(&jobs->lock);
+
+  return file;
+}
+
+static void *ctar_jobs_worker(void *arg)
+{
+  ctar_jobs *jobs = arg;
+
+  // Each thread keeps its own directories open, so they are looked up without locking
+  ctar_dcache dirs;
+  ctar_dcache_open(&dirs);
+
+  ctar_jobs_file *file;
+  while ((file = ctar_jobs_take(jobs)) != NULL)
+  {
+    int status = -1;
+    int out_fd = ctar_extract_open(&dirs, file->name, file->mode, file->size);
+    if (out_fd != -1)
+    {
+      ctar_cache out;
+      ctar_cache_open(&out, out_fd, 0, jobs->args->drop_cache, true);
+      status = ctar_extract_buffer(file->data, file->available, &out);
+      status = ctar_extract_close(jobs->args, &out, file->size, status);
+    }
+
+    pthread_mutex_lock(&jobs->lock);
+    if (status == -1)
+    {
+      jobs->status = -1;
+    }
+    file->busy = false;
+    jobs->busy--;
+    pthread_cond_broadcast(&jobs->cond);
+    pthread_mutex_unlock(&jobs->lock);
+  }
+
+  ctar_dcache_close(&dirs);
+  return NULL;
+}
+
+/**
+ * @brief Wait for all the queued files.
+ *
+ * @return int 0 if every file was extracted, -1 otherwise.
+ */
+static int ctar_jobs_drain(ctar_jobs *jobs)
+{
+  pthread_mutex_lock(&jobs->lock);
+  while (jobs->busy > 0)
+  {
+    pthread_cond_wait(&jobs->cond, &jobs->lock);
+  }
+  int status = jobs->status;
+  pthread_mutex_unlock(&jobs->lock);
+
+  return status;
+}
+
+/**
+ * @brief Wait for all the queued files, then create the deferred symbolic links.
+ *
+ * @return int 0 if every file and link was extracted, -1 otherwise.
+ */
+static int ctar_jobs_flush(ctar_jobs *jobs)
+{
+  int status = ctar_jobs_drain(jobs);
+  for (int i = 0; i < jobs->nlinks; i++)
+  {
+    if (ctar_extract_link(jobs->args->dirs, &jobs->links[i]) == -1)
+    {
+      status = -1;
+    }
+  }
+  jobs->nlinks = 0;
+
+  return status;
+}
+
+/**
+ * @brief Stop the threads once all queued files are extracted and free them.
+ */
+static void ctar_jobs_destroy(ctar_jobs *jobs)
+{
+  pthread_mutex_lock(&jobs->lock);
+  jobs->closing = true;
+  pthread_cond_broadcast(&jobs->cond);
+  pthread_mutex_unlock(&jobs->lock);
+
+  for (int i = 0; i < jobs->nthreads; i++)
+  {
+    pthread_join(jobs->threads[i], NULL);
+  }
+
+  for (int i = 0; jobs->files != NULL && i < jobs->nfiles; i++)
+  {
+    free(jobs->files[i].buf);
+  }
+  free(jobs->files);
+  free(jobs->threads);
+  free(jobs->links);
+  pthread_cond_destroy(&jobs->cond);
+  pthread_mutex_destroy(&jobs->lock);
+  free(jobs);
+}
+
+ctar_jobs *ctar_jobs_new(ctar_args *args)
+{
+  ctar_jobs *jobs = calloc(1, sizeof(ctar_jobs));
+  if (jobs == NULL)
+  {
+    perror("Unable to allocate extraction threads");
+    return NULL;
+  }
+  jobs->args = args;
+  pthread_mutex_init(&jobs->lock, NULL);
+  pthread_cond_init(&jobs->cond, NULL);
+
+  jobs->nfiles = args->jobs * CTAR_JOBS_SLOTS_PER_THREAD;
+  jobs->files = calloc(jobs->nfiles, sizeof(ctar_jobs_file));
+  jobs->threads = calloc(args->jobs, sizeof(pthread_t));
+  jobs->links = malloc(CTAR_JOBS_LINKS_MAX * sizeof(ctar_header));
+  if (jobs->files == NULL || jobs->threads == NULL || jobs->links == NULL)
+  {
+    perror("Unable to allocate extraction threads");
+    ctar_jobs_destroy(jobs);
+    return NULL;
+  }
+
+  for (; jobs->nthreads < args->jobs; jobs->nthreads++)
+  {
+    int err = pthread_create(&jobs->threads[jobs->nthreads], NULL, ctar_jobs_worker, jobs);
+    if (err != 0)
+    {
+      fprintf(stderr, "Unable to start extraction thread: %s\n", strerror(err));
+      ctar_jobs_destroy(jobs);
+      return NULL;
+    }
+  }
+
+  return jobs;
+}
+
+/**
+ * An entry depends on a deferred link if it has its name, or if its path goes through it.
+ */
+int ctar_jobs_wait_name(ctar_jobs *jobs, ctar_header *header)
+{
+  for (int i = 0; i < jobs->nlinks; i++)
+  {
+    size_t len = strnlen(jobs->links[i].name, CTAR_NAME_SIZE);
+    if (strncmp(jobs->links[i].name, header->name, len) == 0 &&
+        (len == CTAR_NAME_SIZE || header->name[len] == '\0' || header->name[len] == '/'))
+    {
+      return ctar_jobs_flush(jobs);
+    }
+  }
+
+  bool queued = false;
+  pthread_mutex_lock(&jobs->lock);
+  for (int i = 0; !queued && i < jobs->nfiles; i++)
+  {
+    queued = jobs->files[i].busy && strncmp(jobs->files[i].name, header->name, CTAR_NAME_SIZE) == 0;
+  }
+  int status = jobs->status;
+  pthread_mutex_unlock(&jobs->lock);
+
+  return queued ? ctar_jobs_drain(jobs) : status;
+}
+
+bool ctar_jobs_accepts(ctar_header *header, ctar_reader *in)
+{
+  return in->map != NULL || oct2dec(header->size, CTAR_SIZE_SIZE) <= CTAR_JOBS_FILE_SIZE;
+}
+
+/**
+ * Files are queued in a ring, so the thread walking the headers waits for the oldest file
+ * of the ring to be extracted once CTAR_JOBS_SLOTS_PER_THREAD files per thread are queued.
+ * This also bounds the memory holding the copies of the data.
+ */
+int ctar_jobs_extract(ctar_jobs *jobs, ctar_header *header, ctar_reader *in)
+{
+  ctar_jobs_file *file = &jobs->files[jobs->submitted % jobs->nfiles];
+
+  // Wait for the slot
+  pthread_mutex_lock(&jobs->lock);
+  while (file->busy && jobs->status == 0)
+  {
+    pthread_cond_wait(&jobs->cond, &jobs->lock);
+  }
+  int status = jobs->status;
+  pthread_mutex_unlock(&jobs->lock);
+
+  if (status == -1)
+  {
+    return -1;
+  }
+
+  // The slot is not used by the threads until it is submitted
+  snprintf(file->name, sizeof(file->name), "%.*s", CTAR_NAME_SIZE, header->name);
+  file->mode = oct2dec(header->mode, CTAR_MODE_SIZE);
+  file->size = oct2dec(header->size, CTAR_SIZE_SIZE);
+  if (in->map != NULL)
+  {
+    file->data = ctar_reader_data(in, header, &file->available);
+  }
+  else
+  {
+    if (file->buf == NULL && (file->buf = malloc(CTAR_JOBS_FILE_SIZE)) == NULL)
+    {
+      perror("Unable to allocate record");
+      return -1;
+    }
+
+    ssize_t nbytes = ctar_reader_read(in, file->buf, (size_t)get_nblocks(header) * CTAR_BLOCK_SIZE);
+    if (nbytes == -1)
+    {
+      perror("Unable to read archive");
+      return -1;
+    }
+    file->available = nbytes < file->size ? nbytes : file->size;
+    file->data = file->buf;
+  }
+
+  pthread_mutex_lock(&jobs->lock);
+  file->busy = true;
+  jobs->busy++;
+  jobs->submitted++;
+  pthread_cond_broadcast(&jobs->cond);
+  pthread_mutex_unlock(&jobs->lock);
+
+  if (file->available < file->size)
+  {
+    fprintf(stderr, "Unexpected end of archive\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int ctar_jobs_symlink(ctar_jobs *jobs, ctar_header *header, ctar_reader *in)
+{
+  if (ctar_reader_skip(in, header) == -1)
+  {
+    perror("Unable to skip data blocks");
+    return -1;
+  }
+
+  if (jobs->nlinks == CTAR_JOBS_LINKS_MAX && ctar_jobs_flush(jobs) == -1)
+  {
+    return -1;
+  }
+
+  jobs->links[jobs->nlinks++] = *header;
+  return 0;
+}
+
+int ctar_jobs_finish(ctar_jobs *jobs)
+{
+  if (jobs == NULL)
+  {
+    return 0;
+  }
+
+  int status = ctar_jobs_flush(jobs);
+  ctar_jobs_destroy(jobs);
+
+  return status;
+}
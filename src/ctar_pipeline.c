@@ -0,0 +1,351 @@
+#define _GNU_SOURCE // copy_file_range(), O_DIRECT
+#include "ctar_pipeline.h"
+#include "utils.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+/**
+ * @brief Write whole buffers, retrying after partial writes, and without O_DIRECT if it is rejected.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_pipeline_writev(int fd, struct iovec *iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t nbytes = writev(fd, iov, count);
+    if (nbytes == -1 && clear_direct_io(fd) == 0)
+    {
+      continue;
+    }
+
+    if (nbytes == -1)
+    {
+      return -1;
+    }
+
+    // Skip the buffers written, and the written part of the next one
+    for (; count > 0 && nbytes >= iov->iov_len; iov++, count--)
+    {
+      nbytes -= iov->iov_len;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + nbytes;
+      iov->iov_len -= nbytes;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Slots are written in order. All the slots filled while the previous ones were being written
+ * are gathered in a single writev(), so small entries coalesced in the slots cost few syscalls
+ * even when writing the archive is the bottleneck.
+ * After a failure, the remaining slots are released without being written,
+ * so the thread creating the archive never waits forever.
+ *
+ * With O_DIRECT, only the last slot may not be full: it is padded up to CTAR_DIRECT_ALIGN.
+ */
+static void *ctar_pipeline_writer(void *arg)
+{
+  ctar_pipeline *pipeline = arg;
+
+  pthread_mutex_lock(&pipeline->lock);
+  while (true)
+  {
+    while (pipeline->written == pipeline->filled && !pipeline->closing)
+    {
+      pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+
+    if (pipeline->written == pipeline->filled)
+    {
+      break;
+    }
+
+    // The filled slots belong to this thread until they are written
+    int count = pipeline->filled - pipeline->written;
+    struct iovec iov[CTAR_PIPELINE_SLOTS];
+    for (int i = 0; i < count; i++)
+    {
+      ctar_pipeline_slot *slot = &pipeline->slots[(pipeline->written + i) % CTAR_PIPELINE_SLOTS];
+      iov[i].iov_base = slot->data;
+      iov[i].iov_len = slot->len;
+      if (pipeline->direct && slot->len % CTAR_DIRECT_ALIGN != 0)
+      {
+        iov[i].iov_len += CTAR_DIRECT_ALIGN - slot->len % CTAR_DIRECT_ALIGN;
+        memset(slot->data + slot->len, 0, iov[i].iov_len - slot->len);
+      }
+    }
+    bool failed = pipeline->status == -1;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (!failed && ctar_pipeline_writev(pipeline->fd, iov, count) == -1)
+    {
+      perror("Unable to write to archive");
+      failed = true;
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    if (failed)
+    {
+      pipeline->status = -1;
+    }
+    pipeline->written += count;
+    pthread_cond_broadcast(&pipeline->cond);
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Free the slots of a pipeline.
+ */
+static void ctar_pipeline_free(ctar_pipeline *pipeline)
+{
+  for (int i = 0; i < CTAR_PIPELINE_SLOTS; i++)
+  {
+    free(pipeline->slots[i].data);
+  }
+  pthread_cond_destroy(&pipeline->cond);
+  pthread_mutex_destroy(&pipeline->lock);
+}
+
+/**
+ * With O_DIRECT, the data is only copied through the slots: kernel copies would leave
+ * the offset of the archive unaligned.
+ */
+int ctar_pipeline_start(ctar_pipeline *pipeline, int fd, size_t slot_size)
+{
+  memset(pipeline, 0, sizeof(ctar_pipeline));
+  pipeline->fd = fd;
+  pipeline->slot_size = slot_size;
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1 && (flags & O_DIRECT))
+  {
+    pipeline->direct = true;
+    pipeline->slot_size = slot_size < CTAR_DIRECT_BUFFER_SIZE ? CTAR_DIRECT_BUFFER_SIZE : slot_size;
+    pipeline->slot_size = (pipeline->slot_size + CTAR_DIRECT_ALIGN - 1) & ~(size_t)(CTAR_DIRECT_ALIGN - 1);
+    pipeline->copy_method = CTAR_PIPELINE_USER;
+  }
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+
+  if (fstat(fd, &pipeline->st) == -1)
+  {
+    perror("Unable to stat archive");
+    ctar_pipeline_free(pipeline);
+    return -1;
+  }
+
+  for (int i = 0; i < CTAR_PIPELINE_SLOTS; i++)
+  {
+    int err = posix_memalign((void **)&pipeline->slots[i].data, CTAR_DIRECT_ALIGN, pipeline->slot_size);
+    if (err != 0)
+    {
+      errno = err;
+      pipeline->slots[i].data = NULL;
+      perror("Unable to allocate pipeline");
+      ctar_pipeline_free(pipeline);
+      return -1;
+    }
+  }
+
+  int err = pthread_create(&pipeline->writer, NULL, ctar_pipeline_writer, pipeline);
+  if (err != 0)
+  {
+    fprintf(stderr, "Unable to start writer thread: %s\n", strerror(err));
+    ctar_pipeline_free(pipeline);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Hand the current slot to the writer thread.
+ */
+static void ctar_pipeline_submit(ctar_pipeline *pipeline)
+{
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->filled++;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+/**
+ * The current slot is only touched by the thread creating the archive until it is full.
+ * It is then handed to the writer thread, and the next slot is reused once written.
+ */
+unsigned char *ctar_pipeline_reserve(ctar_pipeline *pipeline, size_t *size)
+{
+  ctar_pipeline_slot *slot = &pipeline->slots[pipeline->filled % CTAR_PIPELINE_SLOTS];
+  if (slot->len == pipeline->slot_size)
+  {
+    ctar_pipeline_submit(pipeline);
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->filled - pipeline->written == CTAR_PIPELINE_SLOTS && pipeline->status == 0)
+    {
+      pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    slot = &pipeline->slots[pipeline->filled % CTAR_PIPELINE_SLOTS];
+    slot->len = 0;
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  int status = pipeline->status;
+  pthread_mutex_unlock(&pipeline->lock);
+  if (status == -1)
+  {
+    return NULL;
+  }
+
+  *size = pipeline->slot_size - slot->len;
+  return slot->data + slot->len;
+}
+
+void ctar_pipeline_commit(ctar_pipeline *pipeline, size_t size)
+{
+  pipeline->slots[pipeline->filled % CTAR_PIPELINE_SLOTS].len += size;
+  pipeline->offset += size;
+}
+
+int ctar_pipeline_write(ctar_pipeline *pipeline, const void *buf, size_t size)
+{
+  for (size_t pos = 0; pos < size;)
+  {
+    size_t room;
+    unsigned char *dst = ctar_pipeline_reserve(pipeline, &room);
+    if (dst == NULL)
+    {
+      return -1;
+    }
+
+    size_t len = size - pos < room ? size - pos : room;
+    memcpy(dst, (const unsigned char *)buf + pos, len);
+    ctar_pipeline_commit(pipeline, len);
+    pos += len;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Wait for the writer thread to write every slot, including the current one.
+ *
+ * @return int 0 if successful, -1 if the writer thread failed.
+ */
+static int ctar_pipeline_drain(ctar_pipeline *pipeline)
+{
+  if (pipeline->slots[pipeline->filled % CTAR_PIPELINE_SLOTS].len > 0)
+  {
+    ctar_pipeline_submit(pipeline);
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  while (pipeline->written != pipeline->filled && pipeline->status == 0)
+  {
+    pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+  }
+  int status = pipeline->status;
+  pthread_mutex_unlock(&pipeline->lock);
+
+  pipeline->slots[pipeline->filled % CTAR_PIPELINE_SLOTS].len = 0;
+  return status;
+}
+
+/**
+ * The slots are drained first, so the copied data lands after everything appended so far.
+ * copy_file_range() is tried first, then sendfile(). Once a method fails because the files
+ * do not support it, it is not tried again and the caller falls back to the slots.
+ */
+long ctar_pipeline_copy(ctar_pipeline *pipeline, int fd, long size)
+{
+  if (pipeline->copy_method == CTAR_PIPELINE_USER)
+  {
+    return 0;
+  }
+
+  if (ctar_pipeline_drain(pipeline) == -1)
+  {
+    fprintf(stderr, "Unable to write to archive\n");
+    return -1;
+  }
+
+  long copied = 0;
+  while (copied < size && pipeline->copy_method != CTAR_PIPELINE_USER)
+  {
+    ssize_t nbytes;
+    if (pipeline->copy_method == CTAR_PIPELINE_COPY_FILE_RANGE)
+    {
+      nbytes = copy_file_range(fd, NULL, pipeline->fd, NULL, size - copied, 0);
+    }
+    else
+    {
+      nbytes = sendfile(pipeline->fd, fd, NULL, size - copied);
+    }
+
+    if (nbytes == 0)
+    {
+      // The file shrank
+      break;
+    }
+
+    if (nbytes == -1)
+    {
+      // Nothing was copied by the failed call, the next method starts at the same offsets
+      bool unsupported = errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EXDEV ||
+                         (errno == EBADF && pipeline->copy_method == CTAR_PIPELINE_COPY_FILE_RANGE);
+      if (!unsupported)
+      {
+        perror("Unable to copy file to archive");
+        return -1;
+      }
+
+      pipeline->copy_method++;
+      continue;
+    }
+
+    copied += nbytes;
+  }
+
+  pipeline->offset += copied;
+  return copied;
+}
+
+int ctar_pipeline_finish(ctar_pipeline *pipeline)
+{
+  if (pipeline->slots[pipeline->filled % CTAR_PIPELINE_SLOTS].len > 0)
+  {
+    ctar_pipeline_submit(pipeline);
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->closing = true;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+
+  pthread_join(pipeline->writer, NULL);
+  int status = pipeline->status;
+  ctar_pipeline_free(pipeline);
+
+  // Cut the padding of the last slot, the archive was opened truncated
+  if (status == 0 && pipeline->direct && ftruncate(pipeline->fd, pipeline->offset) == -1)
+  {
+    perror("Unable to truncate archive");
+    status = -1;
+  }
+
+  return status;
+}
@@ -0,0 +1,770 @@
+#include "ctar_pzlib.h"
+#include "ctar_zlib.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/** @brief Block of the uncompressed stream, compressed by any thread */
+typedef struct ctar_pzlib_block
+{
+  unsigned char *in;
+  size_t in_len;
+  long offset; // Offset of the block in the uncompressed stream
+  unsigned char *out;
+  size_t out_len;
+  uLong crc;
+  bool done;
+  int status;
+} ctar_pzlib_block;
+
+/** @brief Compression threads and the ring of blocks they work on */
+typedef struct ctar_pzlib_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // Broadcast whenever a block is submitted or done
+  ctar_pzlib_block *blocks;
+  int nblocks;
+  long submitted; // Number of blocks handed to the threads
+  long taken;     // Number of blocks picked up by the threads
+  bool closing;
+  pthread_t *threads;
+  int nthreads;
+  int level; // Compression level of the threads
+  ctar_adapt *adapt;
+} ctar_pzlib_pool;
+
+/**
+ * Each block is compressed as a raw deflate stream ended by a sync flush,
+ * so the blocks can be concatenated in order into a single deflate stream.
+ * The level of the stream is changed wherever the level map of the pool says so.
+ */
+static int ctar_pzlib_deflate(ctar_pzlib_pool *pool, z_stream *strm, int *current, ctar_pzlib_block *block)
+{
+  if (deflateReset(strm) != Z_OK)
+  {
+    return -1;
+  }
+
+  size_t out_size = CTAR_PZLIB_OUT_SIZE;
+  strm->next_out = block->out;
+  strm->avail_out = out_size;
+
+  size_t len;
+  for (size_t pos = 0; pos < block->in_len; pos += len)
+  {
+    int level;
+    len = ctar_adapt_segment(pool->adapt, block->offset + pos, block->in_len - pos, pool->level, &level);
+    if (level != *current && deflateParams(strm, level, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      return -1;
+    }
+    *current = level;
+
+    strm->next_in = block->in + pos;
+    strm->avail_in = len;
+    if (deflate(strm, Z_NO_FLUSH) != Z_OK || strm->avail_in != 0)
+    {
+      return -1;
+    }
+  }
+
+  // avail_out must not be exhausted, otherwise the flush may be incomplete
+  if (deflate(strm, Z_SYNC_FLUSH) != Z_OK || strm->avail_out == 0)
+  {
+    return -1;
+  }
+
+  block->out_len = out_size - strm->avail_out;
+  block->crc = crc32(crc32(0L, Z_NULL, 0), block->in, block->in_len);
+  return 0;
+}
+
+/**
+ * @brief Wait for a submitted block.
+ *
+ * @return ctar_pzlib_block* the block to compress, NULL if the pool is closing.
+ */
+static ctar_pzlib_block *ctar_pzlib_take(ctar_pzlib_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (pool->taken == pool->submitted && !pool->closing)
+  {
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  }
+
+  ctar_pzlib_block *block = NULL;
+  if (pool->taken < pool->submitted)
+  {
+    block = &pool->blocks[pool->taken % pool->nblocks];
+    pool->taken++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return block;
+}
+
+static void *ctar_pzlib_worker(void *arg)
+{
+  ctar_pzlib_pool *pool = arg;
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  int init = deflateInit2(&strm, pool->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+  int current = pool->level;
+
+  ctar_pzlib_block *block;
+  while ((block = ctar_pzlib_take(pool)) != NULL)
+  {
+    int status = init == Z_OK ? ctar_pzlib_deflate(pool, &strm, &current, block) : -1;
+
+    pthread_mutex_lock(&pool->lock);
+    block->status = status;
+    block->done = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  if (init == Z_OK)
+  {
+    deflateEnd(&strm);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Stop the threads once all submitted blocks are done and free the pool.
+ */
+static void ctar_pzlib_pool_destroy(ctar_pzlib_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->closing = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nthreads; i++)
+  {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  for (int i = 0; pool->blocks != NULL && i < pool->nblocks; i++)
+  {
+    free(pool->blocks[i].in);
+    free(pool->blocks[i].out);
+  }
+  free(pool->blocks);
+  free(pool->threads);
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+static int ctar_pzlib_pool_init(ctar_pzlib_pool *pool, int threads, int level, ctar_adapt *adapt)
+{
+  memset(pool, 0, sizeof(ctar_pzlib_pool));
+  pool->level = level == -1 ? Z_DEFAULT_COMPRESSION : level;
+  pool->adapt = adapt;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  pool->nblocks = threads * CTAR_PZLIB_SLOTS_PER_THREAD;
+  pool->blocks = calloc(pool->nblocks, sizeof(ctar_pzlib_block));
+  pool->threads = calloc(threads, sizeof(pthread_t));
+  if (pool->blocks == NULL || pool->threads == NULL)
+  {
+    perror("Unable to allocate compression threads");
+    ctar_pzlib_pool_destroy(pool);
+    return -1;
+  }
+
+  for (int i = 0; i < pool->nblocks; i++)
+  {
+    pool->blocks[i].in = malloc(CTAR_PZLIB_BLOCK);
+    pool->blocks[i].out = malloc(CTAR_PZLIB_OUT_SIZE);
+    if (pool->blocks[i].in == NULL || pool->blocks[i].out == NULL)
+    {
+      perror("Unable to allocate compression blocks");
+      ctar_pzlib_pool_destroy(pool);
+      return -1;
+    }
+  }
+
+  for (; pool->nthreads < threads; pool->nthreads++)
+  {
+    int err = pthread_create(&pool->threads[pool->nthreads], NULL, ctar_pzlib_worker, pool);
+    if (err != 0)
+    {
+      fprintf(stderr, "Unable to start compression thread: %s\n", strerror(err));
+      ctar_pzlib_pool_destroy(pool);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void ctar_pzlib_put32(unsigned char *buf, uLong value)
+{
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+  buf[2] = (value >> 16) & 0xff;
+  buf[3] = (value >> 24) & 0xff;
+}
+
+/**
+ * The uncompressed stream is split into CTAR_PZLIB_BLOCK bytes blocks compressed in parallel
+ * and written in order between a gzip header and trailer, like pigz does.
+ * The CRC of the whole stream is obtained by combining the CRC of each block.
+ *
+ * @note This function will close fd_out but not fd_in.
+ */
+int ctar_compress_parallel(int fd_out, int fd_in, int threads, int level, ctar_adapt *adapt)
+{
+  ctar_pzlib_pool pool;
+  if (ctar_pzlib_pool_init(&pool, threads, level, adapt) == -1)
+  {
+    close(fd_out);
+    return -1;
+  }
+
+  // Magic, deflate method, no flags, no mtime, no extra flags, Unix OS
+  unsigned char header[10] = {0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3};
+  int status = write_full(fd_out, header, sizeof(header)) == -1 ? -1 : 0;
+  if (status == -1)
+  {
+    perror("Unable to write compressed file");
+  }
+
+  uLong crc = crc32(0L, Z_NULL, 0);
+  uLong isize = 0;
+  long nread = 0;
+  long nwritten = 0;
+  bool eof = false;
+
+  while (status == 0 && (!eof || nwritten < nread))
+  {
+    // Keep every block of the ring busy
+    while (!eof && nread - nwritten < pool.nblocks)
+    {
+      ctar_pzlib_block *block = &pool.blocks[nread % pool.nblocks];
+      ssize_t nbytes = read_full(fd_in, block->in, CTAR_PZLIB_BLOCK);
+      if (nbytes == -1)
+      {
+        perror("Unable to read uncompressed file");
+        status = -1;
+        break;
+      }
+
+      eof = nbytes < CTAR_PZLIB_BLOCK;
+      if (nbytes == 0)
+      {
+        break;
+      }
+
+      pthread_mutex_lock(&pool.lock);
+      block->in_len = nbytes;
+      block->offset = nread * CTAR_PZLIB_BLOCK;
+      block->done = false;
+      pool.submitted++;
+      pthread_cond_broadcast(&pool.cond);
+      pthread_mutex_unlock(&pool.lock);
+      nread++;
+    }
+
+    if (status == -1 || nwritten == nread)
+    {
+      break;
+    }
+
+    // Write the oldest block as soon as it is compressed
+    ctar_pzlib_block *block = &pool.blocks[nwritten % pool.nblocks];
+    pthread_mutex_lock(&pool.lock);
+    while (!block->done)
+    {
+      pthread_cond_wait(&pool.cond, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (block->status == -1)
+    {
+      fprintf(stderr, "Unable to compress block\n");
+      status = -1;
+      break;
+    }
+
+    if (write_full(fd_out, block->out, block->out_len) == -1)
+    {
+      perror("Unable to write compressed file");
+      status = -1;
+      break;
+    }
+
+    crc = crc32_combine(crc, block->crc, block->in_len);
+    isize += block->in_len;
+    nwritten++;
+
+    // The blocks still being compressed all come after this one
+    ctar_adapt_consume(adapt, block->offset + block->in_len);
+  }
+
+  ctar_pzlib_pool_destroy(&pool);
+
+  if (status == 0)
+  {
+    // Empty final block with fixed codes, then CRC32 and size modulo 2^32
+    unsigned char trailer[10] = {0x03, 0x00};
+    ctar_pzlib_put32(trailer + 2, crc);
+    ctar_pzlib_put32(trailer + 6, isize);
+    if (write_full(fd_out, trailer, sizeof(trailer)) == -1)
+    {
+      perror("Unable to write compressed file");
+      status = -1;
+    }
+  }
+
+  if (close(fd_out) == -1)
+  {
+    perror("Unable to close compressed file");
+    return -1;
+  }
+
+  return status;
+}
+
+/** @brief Range of gzip members of the compressed stream, inflated by any thread */
+typedef struct ctar_pzlib_chunk
+{
+  off_t start; // Offset of the first member of the chunk
+  off_t end;   // Offset from which no member is started by the chunk
+  off_t stop;  // Offset where inflating stopped, the end of the last member of the chunk
+  unsigned char *out;
+  size_t out_len;
+  size_t out_capacity;
+  bool done;
+  int status; // Status of ctar_pzlib_inflate(), 1 if the output exceeds CTAR_PZLIB_OUT_LIMIT
+} ctar_pzlib_chunk;
+
+/** @brief Inflating threads and the ring of chunks they work on */
+typedef struct ctar_pzlib_inflater
+{
+  int fd;
+  off_t size;
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // Broadcast whenever a chunk is submitted or done
+  ctar_pzlib_chunk *chunks;
+  int nchunks;
+  long submitted; // Number of chunks handed to the threads
+  long taken;     // Number of chunks picked up by the threads
+  bool closing;
+  pthread_t *threads;
+  int nthreads;
+} ctar_pzlib_inflater;
+
+/**
+ * @brief Find the first possible gzip member header at or after offset.
+ *
+ * The magic bytes, the deflate method and the reserved flags are checked,
+ * so the offset may still be a false positive inside the data of a member.
+ *
+ * @return off_t the offset of the header, size if there is none before limit.
+ */
+static off_t ctar_pzlib_find_member(int fd, off_t offset, off_t size, off_t limit)
+{
+  unsigned char buf[CTAR_ZLIB_CHUNK];
+  while (offset < size && offset < limit)
+  {
+    ssize_t nbytes = pread(fd, buf, sizeof(buf), offset);
+    if (nbytes < 4)
+    {
+      break;
+    }
+
+    for (ssize_t i = 0; i + 4 <= nbytes; i++)
+    {
+      if (buf[i] == 0x1f && buf[i + 1] == 0x8b && buf[i + 2] == Z_DEFLATED && (buf[i + 3] & 0xe0) == 0)
+      {
+        return offset + i;
+      }
+    }
+
+    // The next read overlaps the last bytes, which may hold the beginning of a header
+    offset += nbytes - 3;
+  }
+
+  return size;
+}
+
+/**
+ * @return int 0 if successful, 1 if the output of the chunk would exceed CTAR_PZLIB_OUT_LIMIT, -1 otherwise.
+ */
+static int ctar_pzlib_append(ctar_pzlib_chunk *chunk, unsigned char *buf, size_t len)
+{
+  if (chunk->out_len + len > CTAR_PZLIB_OUT_LIMIT)
+  {
+    return 1;
+  }
+
+  if (chunk->out_len + len > chunk->out_capacity)
+  {
+    size_t capacity = chunk->out_capacity ? chunk->out_capacity : CTAR_PZLIB_CHUNK;
+    while (chunk->out_len + len > capacity)
+    {
+      capacity = 2 * capacity < CTAR_PZLIB_OUT_LIMIT ? 2 * capacity : CTAR_PZLIB_OUT_LIMIT;
+    }
+
+    unsigned char *out = realloc(chunk->out, capacity);
+    if (out == NULL)
+    {
+      perror("Unable to allocate decompressed chunk");
+      return -1;
+    }
+    chunk->out = out;
+    chunk->out_capacity = capacity;
+  }
+
+  memcpy(chunk->out + chunk->out_len, buf, len);
+  chunk->out_len += len;
+  return 0;
+}
+
+/**
+ * Members are inflated from chunk->start until one of them ends at or after chunk->end,
+ * so a chunk whose end is a false positive simply runs into the next chunk.
+ * Data which is not a gzip member after a member is ignored, like gzip does.
+ *
+ * The output is kept in chunk->out, up to CTAR_PZLIB_OUT_LIMIT bytes, if fd_out is -1.
+ * Otherwise, it is written straight to fd_out and errors are reported, since the chunk is not a guess.
+ *
+ * @return int 0 if successful, 1 if the output exceeds CTAR_PZLIB_OUT_LIMIT or if the reader of fd_out went away,
+ * -1 otherwise.
+ */
+static int ctar_pzlib_inflate(int fd, off_t size, ctar_pzlib_chunk *chunk, int fd_out)
+{
+  chunk->out_len = 0;
+  chunk->stop = size;
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, MAX_WBITS + 16) != Z_OK)
+  {
+    return -1;
+  }
+
+  unsigned char in[CTAR_ZLIB_CHUNK];
+  unsigned char out[4 * CTAR_ZLIB_CHUNK];
+  off_t offset = chunk->start; // Offset of the next byte to read
+  int status = 0;
+  int ret = Z_OK;
+
+  while (status == 0)
+  {
+    if (strm.avail_in == 0)
+    {
+      ssize_t nbytes = pread(fd, in, sizeof(in), offset);
+      if (nbytes <= 0)
+      {
+        // End of file in the middle of a member
+        status = -1;
+        break;
+      }
+      offset += nbytes;
+      strm.next_in = in;
+      strm.avail_in = nbytes;
+    }
+
+    strm.next_out = out;
+    strm.avail_out = sizeof(out);
+    ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+    {
+      status = -1;
+      break;
+    }
+
+    size_t have = sizeof(out) - strm.avail_out;
+    if (fd_out == -1)
+    {
+      status = ctar_pzlib_append(chunk, out, have);
+    }
+    else if (write_full(fd_out, out, have) == -1)
+    {
+      status = errno == EPIPE ? 1 : -1;
+      if (status == -1)
+      {
+        perror("Unable to write decompressed file");
+        fd_out = -1;
+      }
+    }
+
+    if (status != 0)
+    {
+      break;
+    }
+
+    if (ret == Z_STREAM_END)
+    {
+      off_t member_end = offset - strm.avail_in;
+      unsigned char magic[2];
+      if (member_end >= chunk->end || member_end >= size ||
+          pread(fd, magic, sizeof(magic), member_end) != sizeof(magic) || magic[0] != 0x1f || magic[1] != 0x8b)
+      {
+        chunk->stop = member_end >= chunk->end ? member_end : size;
+        break;
+      }
+      inflateReset(&strm);
+    }
+  }
+
+  inflateEnd(&strm);
+  if (status == -1 && fd_out != -1)
+  {
+    fprintf(stderr, "Unable to decompress archive\n");
+  }
+  return status;
+}
+
+/**
+ * @brief Wait for a submitted chunk.
+ *
+ * @return ctar_pzlib_chunk* the chunk to inflate, NULL if the inflater is closing.
+ */
+static ctar_pzlib_chunk *ctar_pzlib_take_chunk(ctar_pzlib_inflater *inflater)
+{
+  pthread_mutex_lock(&inflater->lock);
+  while (inflater->taken == inflater->submitted && !inflater->closing)
+  {
+    pthread_cond_wait(&inflater->cond, &inflater->lock);
+  }
+
+  ctar_pzlib_chunk *chunk = NULL;
+  if (inflater->taken < inflater->submitted && !inflater->closing)
+  {
+    chunk = &inflater->chunks[inflater->taken % inflater->nchunks];
+    inflater->taken++;
+  }
+  pthread_mutex_unlock(&inflater->lock);
+
+  return chunk;
+}
+
+static void *ctar_pzlib_inflate_worker(void *arg)
+{
+  ctar_pzlib_inflater *inflater = arg;
+
+  ctar_pzlib_chunk *chunk;
+  while ((chunk = ctar_pzlib_take_chunk(inflater)) != NULL)
+  {
+    int status = ctar_pzlib_inflate(inflater->fd, inflater->size, chunk, -1);
+
+    pthread_mutex_lock(&inflater->lock);
+    chunk->status = status;
+    chunk->done = true;
+    pthread_cond_broadcast(&inflater->cond);
+    pthread_mutex_unlock(&inflater->lock);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Stop the threads, dropping the chunks not picked up yet, and free the inflater.
+ */
+static void ctar_pzlib_inflater_destroy(ctar_pzlib_inflater *inflater)
+{
+  pthread_mutex_lock(&inflater->lock);
+  inflater->closing = true;
+  pthread_cond_broadcast(&inflater->cond);
+  pthread_mutex_unlock(&inflater->lock);
+
+  for (int i = 0; i < inflater->nthreads; i++)
+  {
+    pthread_join(inflater->threads[i], NULL);
+  }
+
+  for (int i = 0; inflater->chunks != NULL && i < inflater->nchunks; i++)
+  {
+    free(inflater->chunks[i].out);
+  }
+  free(inflater->chunks);
+  free(inflater->threads);
+  pthread_cond_destroy(&inflater->cond);
+  pthread_mutex_destroy(&inflater->lock);
+}
+
+static int ctar_pzlib_inflater_init(ctar_pzlib_inflater *inflater, int fd, off_t size, int threads)
+{
+  memset(inflater, 0, sizeof(ctar_pzlib_inflater));
+  inflater->fd = fd;
+  inflater->size = size;
+  pthread_mutex_init(&inflater->lock, NULL);
+  pthread_cond_init(&inflater->cond, NULL);
+
+  inflater->nchunks = threads * CTAR_PZLIB_SLOTS_PER_THREAD;
+  inflater->chunks = calloc(inflater->nchunks, sizeof(ctar_pzlib_chunk));
+  inflater->threads = calloc(threads, sizeof(pthread_t));
+  if (inflater->chunks == NULL || inflater->threads == NULL)
+  {
+    perror("Unable to allocate decompression threads");
+    ctar_pzlib_inflater_destroy(inflater);
+    return -1;
+  }
+
+  for (; inflater->nthreads < threads; inflater->nthreads++)
+  {
+    int err = pthread_create(&inflater->threads[inflater->nthreads], NULL, ctar_pzlib_inflate_worker, inflater);
+    if (err != 0)
+    {
+      fprintf(stderr, "Unable to start decompression thread: %s\n", strerror(err));
+      ctar_pzlib_inflater_destroy(inflater);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @return int 0 if successful, 1 if the reader of fd_out went away, -1 otherwise.
+ */
+static int ctar_pzlib_write_chunk(int fd_out, ctar_pzlib_chunk *chunk)
+{
+  for (size_t pos = 0; pos < chunk->out_len;)
+  {
+    ssize_t nbytes = write(fd_out, chunk->out + pos, chunk->out_len - pos);
+    if (nbytes == -1)
+    {
+      if (errno == EPIPE)
+      {
+        // The reader does not need the rest of the archive
+        return 1;
+      }
+
+      perror("Unable to write decompressed file");
+      return -1;
+    }
+    pos += nbytes;
+  }
+
+  return 0;
+}
+
+/**
+ * The compressed file is split into chunks of about CTAR_PZLIB_CHUNK bytes starting at member headers,
+ * inflated in parallel and written in order.
+ * The next chunk is expected where the members of a chunk stopped:
+ * - chunks starting before it began at a false positive, they are dropped
+ * - if no chunk starts there, the gap is inflated by this thread
+ * Chunks whose output exceeds CTAR_PZLIB_OUT_LIMIT are inflated again by this thread, so the memory
+ * used stays bounded whatever the compression ratio.
+ *
+ * @note This function will close fd_in but not fd_out, unless it returns 1.
+ */
+int ctar_decompress_parallel(int fd_in, int fd_out, int threads)
+{
+  struct stat st;
+  if (fstat(fd_in, &st) == -1 || !S_ISREG(st.st_mode))
+  {
+    return 1;
+  }
+
+  // A single member (or a few huge ones) is inflated as usual
+  off_t size = st.st_size;
+  off_t next_start = 0;
+  off_t next_end = ctar_pzlib_find_member(fd_in, CTAR_PZLIB_CHUNK, size, CTAR_PZLIB_SCAN_LIMIT);
+  if (next_end == size)
+  {
+    return 1;
+  }
+
+  ctar_pzlib_inflater inflater;
+  if (ctar_pzlib_inflater_init(&inflater, fd_in, size, threads) == -1)
+  {
+    close(fd_in);
+    return -1;
+  }
+
+  ctar_pzlib_chunk gap;
+  memset(&gap, 0, sizeof(gap));
+  off_t offset = 0; // Offset of the next member to write
+  long nwritten = 0;
+  int status = 0;
+
+  while (status == 0 && offset < size)
+  {
+    // Keep every chunk of the ring busy
+    while (next_start < size && inflater.submitted - nwritten < inflater.nchunks)
+    {
+      ctar_pzlib_chunk *chunk = &inflater.chunks[inflater.submitted % inflater.nchunks];
+      pthread_mutex_lock(&inflater.lock);
+      chunk->start = next_start;
+      chunk->end = next_end;
+      chunk->done = false;
+      inflater.submitted++;
+      pthread_cond_broadcast(&inflater.cond);
+      pthread_mutex_unlock(&inflater.lock);
+
+      next_start = next_end;
+      next_end = ctar_pzlib_find_member(fd_in, next_start + CTAR_PZLIB_CHUNK, size, size);
+    }
+
+    ctar_pzlib_chunk *chunk = NULL;
+    if (nwritten < inflater.submitted)
+    {
+      chunk = &inflater.chunks[nwritten % inflater.nchunks];
+      pthread_mutex_lock(&inflater.lock);
+      while (!chunk->done)
+      {
+        pthread_cond_wait(&inflater.cond, &inflater.lock);
+      }
+      pthread_mutex_unlock(&inflater.lock);
+
+      if (chunk->start < offset)
+      {
+        nwritten++;
+        continue;
+      }
+    }
+
+    if (chunk == NULL || chunk->start > offset)
+    {
+      gap.start = offset;
+      gap.end = chunk != NULL ? chunk->start : size;
+      chunk = &gap;
+    }
+    else
+    {
+      nwritten++;
+    }
+
+    // Too large to be kept in memory, the chunk is inflated again straight to fd_out
+    if (chunk != &gap && chunk->status == 1)
+    {
+      gap.start = chunk->start;
+      gap.end = chunk->end;
+      chunk = &gap;
+    }
+
+    if (chunk == &gap)
+    {
+      status = ctar_pzlib_inflate(fd_in, size, &gap, fd_out);
+    }
+    else if (chunk->status == -1)
+    {
+      fprintf(stderr, "Unable to decompress archive\n");
+      status = -1;
+    }
+    else
+    {
+      status = ctar_pzlib_write_chunk(fd_out, chunk);
+    }
+    offset = chunk->stop;
+  }
+
+  ctar_pzlib_inflater_destroy(&inflater);
+  close(fd_in);
+
+  return status == -1 ? -1 : 0;
+}
@@ -0,0 +1,375 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "ctar_reader.h"
+#include "ctar_sparse.h"
+#include "utils.h"
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * The archive is mapped if it is a regular file, which is never the case of a compressed archive
+ * (it is read from the pipe of the decompression thread, see ctar_open()).
+ * The whole file is mapped, mappings must start on a page boundary.
+ * If the archive cannot be mapped, it is read with read() instead.
+ *
+ * An archive opened with O_DIRECT is never mapped, that would read it through the page cache.
+ * If its window cannot be allocated, O_DIRECT is cleared and the archive mapped as usual.
+ */
+void ctar_reader_open(ctar_reader *reader, int fd, bool drop_cache)
+{
+  memset(reader, 0, sizeof(ctar_reader));
+  reader->fd = fd;
+  reader->sparse_size = -1;
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags != -1 && (flags & O_DIRECT))
+  {
+    if (posix_memalign((void **)&reader->window, CTAR_DIRECT_ALIGN, CTAR_DIRECT_BUFFER_SIZE) == 0)
+    {
+      return;
+    }
+    reader->window = NULL;
+    fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+  }
+
+  struct stat st;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (offset == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= offset)
+  {
+    return;
+  }
+
+  // The archive is read from start to end, even if it cannot be mapped
+  posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    return;
+  }
+
+  // Headers are read one after the other, let the kernel read ahead
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  reader->map = map;
+  reader->map_len = st.st_size;
+  reader->size = st.st_size;
+  reader->pos = offset;
+  ctar_cache_open(&reader->cache, fd, offset, drop_cache, false);
+  reader->cache.map = map;
+}
+
+/**
+ * @brief Read the next window of an archive opened with O_DIRECT.
+ *
+ * Whole windows are read, so the offset of the archive stays aligned until its last, short, read.
+ * Reading is then over: reading again from an unaligned offset would be rejected.
+ *
+ * @return ssize_t the number of bytes read, 0 at the end of the archive, -1 on failure.
+ */
+static ssize_t ctar_reader_fill(ctar_reader *reader)
+{
+  if (reader->window_len % CTAR_DIRECT_ALIGN != 0)
+  {
+    reader->window_pos = reader->window_len;
+    return 0;
+  }
+
+  ssize_t nbytes;
+  do
+  {
+    nbytes = read(reader->fd, reader->window, CTAR_DIRECT_BUFFER_SIZE);
+  } while (nbytes == -1 && (errno == EINTR || clear_direct_io(reader->fd) == 0));
+
+  if (nbytes == -1)
+  {
+    return -1;
+  }
+
+  reader->window_len = nbytes;
+  reader->window_pos = 0;
+  return nbytes;
+}
+
+/**
+ * @brief Shrink the mapped archive to the size of its file, if it was truncated since it was mapped.
+ *
+ * Touching a page of the mapping past the end of the file would kill the process with SIGBUS,
+ * instead of reporting the truncated archive (e.g. a file still being written, or a network file system).
+ */
+static void ctar_reader_check_size(ctar_reader *reader)
+{
+  struct stat st;
+  if (fstat(reader->fd, &st) == 0 && (size_t)st.st_size < reader->size)
+  {
+    reader->size = st.st_size;
+    reader->pos = reader->pos < reader->size ? reader->pos : reader->size;
+  }
+}
+
+/**
+ * @brief Read the next block of the archive as a header.
+ *
+ * Like a short read(), an incomplete last block of a mapped archive ends the archive.
+ * The size of the archive file is checked first, so the header and the data of the entry lie in the file.
+ * The previous entries are done with by now, so the mapping is dropped from the page cache
+ * behind the next header (see ctar_args::drop_cache).
+ *
+ * @return int 1 if a header was read, 0 at the end of the archive, -1 on failure.
+ */
+static int ctar_reader_block(ctar_reader *reader, ctar_header **header)
+{
+  if (reader->map != NULL)
+  {
+    ctar_cache_advance(&reader->cache, reader->pos);
+    ctar_reader_check_size(reader);
+    if (reader->size - reader->pos < sizeof(ctar_header))
+    {
+      return 0;
+    }
+
+    *header = (ctar_header *)(reader->map + reader->pos);
+    reader->pos += sizeof(ctar_header);
+    return 1;
+  }
+
+  if (reader->window != NULL)
+  {
+    if (reader->window_pos == reader->window_len && ctar_reader_fill(reader) == -1)
+    {
+      return -1;
+    }
+
+    if (reader->window_len - reader->window_pos < sizeof(ctar_header))
+    {
+      return 0;
+    }
+
+    // The window is refilled while reading the data of the entry
+    memcpy(&reader->header, reader->window + reader->window_pos, sizeof(ctar_header));
+    reader->window_pos += sizeof(ctar_header);
+    *header = &reader->header;
+    return 1;
+  }
+
+  ssize_t nbytes = read_full(reader->fd, &reader->header, sizeof(ctar_header));
+  if (nbytes <= 0)
+  {
+    return nbytes;
+  }
+
+  *header = &reader->header;
+  return 1;
+}
+
+/**
+ * @brief Apply an extended header to the header following it.
+ *
+ * Only the keys of sparse files are understood, other extended headers are skipped.
+ * The extended header of a sparse file is trusted once its checksum and the one of the next header are valid.
+ *
+ * @return int 1 if the next header was read, 0 at the end of the archive, -1 on failure.
+ */
+static int ctar_reader_extended(ctar_reader *reader, ctar_header **header)
+{
+  // Larger extended headers hold other keys (long names...)
+  size_t size = oct2dec((*header)->size, CTAR_SIZE_SIZE);
+  size_t padded = (size_t)get_nblocks(*header) * CTAR_BLOCK_SIZE;
+  char records[CTAR_SPARSE_RECORDS_SIZE];
+  char name[CTAR_NAME_SIZE];
+  long realsize;
+  int sparse = 0;
+  if (padded > sizeof(records))
+  {
+    if (ctar_reader_skip(reader, *header) == -1)
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    ssize_t nbytes = ctar_reader_read(reader, records, padded);
+    if (nbytes == -1)
+    {
+      return -1;
+    }
+    sparse = ctar_sparse_parse(records, nbytes < size ? nbytes : size, name, &realsize);
+  }
+
+  int status = ctar_reader_block(reader, header);
+  if (status != 1 || !sparse || !is_checksum_valid(*header))
+  {
+    return status;
+  }
+
+  // Present the entry under its real name, the header may be mapped read-only
+  if (*header != &reader->header)
+  {
+    memcpy(&reader->header, *header, sizeof(ctar_header));
+    *header = &reader->header;
+  }
+  memcpy(reader->header.name, name, CTAR_NAME_SIZE);
+  compute_checksum(&reader->header);
+  reader->sparse_size = realsize;
+  return 1;
+}
+
+int ctar_reader_next(ctar_reader *reader, ctar_header **header)
+{
+  reader->sparse_size = -1;
+  int status = ctar_reader_block(reader, header);
+  if (status == 1 && (*header)->typeflag[0] == XHDTYPE && is_checksum_valid(*header))
+  {
+    return ctar_reader_extended(reader, header);
+  }
+
+  return status;
+}
+
+/**
+ * @note Skipping past the end of a mapped archive ends it, like seeking past the end of a file.
+ * The whole windows of an archive read with O_DIRECT are seeked over, not read.
+ */
+int ctar_reader_skip(ctar_reader *reader, ctar_header *header)
+{
+  size_t nbytes = (size_t)get_nblocks(header) * CTAR_BLOCK_SIZE;
+  if (reader->map != NULL)
+  {
+    reader->pos = nbytes < reader->size - reader->pos ? reader->pos + nbytes : reader->size;
+    return 0;
+  }
+
+  if (reader->window == NULL)
+  {
+    return skip_data_blocks(reader->fd, header);
+  }
+
+  size_t available = reader->window_len - reader->window_pos;
+  if (nbytes <= available || reader->window_len % CTAR_DIRECT_ALIGN != 0)
+  {
+    reader->window_pos += nbytes < available ? nbytes : available;
+    return 0;
+  }
+
+  // Keep the offset of the archive aligned
+  nbytes -= available;
+  off_t seek = nbytes & ~(size_t)(CTAR_DIRECT_ALIGN - 1);
+  if (seek > 0 && lseek(reader->fd, seek, SEEK_CUR) == -1)
+  {
+    return -1;
+  }
+
+  if (ctar_reader_fill(reader) == -1)
+  {
+    return -1;
+  }
+  nbytes -= seek;
+  reader->window_pos = nbytes < reader->window_len ? nbytes : reader->window_len;
+  return 0;
+}
+
+ssize_t ctar_reader_read(ctar_reader *reader, void *buf, size_t count)
+{
+  if (reader->map != NULL)
+  {
+    size_t available = reader->size - reader->pos;
+    size_t len = count < available ? count : available;
+    memcpy(buf, reader->map + reader->pos, len);
+    reader->pos += len;
+    return len;
+  }
+
+  if (reader->window == NULL)
+  {
+    return read_full(reader->fd, buf, count);
+  }
+
+  size_t total = 0;
+  while (total < count)
+  {
+    if (reader->window_pos == reader->window_len)
+    {
+      ssize_t nbytes = ctar_reader_fill(reader);
+      if (nbytes == -1)
+      {
+        return -1;
+      }
+
+      if (nbytes == 0)
+      {
+        break;
+      }
+    }
+
+    size_t available = reader->window_len - reader->window_pos;
+    size_t len = count - total < available ? count - total : available;
+    memcpy((unsigned char *)buf + total, reader->window + reader->window_pos, len);
+    reader->window_pos += len;
+    total += len;
+  }
+
+  return total;
+}
+
+long ctar_reader_copy(ctar_reader *reader, int fd_out, size_t count)
+{
+  if (reader->window != NULL)
+  {
+    return 0;
+  }
+
+  if (reader->map == NULL)
+  {
+    return copy_in_kernel(reader->fd, fd_out, count);
+  }
+
+  size_t available = reader->size - reader->pos;
+  if (lseek(reader->fd, reader->pos, SEEK_SET) == -1)
+  {
+    return -1;
+  }
+
+  long copied = copy_in_kernel(reader->fd, fd_out, count < available ? count : available);
+  if (copied > 0)
+  {
+    reader->pos += copied;
+  }
+  return copied;
+}
+
+/**
+ * The pages of the data are prefetched, as the caller is about to read all of them.
+ */
+const unsigned char *ctar_reader_data(ctar_reader *reader, ctar_header *header, size_t *size)
+{
+  const unsigned char *data = reader->map + reader->pos;
+  size_t available = reader->size - reader->pos;
+  size_t wanted = oct2dec(header->size, CTAR_SIZE_SIZE);
+  *size = wanted < available ? wanted : available;
+
+  if (*size > 0)
+  {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(page_size - 1);
+    madvise((void *)start, (uintptr_t)data + *size - start, MADV_WILLNEED);
+  }
+
+  ctar_reader_skip(reader, header);
+  return data;
+}
+
+void ctar_reader_close(ctar_reader *reader)
+{
+  if (reader->map != NULL)
+  {
+    ctar_cache_close(&reader->cache, reader->pos);
+    munmap((void *)reader->map, reader->map_len);
+    reader->map = NULL;
+  }
+
+  free(reader->window);
+  reader->window = NULL;
+}
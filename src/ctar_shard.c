@@ -0,0 +1,481 @@
+#include "ctar_shard.h"
+#include "ctar.h"
+#include "ctar_dir.h"
+#include "utils.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+
+/** @brief File to archive, in the order of a recursive walk */
+typedef struct ctar_shard_entry
+{
+  char path[CTAR_NAME_SIZE];
+  bool dir;    // Whether the file is a directory, added to every shard
+  long weight; // Size of the file in an archive, header included
+  int shard;   // Index of the shard holding the file, -1 for directories
+} ctar_shard_entry;
+
+/** @brief Files to archive, listed before being balanced between the shards */
+typedef struct ctar_shard_list
+{
+  ctar_shard_entry *entries;
+  size_t count;
+  size_t capacity;
+  size_t ndirs;
+  bool inode_order;  // See ctar_args::inode_order
+  struct stat *skip; // Status of the shards and of the manifest, not to add to themselves
+  int nskip;
+} ctar_shard_list;
+
+/**
+ * @brief List a file to archive, and the files inside it if it is a directory,
+ * in the order ctar_create_at() adds them.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_shard_walk(ctar_shard_list *list, int dir_fd, const char *name, const char *path)
+{
+  if (strlen(path) >= CTAR_NAME_SIZE)
+  {
+    fprintf(stderr, "Warning: path '%s' is too long, skipping entry\n", path);
+    return 0;
+  }
+
+  struct stat st;
+  if (ctar_dir_stat(dir_fd, name, &st) == -1)
+  {
+    perror("Unable to stat file");
+    return -1;
+  }
+
+  for (int i = 0; i < list->nskip; i++)
+  {
+    if (list->skip[i].st_dev == st.st_dev && list->skip[i].st_ino == st.st_ino)
+    {
+      fprintf(stderr, "Warning: archive and file '%s' are the same, skipping entry\n", path);
+      return 0;
+    }
+  }
+
+  if (list->count == list->capacity)
+  {
+    size_t capacity = list->capacity == 0 ? 1024 : 2 * list->capacity;
+    ctar_shard_entry *entries = realloc(list->entries, capacity * sizeof(ctar_shard_entry));
+    if (entries == NULL)
+    {
+      perror("Unable to allocate file list");
+      return -1;
+    }
+    list->entries = entries;
+    list->capacity = capacity;
+  }
+
+  ctar_shard_entry *entry = &list->entries[list->count++];
+  strcpy(entry->path, path);
+  entry->dir = S_ISDIR(st.st_mode);
+  entry->weight = CTAR_BLOCK_SIZE;
+  entry->shard = -1;
+  if (S_ISREG(st.st_mode))
+  {
+    entry->weight += (st.st_size + CTAR_BLOCK_SIZE - 1) / CTAR_BLOCK_SIZE * CTAR_BLOCK_SIZE;
+  }
+
+  if (!S_ISDIR(st.st_mode))
+  {
+    return 0;
+  }
+  list->ndirs++;
+
+  // List files and directories inside the directory
+  int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY);
+  ctar_dir dir;
+  if (fd == -1 || ctar_dir_open(&dir, fd, list->inode_order) == -1)
+  {
+    perror("Unable to open directory");
+    if (fd != -1)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+
+  // If path ends with a slash, it is removed from the paths of the files
+  char parent[CTAR_NAME_SIZE];
+  strcpy(parent, path);
+  size_t len = strlen(parent);
+  if (len > 0 && parent[len - 1] == '/')
+  {
+    parent[len - 1] = '\0';
+  }
+
+  int status = 0;
+  int nread;
+  const char *child_name;
+  unsigned char type;
+  while (status == 0 && (nread = ctar_dir_next(&dir, &child_name, &type)) == 1)
+  {
+    char child[PATH_MAX];
+    snprintf(child, sizeof(child), "%s/%s", parent, child_name);
+    status = ctar_shard_walk(list, fd, child_name, child);
+  }
+
+  if (status == 0 && nread == -1)
+  {
+    perror("Unable to read directory");
+    status = -1;
+  }
+  ctar_dir_close(&dir);
+  close(fd);
+
+  return status;
+}
+
+/**
+ * @brief Order files from the largest to the smallest, then in the order of the walk.
+ */
+static int ctar_shard_compare(const void *a, const void *b)
+{
+  const ctar_shard_entry *entry_a = *(ctar_shard_entry *const *)a;
+  const ctar_shard_entry *entry_b = *(ctar_shard_entry *const *)b;
+  if (entry_a->weight != entry_b->weight)
+  {
+    return entry_a->weight > entry_b->weight ? -1 : 1;
+  }
+  return entry_a < entry_b ? -1 : entry_a > entry_b;
+}
+
+/**
+ * @brief Balance the files between the shards, and build the file list of each shard.
+ *
+ * From the largest, each file goes to the smallest shard so far: a few large files end up
+ * in different shards, and no shard is left empty if there are as many files as shards.
+ * Each shard keeps the order of the walk.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_shard_assign(ctar_shard *shards, int count, ctar_shard_list *list)
+{
+  size_t nfiles = list->count - list->ndirs;
+  ctar_shard_entry **order = malloc((nfiles > 0 ? nfiles : 1) * sizeof(ctar_shard_entry *));
+  if (order == NULL)
+  {
+    perror("Unable to allocate file list");
+    return -1;
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < list->count; i++)
+  {
+    if (!list->entries[i].dir)
+    {
+      order[n++] = &list->entries[i];
+    }
+  }
+  qsort(order, nfiles, sizeof(ctar_shard_entry *), ctar_shard_compare);
+
+  for (size_t i = 0; i < nfiles; i++)
+  {
+    int smallest = 0;
+    for (int j = 1; j < count; j++)
+    {
+      if (shards[j].bytes < shards[smallest].bytes)
+      {
+        smallest = j;
+      }
+    }
+    order[i]->shard = smallest;
+    shards[smallest].bytes += order[i]->weight;
+    shards[smallest].nfiles++;
+  }
+  free(order);
+
+  for (int i = 0; i < count; i++)
+  {
+    shards[i].files = malloc((list->ndirs + shards[i].nfiles + 1) * sizeof(char *));
+    if (shards[i].files == NULL)
+    {
+      perror("Unable to allocate file list");
+      return -1;
+    }
+
+    size_t len = 0;
+    for (size_t j = 0; j < list->count; j++)
+    {
+      if (list->entries[j].dir || list->entries[j].shard == i)
+      {
+        shards[i].files[len++] = list->entries[j].path;
+      }
+    }
+    shards[i].files[len] = NULL;
+    shards[i].args.files = shards[i].files;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Write the shard holding each file to the manifest.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_shard_write_manifest(FILE *manifest, ctar_shard_list *list, int count)
+{
+  fprintf(manifest, "%s %d\n", CTAR_SHARD_MAGIC, count);
+  for (size_t i = 0; i < list->count; i++)
+  {
+    ctar_shard_entry *entry = &list->entries[i];
+    if (entry->dir)
+    {
+      fputs("*\t", manifest);
+    }
+    else
+    {
+      fprintf(manifest, "%d\t", entry->shard);
+    }
+
+    for (const char *c = entry->path; *c != '\0'; c++)
+    {
+      if (*c == '\\' || *c == '\n')
+      {
+        fputc('\\', manifest);
+      }
+      fputc(*c == '\n' ? 'n' : *c, manifest);
+    }
+    fputc('\n', manifest);
+  }
+
+  if (fflush(manifest) == EOF || ferror(manifest))
+  {
+    perror("Unable to write shard manifest");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void *ctar_shard_worker(void *arg)
+{
+  ctar_shard *shard = arg;
+  if (shard->args.create)
+  {
+    shard->status = ctar_create(&shard->args, shard->fd);
+  }
+  else
+  {
+    shard->status = ctar_extract(&shard->args, shard->fd);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Create or extract the shards in parallel, a thread each.
+ *
+ * @return int 0 if every shard was created or extracted, -1 otherwise.
+ */
+static int ctar_shard_parallel(ctar_shard *shards, int count)
+{
+  int status = 0;
+  int started = 0;
+  for (; started < count; started++)
+  {
+    int err = pthread_create(&shards[started].thread, NULL, ctar_shard_worker, &shards[started]);
+    if (err != 0)
+    {
+      fprintf(stderr, "Unable to start shard thread: %s\n", strerror(err));
+      status = -1;
+      break;
+    }
+  }
+
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join(shards[i].thread, NULL);
+    if (shards[i].status == -1)
+    {
+      status = -1;
+    }
+  }
+
+  return status;
+}
+
+/**
+ * Only regular files are probed: opening and reading a pipe (standard input, FIFO, process substitution)
+ * would consume the beginning of the archive, or break it.
+ * The manifest is read with a single read(), its first line being short.
+ */
+int ctar_shard_count(ctar_args *args)
+{
+  struct stat st;
+  if (strcmp(args->archive, CTAR_ARGS_STDIO) == 0 || stat(args->archive, &st) == -1 || !S_ISREG(st.st_mode))
+  {
+    return 0;
+  }
+
+  int fd = open(args->archive, O_RDONLY);
+  if (fd == -1)
+  {
+    return 0;
+  }
+
+  char line[32];
+  ssize_t nbytes = read_full(fd, line, sizeof(line) - 1);
+  close(fd);
+
+  size_t magic_len = strlen(CTAR_SHARD_MAGIC);
+  if (nbytes <= (ssize_t)magic_len || memcmp(line, CTAR_SHARD_MAGIC " ", magic_len + 1) != 0)
+  {
+    return 0;
+  }
+  line[nbytes] = '\0';
+
+  char *end;
+  errno = 0;
+  long count = strtol(line + magic_len + 1, &end, 10);
+  if (errno != 0 || *end != '\n' || count < 1 || count > CTAR_SHARD_MAX)
+  {
+    fprintf(stderr, "Invalid shard manifest '%s'\n", args->archive);
+    return -1;
+  }
+
+  return count;
+}
+
+/**
+ * The shards (and the manifest) are opened before changing to args->dir, like the archive by main().
+ * When creating, the files to archive are listed and balanced first, then each shard adds its own
+ * files without walking the directories again (see ctar_args::recursive), with a single thread.
+ * When listing, the shards are listed one after the other, so that the entries are not mixed,
+ * and the directories only from the first shard.
+ */
+int ctar_shard_run(ctar_args *args, int count)
+{
+  ctar_shard *shards = calloc(count, sizeof(ctar_shard));
+  ctar_shard_list list = {.inode_order = args->inode_order, .skip = calloc(count + 1, sizeof(struct stat))};
+  if (shards == NULL || list.skip == NULL)
+  {
+    perror("Unable to allocate shards");
+    free(shards);
+    free(list.skip);
+    return -1;
+  }
+
+  int status = 0;
+  FILE *manifest = NULL;
+  if (args->create)
+  {
+    manifest = fopen(args->archive, "w");
+    if (manifest == NULL || fstat(fileno(manifest), &list.skip[list.nskip++]) == -1)
+    {
+      perror("Unable to open shard manifest");
+      status = -1;
+    }
+  }
+
+  int opened = 0;
+  while (status == 0 && opened < count)
+  {
+    ctar_shard *shard = &shards[opened];
+    shard->args = *args;
+    shard->args.shards = 1;
+    if (args->create)
+    {
+      shard->args.recursive = false;
+      shard->args.jobs = 1;
+    }
+
+    if (snprintf(shard->args.archive, CTAR_ARGS_ARCHIVE_SIZE, "%.*s.%d",
+                 CTAR_ARGS_ARCHIVE_SIZE, args->archive, opened) >= CTAR_ARGS_ARCHIVE_SIZE)
+    {
+      fprintf(stderr, "Archive name '%s' is too long for shards\n", args->archive);
+      status = -1;
+      break;
+    }
+
+    shard->fd = ctar_open(&shard->args);
+    if (shard->fd == -1)
+    {
+      status = -1;
+      break;
+    }
+    opened++;
+
+    if (args->create && stat(shard->args.archive, &list.skip[list.nskip++]) == -1)
+    {
+      perror("Unable to stat archive");
+      status = -1;
+    }
+  }
+
+  bool moved = false;
+  if (status == 0 && args->dir[0])
+  {
+    status = ctar_chdir(args);
+    moved = status == 0;
+  }
+
+  if (status == 0 && args->create)
+  {
+    for (int i = 0; status == 0 && args->files[i] != NULL; i++)
+    {
+      status = ctar_shard_walk(&list, AT_FDCWD, args->files[i], args->files[i]);
+    }
+
+    if (status == 0 && ctar_shard_assign(shards, count, &list) == 0 &&
+        ctar_shard_write_manifest(manifest, &list, count) == 0)
+    {
+      status = ctar_shard_parallel(shards, count);
+    }
+    else
+    {
+      status = -1;
+    }
+  }
+  else if (status == 0 && args->list)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      // Every shard holds all the directories, they are only listed once
+      shards[i].args.list_dirs = i == 0;
+      if (ctar_list(&shards[i].args, shards[i].fd) == -1)
+      {
+        status = -1;
+      }
+    }
+  }
+  else if (status == 0)
+  {
+    status = ctar_shard_parallel(shards, count);
+  }
+
+  if (moved && ctar_chdir(args) == -1)
+  {
+    status = -1;
+  }
+
+  for (int i = 0; i < opened; i++)
+  {
+    if (ctar_close(&shards[i].args, shards[i].fd) == -1)
+    {
+      status = -1;
+    }
+    free(shards[i].files);
+  }
+
+  if (manifest != NULL && fclose(manifest) == EOF && status == 0)
+  {
+    perror("Unable to close shard manifest");
+    status = -1;
+  }
+
+  free(list.entries);
+  free(list.skip);
+  free(shards);
+
+  return status;
+}
@@ -0,0 +1,406 @@
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
+#include "ctar_sparse.h"
+#include "utils.h"
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Append a data region to a map.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_sparse_push(ctar_sparse *sparse, long offset, long size)
+{
+  if (sparse->count == sparse->capacity)
+  {
+    long capacity = sparse->capacity ? 2 * sparse->capacity : 16;
+    ctar_sparse_region *regions = realloc(sparse->regions, capacity * sizeof(ctar_sparse_region));
+    if (regions == NULL)
+    {
+      perror("Unable to allocate sparse map");
+      return -1;
+    }
+    sparse->regions = regions;
+    sparse->capacity = capacity;
+  }
+
+  sparse->regions[sparse->count].offset = offset;
+  sparse->regions[sparse->count].size = size;
+  sparse->count++;
+  sparse->stored += size;
+  return 0;
+}
+
+/**
+ * Only files using fewer blocks than their size are scanned, with SEEK_DATA and SEEK_HOLE.
+ * If the file system does not report holes, the file is stored as a regular file.
+ * Like GNU tar, a file ending with a hole gets a last empty region at its end.
+ *
+ * @note The offset of the file is moved back to its beginning.
+ */
+int ctar_sparse_scan(ctar_sparse *sparse, int fd)
+{
+  memset(sparse, 0, sizeof(ctar_sparse));
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+  {
+    perror("Unable to stat input file");
+    return -1;
+  }
+  sparse->size = st.st_size;
+
+  // st_blocks counts 512 bytes units, whatever the block size of the file system
+  bool holes = (long)st.st_blocks * 512 < st.st_size;
+  for (off_t offset = 0; holes && offset < st.st_size;)
+  {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data == -1 && errno == ENXIO)
+    {
+      // The file ends with a hole
+      break;
+    }
+
+    off_t hole = data == -1 ? -1 : lseek(fd, data, SEEK_HOLE);
+    if (hole == -1)
+    {
+      holes = false;
+      break;
+    }
+
+    hole = hole < st.st_size ? hole : st.st_size;
+    if (ctar_sparse_push(sparse, data, hole - data) == -1)
+    {
+      return -1;
+    }
+    offset = hole;
+  }
+
+  if (lseek(fd, 0, SEEK_SET) == -1)
+  {
+    perror("Unable to seek input file");
+    return -1;
+  }
+
+  if (!holes || sparse->stored == sparse->size)
+  {
+    sparse->count = 0;
+    sparse->stored = 0;
+    return ctar_sparse_push(sparse, 0, st.st_size);
+  }
+
+  ctar_sparse_region *last = sparse->count > 0 ? &sparse->regions[sparse->count - 1] : NULL;
+  if (last == NULL || last->offset + last->size < sparse->size)
+  {
+    if (ctar_sparse_push(sparse, sparse->size, 0) == -1)
+    {
+      return -1;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * @brief Append a record to the records of an extended header.
+ *
+ * A record is "LENGTH KEY=VALUE\n", where LENGTH counts the whole record, its own digits included.
+ *
+ * @return int 0 if successful, -1 if the record does not fit.
+ */
+static int ctar_sparse_record(char *records, size_t *len, const char *key, const char *value)
+{
+  int size = strlen(key) + strlen(value) + 3;
+  int digits = snprintf(NULL, 0, "%d", size);
+  if (snprintf(NULL, 0, "%d", size + digits) > digits)
+  {
+    digits++;
+  }
+  size += digits;
+
+  if (*len + size >= CTAR_SPARSE_RECORDS_SIZE)
+  {
+    return -1;
+  }
+
+  snprintf(records + *len, CTAR_SPARSE_RECORDS_SIZE - *len, "%d %s=%s\n", size, key, value);
+  *len += size;
+  return 0;
+}
+
+/**
+ * @brief Write a buffer to the archive, padded with zeros to the next block.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_sparse_write_padded(ctar_pipeline *out, const void *buf, size_t size)
+{
+  static const char zeros[CTAR_BLOCK_SIZE];
+  size_t padding = (CTAR_BLOCK_SIZE - size % CTAR_BLOCK_SIZE) % CTAR_BLOCK_SIZE;
+  if (ctar_pipeline_write(out, buf, size) == -1 || ctar_pipeline_write(out, zeros, padding) == -1)
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * The extended header is named like the ones of GNU tar, DIR/PaxHeaders/NAME.
+ * It keeps the metadata of the file, for readers showing the extended headers as files.
+ */
+int ctar_sparse_write_header(ctar_sparse *sparse, ctar_header *header, ctar_pipeline *out)
+{
+  char name[CTAR_NAME_SIZE + 1];
+  snprintf(name, sizeof(name), "%.*s", CTAR_NAME_SIZE, header->name);
+
+  // Create copies of the name because dirname() and basename() may modify them
+  char dir_copy[CTAR_NAME_SIZE + 1];
+  char base_copy[CTAR_NAME_SIZE + 1];
+  strcpy(dir_copy, name);
+  strcpy(base_copy, name);
+  char *dir = dirname(dir_copy);
+  char *base = basename(base_copy);
+
+  // Extended header
+  char records[CTAR_SPARSE_RECORDS_SIZE];
+  size_t len = 0;
+  char realsize[32];
+  snprintf(realsize, sizeof(realsize), "%ld", sparse->size);
+  if (ctar_sparse_record(records, &len, "GNU.sparse.major", "1") == -1 ||
+      ctar_sparse_record(records, &len, "GNU.sparse.minor", "0") == -1 ||
+      ctar_sparse_record(records, &len, "GNU.sparse.name", name) == -1 ||
+      ctar_sparse_record(records, &len, "GNU.sparse.realsize", realsize) == -1)
+  {
+    fprintf(stderr, "Unable to write extended header\n");
+    return -1;
+  }
+
+  char path[PATH_MAX];
+  ctar_header extended = *header;
+  snprintf(path, sizeof(path), "%s/PaxHeaders/%s", dir, base);
+  strncpy(extended.name, path, CTAR_NAME_SIZE);
+  extended.typeflag[0] = XHDTYPE;
+  dec2oct(len, extended.size, CTAR_SIZE_SIZE);
+  compute_checksum(&extended);
+  if (ctar_pipeline_write(out, &extended, sizeof(ctar_header)) == -1 || ctar_sparse_write_padded(out, records, len) == -1)
+  {
+    fprintf(stderr, "Unable to write extended header\n");
+    return -1;
+  }
+
+  // Map, at most 20 digits and a new line per number
+  char *map = malloc((2 * sparse->count + 1) * 21);
+  if (map == NULL)
+  {
+    perror("Unable to allocate sparse map");
+    return -1;
+  }
+
+  int map_len = sprintf(map, "%ld\n", sparse->count);
+  for (long i = 0; i < sparse->count; i++)
+  {
+    map_len += sprintf(map + map_len, "%ld\n%ld\n", sparse->regions[i].offset, sparse->regions[i].size);
+  }
+  long map_padded = (map_len + CTAR_BLOCK_SIZE - 1) / CTAR_BLOCK_SIZE * CTAR_BLOCK_SIZE;
+
+  // Header of the data, the map followed by the data of the regions
+  snprintf(path, sizeof(path), "%s/" CTAR_SPARSE_DIR "/%s", dir, base);
+  strncpy(header->name, path, CTAR_NAME_SIZE);
+  header->typeflag[0] = REGTYPE;
+  dec2oct(map_padded + sparse->stored, header->size, CTAR_SIZE_SIZE);
+  compute_checksum(header);
+
+  int status = 0;
+  if (ctar_pipeline_write(out, header, sizeof(ctar_header)) == -1 || ctar_sparse_write_padded(out, map, map_len) == -1)
+  {
+    fprintf(stderr, "Unable to write header\n");
+    status = -1;
+  }
+  free(map);
+
+  return status;
+}
+
+/**
+ * @brief Parse the decimal number at the beginning of a string.
+ *
+ * @return size_t the number of digits parsed, 0 if there are none or if the number overflows.
+ */
+static size_t ctar_sparse_decimal(const char *str, size_t size, long *value)
+{
+  size_t digits = 0;
+  *value = 0;
+  while (digits < size && str[digits] >= '0' && str[digits] <= '9')
+  {
+    if (digits == 18)
+    {
+      return 0;
+    }
+    *value = *value * 10 + str[digits] - '0';
+    digits++;
+  }
+
+  return digits;
+}
+
+/**
+ * Records of other keys are ignored, the parsing stops at the first malformed record.
+ * Only the format 1.0 is supported, the older ones store the map in the extended header itself.
+ */
+int ctar_sparse_parse(const char *records, size_t size, char *name, long *realsize)
+{
+  bool major = false;
+  bool minor = false;
+  bool has_name = false;
+  bool has_size = false;
+
+  size_t pos = 0;
+  while (pos < size)
+  {
+    long len;
+    size_t digits = ctar_sparse_decimal(records + pos, size - pos, &len);
+    if (digits == 0 || len <= digits + 1 || len > size - pos || records[pos + digits] != ' ' ||
+        records[pos + len - 1] != '\n')
+    {
+      break;
+    }
+
+    const char *key = records + pos + digits + 1;
+    const char *end = records + pos + len - 1;
+    const char *equal = memchr(key, '=', end - key);
+    pos += len;
+    if (equal == NULL)
+    {
+      continue;
+    }
+
+    const char *value = equal + 1;
+    size_t key_len = equal - key;
+    size_t value_len = end - value;
+    long number;
+    if (key_len == 16 && strncmp(key, "GNU.sparse.major", key_len) == 0)
+    {
+      major = value_len == 1 && value[0] == '1';
+    }
+    else if (key_len == 16 && strncmp(key, "GNU.sparse.minor", key_len) == 0)
+    {
+      minor = value_len == 1 && value[0] == '0';
+    }
+    else if (key_len == 15 && strncmp(key, "GNU.sparse.name", key_len) == 0)
+    {
+      memset(name, 0, CTAR_NAME_SIZE);
+      memcpy(name, value, value_len < CTAR_NAME_SIZE ? value_len : CTAR_NAME_SIZE);
+      has_name = value_len > 0;
+    }
+    else if (key_len == 19 && strncmp(key, "GNU.sparse.realsize", key_len) == 0)
+    {
+      has_size = value_len > 0 && ctar_sparse_decimal(value, value_len, &number) == value_len;
+      if (has_size)
+      {
+        *realsize = number;
+      }
+    }
+  }
+
+  return major && minor && has_name && has_size;
+}
+
+/**
+ * The map is read block by block, until all its numbers are parsed.
+ * Regions must be sorted, and lie in the file.
+ */
+long ctar_sparse_read_map(ctar_sparse *sparse, ctar_reader *in, long realsize)
+{
+  memset(sparse, 0, sizeof(ctar_sparse));
+  sparse->size = realsize;
+
+  char block[CTAR_BLOCK_SIZE];
+  long consumed = 0;
+  long count = -1;
+  long numbers = 0; // Numbers parsed after the count
+  long value = 0;
+  int digits = 0;
+  long end = 0;
+
+  while (count == -1 || numbers < 2 * count)
+  {
+    ssize_t nbytes = ctar_reader_read(in, block, sizeof(block));
+    if (nbytes == -1)
+    {
+      perror("Unable to read archive");
+      return -1;
+    }
+
+    if (nbytes < sizeof(block))
+    {
+      fprintf(stderr, "Unexpected end of archive\n");
+      return -1;
+    }
+    consumed += nbytes;
+
+    for (int i = 0; i < sizeof(block) && (count == -1 || numbers < 2 * count); i++)
+    {
+      if (block[i] >= '0' && block[i] <= '9' && digits < 18)
+      {
+        value = value * 10 + block[i] - '0';
+        digits++;
+        continue;
+      }
+
+      if (block[i] != '\n' || digits == 0)
+      {
+        fprintf(stderr, "Invalid sparse map\n");
+        return -1;
+      }
+
+      if (count == -1)
+      {
+        count = value;
+        if (count > CTAR_SPARSE_REGIONS_MAX)
+        {
+          fprintf(stderr, "Invalid sparse map\n");
+          return -1;
+        }
+      }
+      else if (numbers % 2 == 0)
+      {
+        if (value < end || value > realsize || ctar_sparse_push(sparse, value, 0) == -1)
+        {
+          fprintf(stderr, "Invalid sparse map\n");
+          return -1;
+        }
+        numbers++;
+      }
+      else
+      {
+        ctar_sparse_region *region = &sparse->regions[sparse->count - 1];
+        if (value > realsize - region->offset)
+        {
+          fprintf(stderr, "Invalid sparse map\n");
+          return -1;
+        }
+        region->size = value;
+        sparse->stored += value;
+        end = region->offset + value;
+        numbers++;
+      }
+      value = 0;
+      digits = 0;
+    }
+  }
+
+  return consumed;
+}
+
+void ctar_sparse_free(ctar_sparse *sparse)
+{
+  free(sparse->regions);
+  sparse->regions = NULL;
+  sparse->count = 0;
+  sparse->capacity = 0;
+}
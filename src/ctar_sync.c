@@ -0,0 +1,153 @@
+#define _GNU_SOURCE // syncfs(), sync_file_range()
+#include "ctar_sync.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/** @brief Names of the policies, in the order of ctar_sync_mode */
+static const char *ctar_sync_names[] = {"none", "per-file", "batched", "end"};
+
+int ctar_sync_parse(const char *name)
+{
+  for (int i = 0; i < sizeof(ctar_sync_names) / sizeof(ctar_sync_names[0]); i++)
+  {
+    if (strcmp(name, ctar_sync_names[i]) == 0)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @brief Get the time of the monotonic clock, in seconds.
+ */
+static double ctar_sync_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int ctar_sync_open(ctar_sync *sync, ctar_sync_mode mode)
+{
+  memset(sync, 0, sizeof(ctar_sync));
+  sync->mode = mode;
+  sync->fd = -1;
+  sync->start = ctar_sync_now();
+
+  if (mode != CTAR_SYNC_NONE)
+  {
+    sync->fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (sync->fd == -1)
+    {
+      perror("Unable to open extraction directory");
+      return -1;
+    }
+  }
+  pthread_mutex_init(&sync->lock, NULL);
+
+  return 0;
+}
+
+/**
+ * @brief Wait for the writeback of every file extracted so far.
+ *
+ * syncfs() waits for the writeback started by sync_file_range() at once,
+ * and also writes back the directories and symbolic links created.
+ * It is called with sync->lock held, or once the files are extracted.
+ *
+ * @return int 0 if successful, -1 otherwise.
+ */
+static int ctar_sync_sweep(ctar_sync *sync)
+{
+  sync->bytes = 0;
+  sync->files = 0;
+  double start = ctar_sync_now();
+  int status = syncfs(sync->fd);
+  sync->calls++;
+  sync->wait += ctar_sync_now() - start;
+  if (status == -1)
+  {
+    perror("Unable to sync extracted files");
+    return -1;
+  }
+
+  return 0;
+}
+
+int ctar_sync_written(ctar_sync *sync, long size)
+{
+  if (sync->mode != CTAR_SYNC_BATCHED)
+  {
+    return 0;
+  }
+
+  int status = 0;
+  pthread_mutex_lock(&sync->lock);
+  sync->bytes += size;
+  sync->files++;
+  if (sync->bytes >= CTAR_SYNC_BATCH_SIZE || sync->files >= CTAR_SYNC_BATCH_FILES)
+  {
+    status = ctar_sync_sweep(sync);
+  }
+  pthread_mutex_unlock(&sync->lock);
+
+  return status;
+}
+
+/**
+ * With the batched policy, sync_file_range() only starts the writeback of the file, without waiting for it,
+ * so that the disk writes the files while the next ones are extracted.
+ */
+int ctar_sync_file(ctar_sync *sync, int fd, long size)
+{
+  if (sync->mode != CTAR_SYNC_FILE && sync->mode != CTAR_SYNC_BATCHED)
+  {
+    return 0;
+  }
+
+  double start = ctar_sync_now();
+  int status = sync->mode == CTAR_SYNC_FILE ? fsync(fd) : sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  double wait = ctar_sync_now() - start;
+
+  pthread_mutex_lock(&sync->lock);
+  sync->calls++;
+  sync->wait += wait;
+  pthread_mutex_unlock(&sync->lock);
+
+  if (status == -1)
+  {
+    perror("Unable to sync output file");
+    return -1;
+  }
+
+  return ctar_sync_written(sync, size);
+}
+
+/**
+ * The data of the files synced one by one is already durable, the final sweep makes
+ * the directories, symbolic links and file sizes durable too.
+ */
+int ctar_sync_close(ctar_sync *sync)
+{
+  int status = 0;
+  if (sync->fd != -1)
+  {
+    status = ctar_sync_sweep(sync);
+    close(sync->fd);
+    sync->fd = -1;
+  }
+  pthread_mutex_destroy(&sync->lock);
+
+  return status;
+}
+
+void ctar_sync_report(ctar_sync *sync)
+{
+  fprintf(stderr, "Sync policy %s: %ld sync calls in %.3f s, out of %.3f s of extraction\n",
+          ctar_sync_names[sync->mode], sync->calls, sync->wait, ctar_sync_now() - sync->start);
+}
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE // SYNC_FILE_RANGE_WRITE
+#include "ctar_uring.h"
+#include "ctar_dcache.h"
+
+#ifdef CTAR_URING
+
+#include "utils.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <liburing.h>
+
+#define CTAR_URING_OPS 4                                  // Represents the maximum number of operations per file
+#define CTAR_URING_ENTRIES (CTAR_URING_OPS * CTAR_URING_DEPTH) // Represents the size of the submission queue
+
+/** @brief Operations extracting a regular file, linked in this order */
+enum
+{
+  CTAR_URING_OPEN,
+  CTAR_URING_WRITE,
+  CTAR_URING_SYNC,
+  CTAR_URING_CLOSE,
+};
+
+/** @brief Regular file being extracted, opened in the direct descriptor of the same index */
+typedef struct ctar_uring_file
+{
+  bool busy;
+  bool failed; // Whether an error was reported, the next operations of the file are canceled
+  char name[CTAR_NAME_SIZE + 1];
+  size_t size;
+  unsigned char *buf; // Copy of the data, if the archive is not mapped
+} ctar_uring_file;
+
+struct ctar_uring
+{
+  struct io_uring ring;
+  ctar_sync_mode sync_mode; // Whether files are synced, or their writeback started, before being closed
+  ctar_uring_file files[CTAR_URING_DEPTH];
+  int busy;              // Number of files being extracted
+  int status; // -1 once a file could not be extracted
+};
+
+/**
+ * Files are opened into direct descriptors (io_uring_register_files_sparse(), Linux 5.19),
+ * so that writing and closing a file can be linked to its opening, and the three operations
+ * submitted at once. If the kernel does not support it (or io_uring is disabled), NULL is returned.
+ */
+ctar_uring *ctar_uring_new(ctar_sync_mode sync_mode)
+{
+  ctar_uring *uring = calloc(1, sizeof(ctar_uring));
+  if (uring == NULL)
+  {
+    return NULL;
+  }
+  uring->sync_mode = sync_mode;
+
+  if (io_uring_queue_init(CTAR_URING_ENTRIES, &uring->ring, 0) < 0)
+  {
+    free(uring);
+    return NULL;
+  }
+
+  if (io_uring_register_files_sparse(&uring->ring, CTAR_URING_DEPTH) < 0)
+  {
+    io_uring_queue_exit(&uring->ring);
+    free(uring);
+    return NULL;
+  }
+
+  return uring;
+}
+
+/**
+ * @brief Handle the completion of an operation.
+ *
+ * Only the first error of a file is reported, the operations linked after it are canceled.
+ * The close operation always completes, and releases the file.
+ */
+static void ctar_uring_complete(ctar_uring *uring, struct io_uring_cqe *cqe)
+{
+  uint64_t data = io_uring_cqe_get_data64(cqe);
+  ctar_uring_file *file = &uring->files[data / CTAR_URING_OPS];
+  int op = data % CTAR_URING_OPS;
+
+  // A short write means the file system is full
+  int err = cqe->res < 0 ? -cqe->res : (op == CTAR_URING_WRITE && cqe->res != file->size ? ENOSPC : 0);
+  if (err != 0 && !file->failed)
+  {
+    const char *actions[] = {"open", "write to", "sync", "close"};
+    const char *action = actions[op];
+    fprintf(stderr, "Unable to %s output file '%s': %s\n", action, file->name, strerror(err));
+    file->failed = true;
+    uring->status = -1;
+  }
+
+  if (op == CTAR_URING_CLOSE)
+  {
+    file->busy = false;
+    uring->busy--;
+  }
+}
+
+/**
+ * @brief Submit the queued operations, wait for wait_nr completions and handle all the available ones.
+ *
+ * @return int 0 if successful, -1 if the operations could not be submitted.
+ */
+static int ctar_uring_reap(ctar_uring *uring, unsigned wait_nr)
+{
+  int err;
+  while ((err = io_uring_submit_and_wait(&uring->ring, wait_nr)) == -EINTR)
+  {
+  }
+
+  if (err < 0)
+  {
+    fprintf(stderr, "Unable to submit to io_uring: %s\n", strerror(-err));
+    uring->status = -1;
+    return -1;
+  }
+
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  unsigned count = 0;
+  io_uring_for_each_cqe(&uring->ring, head, cqe)
+  {
+    ctar_uring_complete(uring, cqe);
+    count++;
+  }
+  io_uring_cq_advance(&uring->ring, count);
+
+  return 0;
+}
+
+/**
+ * @brief Wait for all the files being extracted.
+ *
+ * @return int 0 if every file was extracted, -1 otherwise.
+ */
+static int ctar_uring_drain(ctar_uring *uring)
+{
+  while (uring->busy > 0 && ctar_uring_reap(uring, 1) == 0)
+  {
+  }
+
+  return uring->status;
+}
+
+/**
+ * @brief Get a submission queue entry, submitting the queued ones if the queue is full.
+ */
+static struct io_uring_sqe *ctar_uring_get_sqe(ctar_uring *uring, uint64_t data, int flags)
+{
+  struct io_uring_sqe *sqe;
+  while ((sqe = io_uring_get_sqe(&uring->ring)) == NULL)
+  {
+    io_uring_submit(&uring->ring);
+  }
+
+  io_uring_sqe_set_data64(sqe, data);
+  io_uring_sqe_set_flags(sqe, flags);
+  return sqe;
+}
+
+int ctar_uring_wait_name(ctar_uring *uring, ctar_header *header)
+{
+  for (int i = 0; i < CTAR_URING_DEPTH; i++)
+  {
+    if (uring->files[i].busy && strncmp(uring->files[i].name, header->name, CTAR_NAME_SIZE) == 0)
+    {
+      return ctar_uring_drain(uring);
+    }
+  }
+
+  return uring->status;
+}
+
+/**
+ * The file is opened, written and closed by linked operations, submitted
+ * with the ones of other files once all the direct descriptors are in use.
+ * The write is hard linked to the close, so that the file is closed even after a short write.
+ * With the per-file and batched durability policies, the write is followed by a fsync, or
+ * the start of the writeback of the file (the batch is then swept by ctar_sync_written()).
+ *
+ * The parent directory is created synchronously, as the file cannot be opened without it.
+ * The file is still opened by its path: the directory kept open by dirs may be closed before the open operation runs.
+ */
+int ctar_uring_extract(ctar_uring *uring, ctar_dcache *dirs, ctar_header *header, ctar_reader *in)
+{
+  // Wait for a free direct descriptor
+  while (uring->busy == CTAR_URING_DEPTH && uring->status == 0 && ctar_uring_reap(uring, 1) == 0)
+  {
+  }
+
+  if (uring->status == -1)
+  {
+    return -1;
+  }
+
+  int index = 0;
+  while (uring->files[index].busy)
+  {
+    index++;
+  }
+  ctar_uring_file *file = &uring->files[index];
+  snprintf(file->name, sizeof(file->name), "%.*s", CTAR_NAME_SIZE, header->name);
+
+  // Prepare directory
+  const char *base;
+  if (ctar_dcache_parent(dirs, file->name, &base) == -1)
+  {
+    perror("Unable to create parent directory");
+    return -1;
+  }
+
+  // Get the data, it must stay available until it is written
+  size_t wanted = oct2dec(header->size, CTAR_SIZE_SIZE);
+  const unsigned char *data;
+  if (in->map != NULL)
+  {
+    data = ctar_reader_data(in, header, &file->size);
+  }
+  else
+  {
+    if (file->buf == NULL && (file->buf = malloc(CTAR_URING_FILE_SIZE)) == NULL)
+    {
+      perror("Unable to allocate record");
+      return -1;
+    }
+
+    ssize_t nbytes = ctar_reader_read(in, file->buf, (size_t)get_nblocks(header) * CTAR_BLOCK_SIZE);
+    if (nbytes == -1)
+    {
+      perror("Unable to read archive");
+      return -1;
+    }
+    file->size = nbytes < wanted ? nbytes : wanted;
+    data = file->buf;
+  }
+
+  int mode = oct2dec(header->mode, CTAR_MODE_SIZE);
+  struct io_uring_sqe *sqe = ctar_uring_get_sqe(uring, index * CTAR_URING_OPS + CTAR_URING_OPEN, IOSQE_IO_LINK);
+  io_uring_prep_openat_direct(sqe, AT_FDCWD, file->name, O_WRONLY | O_CREAT | O_TRUNC, mode, index);
+
+  if (file->size > 0)
+  {
+    sqe = ctar_uring_get_sqe(uring, index * CTAR_URING_OPS + CTAR_URING_WRITE, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+    io_uring_prep_write(sqe, index, data, file->size, 0);
+  }
+
+  if (uring->sync_mode == CTAR_SYNC_FILE || uring->sync_mode == CTAR_SYNC_BATCHED)
+  {
+    sqe = ctar_uring_get_sqe(uring, index * CTAR_URING_OPS + CTAR_URING_SYNC, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+    if (uring->sync_mode == CTAR_SYNC_FILE)
+    {
+      io_uring_prep_fsync(sqe, index, 0);
+    }
+    else
+    {
+      io_uring_prep_sync_file_range(sqe, index, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+  }
+
+  sqe = ctar_uring_get_sqe(uring, index * CTAR_URING_OPS + CTAR_URING_CLOSE, 0);
+  io_uring_prep_close_direct(sqe, index);
+
+  file->busy = true;
+  file->failed = false;
+  uring->busy++;
+
+  if (file->size < wanted)
+  {
+    fprintf(stderr, "Unexpected end of archive\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int ctar_uring_finish(ctar_uring *uring)
+{
+  if (uring == NULL)
+  {
+    return 0;
+  }
+
+  int status = ctar_uring_drain(uring);
+  io_uring_queue_exit(&uring->ring);
+  for (int i = 0; i < CTAR_URING_DEPTH; i++)
+  {
+    free(uring->files[i].buf);
+  }
+  free(uring);
+
+  return status;
+}
+
+#else
+
+/**
+ * Without liburing, files are always extracted with blocking syscalls.
+ */
+ctar_uring *ctar_uring_new(ctar_sync_mode sync_mode)
+{
+  (void)sync_mode;
+  return NULL;
+}
+
+int ctar_uring_wait_name(ctar_uring *uring, ctar_header *header)
+{
+  (void)uring;
+  (void)header;
+  return 0;
+}
+
+int ctar_uring_extract(ctar_uring *uring, ctar_dcache *dirs, ctar_header *header, ctar_reader *in)
+{
+  (void)uring;
+  (void)dirs;
+  (void)header;
+  (void)in;
+  return -1;
+}
+
+int ctar_uring_finish(ctar_uring *uring)
+{
+  (void)uring;
+  return 0;
+}
+
+#endif // CTAR_URING
@@ -0,0 +1,428 @@
+#include "ctar_walk.h"
+#include "ctar_dir.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/** @brief Directory walked, open until its files are stat'ed */
+typedef struct ctar_walk_dir
+{
+  int fd;
+  int refs; // Number of files listed and not stat'ed yet, plus one while the directory is listed
+} ctar_walk_dir;
+
+struct ctar_walk
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // Broadcast whenever an entry is listed, stat'ed or released
+  ctar_walk_entry entries[CTAR_WALK_AHEAD];
+  long listed;  // Number of entries listed
+  long taken;   // Number of entries picked up by the stat threads
+  long emitted; // Number of entries released by the writer
+  bool held;    // Whether the writer holds the entry emitted
+  bool closing;
+  pthread_t lister;
+  pthread_t *threads;
+  int nthreads;
+  ctar_args *args;
+};
+
+/**
+ * @brief Wait for room ahead of the writer.
+ *
+ * @return ctar_walk_entry* the entry to list, NULL if the walk is stopping.
+ */
+static ctar_walk_entry *ctar_walk_reserve(ctar_walk *walk)
+{
+  pthread_mutex_lock(&walk->lock);
+  while (walk->listed - walk->emitted == CTAR_WALK_AHEAD && !walk->closing)
+  {
+    pthread_cond_wait(&walk->cond, &walk->lock);
+  }
+  bool closing = walk->closing;
+  pthread_mutex_unlock(&walk->lock);
+
+  if (closing)
+  {
+    return NULL;
+  }
+
+  // The entry is not used by the other threads until it is listed
+  ctar_walk_entry *entry = &walk->entries[walk->listed % CTAR_WALK_AHEAD];
+  entry->ready = false;
+  entry->name = entry->path;
+  entry->dir = NULL;
+  entry->err = 0;
+  entry->fd = -1;
+  return entry;
+}
+
+/**
+ * @brief Hand an entry to the stat threads and to the writer.
+ *
+ * @param dir The directory of the file, kept open until the file is stat'ed, NULL if none.
+ */
+static void ctar_walk_publish(ctar_walk *walk, ctar_walk_entry *entry, ctar_walk_kind kind, ctar_walk_dir *dir)
+{
+  pthread_mutex_lock(&walk->lock);
+  entry->kind = kind;
+  entry->ready = kind != CTAR_WALK_FILE;
+  if (dir != NULL)
+  {
+    entry->dir = dir;
+    dir->refs++;
+  }
+  walk->listed++;
+  pthread_cond_broadcast(&walk->cond);
+  pthread_mutex_unlock(&walk->lock);
+}
+
+/**
+ * @brief Hand an error to the writer.
+ */
+static void ctar_walk_error(ctar_walk *walk, const char *path, const char *message, int err)
+{
+  ctar_walk_entry *entry = ctar_walk_reserve(walk);
+  if (entry != NULL)
+  {
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->message = message;
+    entry->err = err;
+    ctar_walk_publish(walk, entry, CTAR_WALK_ERROR, NULL);
+  }
+}
+
+/**
+ * @brief Release a directory, closed once all its files are stat'ed and listed. Called with walk->lock held, or once the threads are stopped.
+ */
+static void ctar_walk_release(ctar_walk_dir *dir)
+{
+  if (dir != NULL && --dir->refs == 0)
+  {
+    close(dir->fd);
+    free(dir);
+  }
+}
+
+/**
+ * @brief List the files of a directory, recursively, as ctar_create_directory() does.
+ *
+ * @param fd The file descriptor of the directory, closed once its files are stat'ed.
+ * @param path The path of the directory.
+ * @return int 0 if successful, -1 if the walk stopped.
+ */
+static int ctar_walk_directory(ctar_walk *walk, int fd, const char *path)
+{
+  ctar_dir dir;
+  ctar_walk_dir *handle = malloc(sizeof(ctar_walk_dir));
+  if (handle == NULL || ctar_dir_open(&dir, fd, walk->args->inode_order) == -1)
+  {
+    ctar_walk_error(walk, path, "Unable to open directory", errno);
+    free(handle);
+    close(fd);
+    return -1;
+  }
+  handle->fd = fd;
+  handle->refs = 1;
+
+  // If path ends with a slash, it is removed from the paths of the files
+  char parent[CTAR_WALK_PATH_SIZE];
+  snprintf(parent, sizeof(parent), "%s", path);
+  size_t len = strlen(parent);
+  if (len > 0 && parent[len - 1] == '/')
+  {
+    parent[len - 1] = '\0';
+    len--;
+  }
+
+  int status = 0;
+  int nread;
+  const char *name;
+  unsigned char type;
+  while (status == 0 && (nread = ctar_dir_next(&dir, &name, &type)) == 1)
+  {
+    ctar_walk_entry *entry = ctar_walk_reserve(walk);
+    if (entry == NULL)
+    {
+      status = -1;
+      break;
+    }
+
+    int n = snprintf(entry->path, sizeof(entry->path), "%s/%s", parent, name);
+    if (n >= CTAR_NAME_SIZE)
+    {
+      ctar_walk_publish(walk, entry, CTAR_WALK_TOO_LONG, NULL);
+      continue;
+    }
+    entry->name = entry->path + len + 1;
+
+    // The entry may be reused once listed
+    char child[CTAR_NAME_SIZE];
+    strcpy(child, entry->path);
+    ctar_walk_publish(walk, entry, CTAR_WALK_FILE, handle);
+
+    struct stat st;
+    if (type == DT_DIR || (type == DT_UNKNOWN && ctar_dir_stat(fd, name, &st) == 0 && S_ISDIR(st.st_mode)))
+    {
+      int child_fd = openat(fd, name, O_RDONLY | O_DIRECTORY);
+      if (child_fd == -1)
+      {
+        ctar_walk_error(walk, child, "Unable to open directory", errno);
+        status = -1;
+      }
+      else
+      {
+        status = ctar_walk_directory(walk, child_fd, child);
+      }
+    }
+  }
+
+  if (status == 0 && nread == -1)
+  {
+    ctar_walk_error(walk, path, "Unable to read directory", errno);
+    status = -1;
+  }
+  ctar_dir_close(&dir);
+
+  pthread_mutex_lock(&walk->lock);
+  ctar_walk_release(handle);
+  pthread_mutex_unlock(&walk->lock);
+
+  return status;
+}
+
+static void *ctar_walk_lister(void *arg)
+{
+  ctar_walk *walk = arg;
+
+  char **files = walk->args->files;
+  for (int i = 0; files != NULL && files[i] != NULL; i++)
+  {
+    ctar_walk_entry *entry = ctar_walk_reserve(walk);
+    if (entry == NULL)
+    {
+      return NULL;
+    }
+
+    // Skipped as by ctar_create_at()
+    snprintf(entry->path, sizeof(entry->path), "%s", files[i]);
+    if (strlen(files[i]) >= CTAR_NAME_SIZE)
+    {
+      ctar_walk_publish(walk, entry, CTAR_WALK_TOO_LONG, NULL);
+      continue;
+    }
+    ctar_walk_publish(walk, entry, CTAR_WALK_FILE, NULL);
+
+    struct stat st;
+    if (ctar_dir_stat(AT_FDCWD, files[i], &st) == 0 && S_ISDIR(st.st_mode))
+    {
+      int fd = open(files[i], O_RDONLY | O_DIRECTORY);
+      if (fd == -1)
+      {
+        ctar_walk_error(walk, files[i], "Unable to open directory", errno);
+        return NULL;
+      }
+
+      if (ctar_walk_directory(walk, fd, files[i]) == -1)
+      {
+        return NULL;
+      }
+    }
+  }
+
+  ctar_walk_entry *entry = ctar_walk_reserve(walk);
+  if (entry != NULL)
+  {
+    ctar_walk_publish(walk, entry, CTAR_WALK_END, NULL);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Wait for a listed entry.
+ *
+ * @return ctar_walk_entry* the entry to stat, NULL if the walk is stopping.
+ */
+static ctar_walk_entry *ctar_walk_take(ctar_walk *walk)
+{
+  pthread_mutex_lock(&walk->lock);
+  while (walk->taken == walk->listed && !walk->closing)
+  {
+    pthread_cond_wait(&walk->cond, &walk->lock);
+  }
+
+  ctar_walk_entry *entry = NULL;
+  if (!walk->closing)
+  {
+    entry = &walk->entries[walk->taken % CTAR_WALK_AHEAD];
+    walk->taken++;
+  }
+  pthread_mutex_unlock(&walk->lock);
+
+  return entry;
+}
+
+/**
+ * The beginning of regular files is read ahead with posix_fadvise(), which starts the reads without waiting for them.
+ */
+static void *ctar_walk_worker(void *arg)
+{
+  ctar_walk *walk = arg;
+
+  ctar_walk_entry *entry;
+  while ((entry = ctar_walk_take(walk)) != NULL)
+  {
+    if (entry->kind == CTAR_WALK_FILE)
+    {
+      int dir_fd = entry->dir != NULL ? entry->dir->fd : AT_FDCWD;
+      entry->err = ctar_dir_stat(dir_fd, entry->name, &entry->st) == -1 ? errno : 0;
+      if (entry->err == 0 && S_ISREG(entry->st.st_mode))
+      {
+        entry->fd = openat(dir_fd, entry->name, O_RDONLY);
+        if (entry->fd != -1)
+        {
+          posix_fadvise(entry->fd, 0, CTAR_WALK_READAHEAD, POSIX_FADV_WILLNEED);
+        }
+      }
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    ctar_walk_release(entry->dir);
+    entry->dir = NULL;
+    entry->ready = true;
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+  }
+
+  return NULL;
+}
+
+ctar_walk *ctar_walk_start(ctar_args *args)
+{
+  ctar_walk *walk = calloc(1, sizeof(ctar_walk));
+  pthread_t *threads = calloc(args->jobs, sizeof(pthread_t));
+  if (walk == NULL || threads == NULL)
+  {
+    perror("Unable to allocate walking threads");
+    free(walk);
+    free(threads);
+    return NULL;
+  }
+  walk->threads = threads;
+  walk->args = args;
+  pthread_mutex_init(&walk->lock, NULL);
+  pthread_cond_init(&walk->cond, NULL);
+
+  int err = pthread_create(&walk->lister, NULL, ctar_walk_lister, walk);
+  if (err != 0)
+  {
+    fprintf(stderr, "Unable to start walking thread: %s\n", strerror(err));
+    pthread_cond_destroy(&walk->cond);
+    pthread_mutex_destroy(&walk->lock);
+    free(walk->threads);
+    free(walk);
+    return NULL;
+  }
+
+  for (; walk->nthreads < args->jobs; walk->nthreads++)
+  {
+    err = pthread_create(&walk->threads[walk->nthreads], NULL, ctar_walk_worker, walk);
+    if (err != 0)
+    {
+      fprintf(stderr, "Unable to start walking thread: %s\n", strerror(err));
+      ctar_walk_stop(walk);
+      return NULL;
+    }
+  }
+
+  return walk;
+}
+
+int ctar_walk_next(ctar_walk *walk, ctar_walk_entry **entry)
+{
+  pthread_mutex_lock(&walk->lock);
+  if (walk->held)
+  {
+    walk->emitted++;
+    walk->held = false;
+    pthread_cond_broadcast(&walk->cond);
+  }
+
+  int status = 1;
+  while (status == 1)
+  {
+    ctar_walk_entry *next = &walk->entries[walk->emitted % CTAR_WALK_AHEAD];
+    while (walk->emitted == walk->listed || !next->ready)
+    {
+      pthread_cond_wait(&walk->cond, &walk->lock);
+    }
+
+    walk->held = true;
+    if (next->kind == CTAR_WALK_TOO_LONG)
+    {
+      fprintf(stderr, "Warning: path '%s' is too long, skipping entry\n", next->path);
+      walk->emitted++;
+      walk->held = false;
+      pthread_cond_broadcast(&walk->cond);
+    }
+    else if (next->kind == CTAR_WALK_END)
+    {
+      status = 0;
+    }
+    else if (next->err != 0)
+    {
+      errno = next->err;
+      perror(next->kind == CTAR_WALK_ERROR ? next->message : "Unable to stat file");
+      status = -1;
+    }
+    else
+    {
+      *entry = next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&walk->lock);
+
+  return status;
+}
+
+/**
+ * The files opened ahead of the writer, and not handed to it, are closed.
+ */
+void ctar_walk_stop(ctar_walk *walk)
+{
+  pthread_mutex_lock(&walk->lock);
+  walk->closing = true;
+  pthread_cond_broadcast(&walk->cond);
+  pthread_mutex_unlock(&walk->lock);
+
+  pthread_join(walk->lister, NULL);
+  for (int i = 0; i < walk->nthreads; i++)
+  {
+    pthread_join(walk->threads[i], NULL);
+  }
+
+  // The files not stat'ed still hold their directory
+  for (long i = walk->emitted + walk->held; i < walk->listed; i++)
+  {
+    ctar_walk_entry *entry = &walk->entries[i % CTAR_WALK_AHEAD];
+    if (entry->kind == CTAR_WALK_FILE && entry->fd != -1)
+    {
+      close(entry->fd);
+    }
+    if (entry->kind == CTAR_WALK_FILE)
+    {
+      ctar_walk_release(entry->dir);
+    }
+  }
+
+  free(walk->threads);
+  pthread_cond_destroy(&walk->cond);
+  pthread_mutex_destroy(&walk->lock);
+  free(walk);
+}
@@ -1,40 +1,83 @@
 #include "ctar_zlib.h"
+#include "ctar_pzlib.h"
+#include "ctar_gzindex.h"
+#include "ctar_zran.h"
+#include "ctar_adapt.h"
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 /**
- * @note This function will not close fd_in.
- * @note This function will reset fd_in to the beginning of the file.
+ * @brief Print the last error of a compressed file, from errno for system errors and from zlib otherwise.
  */
-int ctar_compress(char *path, int fd_in)
+static void ctar_gzerror(gzFile file, const char *message)
 {
-  if (lseek(fd_in, 0, SEEK_SET) == -1)
+  int err;
+  const char *msg = gzerror(file, &err);
+  if (err == Z_ERRNO)
   {
-    perror("Unable to seek uncompressed file");
-    return -1;
+    perror(message);
+  }
+  else
+  {
+    // Skip the "<fd:N>: " prefix of files opened with gzdopen()
+    const char *sep = strstr(msg, ": ");
+    fprintf(stderr, "%s: %s\n", message, sep != NULL ? sep + 2 : msg);
   }
+}
 
-  gzFile file_out = gzopen(path, "wb");
+/**
+ * @note This function will close fd_out but not fd_in.
+ * @note fd_in is read from its current offset until end of file, so it may be a pipe.
+ */
+int ctar_compress(int fd_out, int fd_in, int level, ctar_adapt *adapt)
+{
+  char mode[] = "wb ";
+  mode[2] = level == -1 ? '\0' : '0' + level;
+  gzFile file_out = gzdopen(fd_out, mode);
   if (file_out == NULL)
   {
     perror("Unable to open compressed file");
+    close(fd_out);
     return -1;
   }
 
   char buffer[CTAR_ZLIB_CHUNK];
   int nbytes;
+  long offset = 0;
+  int current = level;
 
   while ((nbytes = read(fd_in, buffer, CTAR_ZLIB_CHUNK)) > 0)
   {
-    if (gzwrite(file_out, buffer, nbytes) == 0)
+    size_t len;
+    for (size_t pos = 0; pos < nbytes; pos += len)
     {
-      perror("Unable to write compressed file");  
-      return -1;
+      int segment_level;
+      len = ctar_adapt_segment(adapt, offset + pos, nbytes - pos, level, &segment_level);
+      if (segment_level != current && gzsetparams(file_out, segment_level, Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+        fprintf(stderr, "Unable to change compression level\n");
+        gzclose(file_out);
+        return -1;
+      }
+      current = segment_level;
+
+      if (gzwrite(file_out, buffer + pos, len) == 0)
+      {
+        ctar_gzerror(file_out, "Unable to write compressed file");
+        gzclose(file_out);
+        return -1;
+      }
     }
+    offset += nbytes;
+    ctar_adapt_consume(adapt, offset);
   }
 
   if (nbytes == -1)
   {
     perror("Unable to read uncompressed file");
+    gzclose(file_out);
     return -1;
   }
 
@@ -44,31 +87,21 @@ int ctar_compress(char *path, int fd_in)
     return -1;
   }
 
-  if (lseek(fd_in, 0, SEEK_SET) == -1)
-  {
-    perror("Unable to seek uncompressed file");
-    return -1;
-  }
-
   return 0;
 }
 
 /**
- * @note This function will not close fd_out.
- * @note This function will reset fd_out to the beginning of the file.
+ * @note This function will close fd_in but not fd_out.
+ * @note fd_out is written from its current offset, so it may be a pipe.
+ * If the reader of the pipe goes away (EPIPE), decompression stops successfully.
  */
-int ctar_decompress(char *path, int fd_out)
+int ctar_decompress(int fd_in, int fd_out)
 {
-  if (lseek(fd_out, 0, SEEK_SET) == -1)
-  {
-    perror("Unable to seek decompressed file");
-    return -1;
-  }
-
-  gzFile file_in = gzopen(path, "rb");
+  gzFile file_in = gzdopen(fd_in, "rb");
   if (file_in == NULL)
   {
     perror("Unable to open compressed file");
+    close(fd_in);
     return -1;
   }
 
@@ -79,14 +112,25 @@ int ctar_decompress(char *path, int fd_out)
   {
     if (write(fd_out, buffer, nbytes) == -1)
     {
+      if (errno == EPIPE)
+      {
+        // The reader does not need the rest of the archive
+        break;
+      }
+
       perror("Unable to write decompressed file");
+      gzclose(file_in);
       return -1;
     }
   }
 
-  if (nbytes == -1)
+  // A truncated file ends the reading without error, and is only reported by gzerror()
+  int err;
+  gzerror(file_in, &err);
+  if (nbytes == -1 || err != Z_OK)
   {
-    perror("Unable to read compressed file");
+    ctar_gzerror(file_in, "Unable to read compressed file");
+    gzclose(file_in);
     return -1;
   }
 
@@ -96,11 +140,66 @@ int ctar_decompress(char *path, int fd_out)
     return -1;
   }
 
-  if (lseek(fd_out, 0, SEEK_SET) == -1)
+  return 0;
+}
+
+/**
+ * The archive is compressed in independent gzip members if args->member_size is set,
+ * in parallel if args->threads is greater than 1, and with gzwrite() otherwise.
+ * In all cases, the levels chosen per entry in args->adapt are followed.
+ */
+int ctar_gzip_compress(int fd_out, int fd_in, ctar_args *args)
+{
+  if (args->member_size > 0)
   {
-    perror("Unable to seek decompressed file");
-    return -1;
+    return ctar_compress_seekable(fd_out, fd_in, args->member_size, args->level, args->adapt);
   }
 
-  return 0;
-}
\ No newline at end of file
+  if (args->threads > 1)
+  {
+    return ctar_compress_parallel(fd_out, fd_in, args->threads, args->level, args->adapt);
+  }
+
+  return ctar_compress(fd_out, fd_in, args->level, args->adapt);
+}
+
+/**
+ * If args->index_span is set, a checkpoint index is written next to the archive.
+ * Otherwise, if files are selected, the embedded index of the archive or its checkpoint index
+ * is used to jump straight to them, and if args->threads is greater than 1, the members
+ * of the archive are inflated in parallel.
+ *
+ * The checkpoint index is args->index_fd, opened by ctar_open() and closed here.
+ */
+int ctar_gzip_decompress(int fd_in, int fd_out, ctar_args *args)
+{
+  int fd_idx = args->index_fd;
+  args->index_fd = -1;
+
+  if (args->index_span > 0)
+  {
+    return ctar_zran_build(fd_in, fd_out, args->index_span, fd_idx);
+  }
+
+  int status = 1;
+  if (args->files != NULL)
+  {
+    status = ctar_decompress_indexed(fd_in, fd_out, args->files);
+  }
+
+  if (status == 1)
+  {
+    status = ctar_zran_decompress(fd_in, fd_out, args->files, fd_idx);
+  }
+  else if (fd_idx != -1)
+  {
+    close(fd_idx);
+  }
+
+  if (status == 1 && args->threads > 1)
+  {
+    status = ctar_decompress_parallel(fd_in, fd_out, args->threads);
+  }
+
+  return status == 1 ? ctar_decompress(fd_in, fd_out) : status;
+}
@@ -0,0 +1,737 @@
+#include "ctar_zran.h"
+#include "ctar_zlib.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/** @brief Follows the headers of the uncompressed archive while it is inflated */
+typedef struct ctar_zran_tracker
+{
+  uint64_t offset; // Offset of the next byte in the uncompressed archive
+  uint64_t skip;   // Number of data bytes before the next header
+  ctar_header header;
+  size_t fill;     // Number of bytes of header already received
+  int blank_count; // Number of blank headers found, the archive ends after two of them
+} ctar_zran_tracker;
+
+/** @brief Inflates a gzip stream from a checkpoint */
+typedef struct ctar_zran_reader
+{
+  int fd;
+  z_stream strm;
+  off_t in_offset; // Offset of the next byte to read in the archive
+  bool raw;        // Whether the current member is inflated without its gzip wrapper
+  int trailer;     // Number of bytes of gzip trailer to skip before the next member
+  unsigned char in[CTAR_ZLIB_CHUNK];
+} ctar_zran_reader;
+
+static int ctar_zran_add_checkpoint(ctar_zran_index *index, uint64_t in, int bits, uint64_t out)
+{
+  if (index->ncheckpoints == index->checkpoints_capacity)
+  {
+    size_t capacity = index->checkpoints_capacity ? 2 * index->checkpoints_capacity : 64;
+    ctar_zran_checkpoint *checkpoints = realloc(index->checkpoints, capacity * sizeof(ctar_zran_checkpoint));
+    if (checkpoints == NULL)
+    {
+      perror("Unable to allocate checkpoint index");
+      return -1;
+    }
+    index->checkpoints = checkpoints;
+    index->checkpoints_capacity = capacity;
+  }
+
+  ctar_zran_checkpoint *checkpoint = &index->checkpoints[index->ncheckpoints++];
+  checkpoint->in = in;
+  checkpoint->bits = bits;
+  checkpoint->out = out;
+  return 0;
+}
+
+static int ctar_zran_add_entry(ctar_zran_index *index, uint64_t offset, char *name)
+{
+  if (index->nentries == index->entries_capacity)
+  {
+    size_t capacity = index->entries_capacity ? 2 * index->entries_capacity : 64;
+    ctar_zran_entry *entries = realloc(index->entries, capacity * sizeof(ctar_zran_entry));
+    if (entries == NULL)
+    {
+      perror("Unable to allocate checkpoint index");
+      return -1;
+    }
+    index->entries = entries;
+    index->entries_capacity = capacity;
+  }
+
+  ctar_zran_entry *entry = &index->entries[index->nentries++];
+  entry->offset = offset;
+  snprintf(entry->name, sizeof(entry->name), "%.*s", CTAR_NAME_SIZE, name);
+  return 0;
+}
+
+static void ctar_zran_free(ctar_zran_index *index)
+{
+  free(index->checkpoints);
+  free(index->entries);
+}
+
+/**
+ * @brief Get the size, modification time and gzip trailer of an archive, which tie an index to it.
+ *
+ * @return int 0 if successful, -1 if fd is not a regular file or cannot be read.
+ */
+static int ctar_zran_identify(int fd, ctar_zran_index *index)
+{
+  struct stat st;
+  unsigned char trailer[8];
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(trailer) ||
+      pread(fd, trailer, sizeof(trailer), st.st_size - sizeof(trailer)) != sizeof(trailer))
+  {
+    return -1;
+  }
+
+  index->size = st.st_size;
+  index->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  index->trailer = get_le64(trailer);
+  return 0;
+}
+
+/**
+ * @brief Record the headers found in the next len bytes of the uncompressed archive.
+ */
+static int ctar_zran_track(ctar_zran_tracker *tracker, ctar_zran_index *index, unsigned char *buf, size_t len)
+{
+  while (len > 0 && tracker->blank_count < 2)
+  {
+    size_t n;
+    if (tracker->skip > 0)
+    {
+      n = tracker->skip < len ? tracker->skip : len;
+      tracker->skip -= n;
+    }
+    else
+    {
+      n = sizeof(ctar_header) - tracker->fill < len ? sizeof(ctar_header) - tracker->fill : len;
+      memcpy((char *)&tracker->header + tracker->fill, buf, n);
+      tracker->fill += n;
+    }
+    buf += n;
+    len -= n;
+    tracker->offset += n;
+
+    if (tracker->fill == sizeof(ctar_header))
+    {
+      tracker->fill = 0;
+      if (is_header_blank(&tracker->header))
+      {
+        tracker->blank_count++;
+        continue;
+      }
+
+      tracker->skip = (uint64_t)get_nblocks(&tracker->header) * CTAR_BLOCK_SIZE;
+      if (ctar_zran_add_entry(index, tracker->offset - sizeof(ctar_header), tracker->header.name) == -1)
+      {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * The index file is made of (little endian integers):
+ * - CTAR_ZRAN_MAGIC, the number of checkpoints and the number of entries (64 bits),
+ *   the size, modification time and last 8 bytes of the archive (64 bits, see ctar_zran_identify())
+ * - for each checkpoint: in (64 bits), bits (8 bits), out (64 bits),
+ *   then the last CTAR_ZRAN_WINSIZE uncompressed bytes before out
+ * - for each entry: offset (64 bits), length of the name (8 bits), name
+ *
+ * The windows are written as soon as the checkpoints are found, so only the rest of the index is kept in memory.
+ */
+static int ctar_zran_write(int fd_idx, ctar_zran_index *index)
+{
+  unsigned char buf[CTAR_ZRAN_HEADER_SIZE];
+  memcpy(buf, CTAR_ZRAN_MAGIC, 8);
+  put_le64(buf + 8, index->ncheckpoints);
+  put_le64(buf + 16, index->nentries);
+  put_le64(buf + 24, index->size);
+  put_le64(buf + 32, index->mtime);
+  put_le64(buf + 40, index->trailer);
+  if (pwrite(fd_idx, buf, sizeof(buf), 0) != sizeof(buf))
+  {
+    perror("Unable to write checkpoint index");
+    return -1;
+  }
+
+  off_t offset = sizeof(buf);
+  for (size_t i = 0; i < index->ncheckpoints; i++)
+  {
+    unsigned char meta[CTAR_ZRAN_META_SIZE];
+    put_le64(meta, index->checkpoints[i].in);
+    meta[8] = index->checkpoints[i].bits;
+    put_le64(meta + 9, index->checkpoints[i].out);
+    if (pwrite(fd_idx, meta, sizeof(meta), offset) != sizeof(meta))
+    {
+      perror("Unable to write checkpoint index");
+      return -1;
+    }
+    offset += CTAR_ZRAN_META_SIZE + CTAR_ZRAN_WINSIZE;
+  }
+
+  for (size_t i = 0; i < index->nentries; i++)
+  {
+    unsigned char entry[8 + 1 + CTAR_NAME_SIZE];
+    size_t name_len = strlen(index->entries[i].name);
+    put_le64(entry, index->entries[i].offset);
+    entry[8] = name_len;
+    memcpy(entry + 9, index->entries[i].name, name_len);
+    if (pwrite(fd_idx, entry, 9 + name_len, offset) != 9 + name_len)
+    {
+      perror("Unable to write checkpoint index");
+      return -1;
+    }
+    offset += 9 + name_len;
+  }
+
+  return 0;
+}
+
+int ctar_zran_open(ctar_args *args)
+{
+  args->index_fd = -1;
+  if (strcmp(args->archive, CTAR_ARGS_STDIO) == 0 || (args->index_span == 0 && args->files == NULL))
+  {
+    return 0;
+  }
+
+  char index_path[CTAR_ARGS_ARCHIVE_SIZE + sizeof(CTAR_ZRAN_SUFFIX)];
+  snprintf(index_path, sizeof(index_path), "%s%s", args->archive, CTAR_ZRAN_SUFFIX);
+  if (args->index_span == 0)
+  {
+    // Without an index, the archive is inflated from the start
+    args->index_fd = open(index_path, O_RDONLY);
+    return 0;
+  }
+
+  args->index_fd = open(index_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (args->index_fd == -1)
+  {
+    perror("Unable to open checkpoint index");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Like zlib's zran example, the archive is inflated block by block (Z_BLOCK),
+ * and a checkpoint is recorded at the first block boundary after every span bytes.
+ * Concatenated gzip members are supported, trailing garbage is ignored like gzread() does.
+ * The archive is identified before being read, an index built from a pipe is never used.
+ *
+ * @note This function will close fd_in and fd_idx but not fd_out.
+ * @note If the reader of fd_out goes away, the index is still built for the whole archive.
+ */
+int ctar_zran_build(int fd_in, int fd_out, long span, int fd_idx)
+{
+  ctar_zran_index index;
+  memset(&index, 0, sizeof(index));
+  if (ctar_zran_identify(fd_in, &index) == -1)
+  {
+    index.size = CTAR_ZRAN_UNKNOWN;
+  }
+  ctar_zran_tracker tracker;
+  memset(&tracker, 0, sizeof(tracker));
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  unsigned char in[CTAR_ZLIB_CHUNK];
+  unsigned char *window = calloc(CTAR_ZRAN_WINSIZE, 1);
+  if (window == NULL || inflateInit2(&strm, MAX_WBITS + 16) != Z_OK)
+  {
+    fprintf(stderr, "Unable to initialize decompression\n");
+    free(window);
+    close(fd_idx);
+    close(fd_in);
+    return -1;
+  }
+
+  uint64_t totin = 0;
+  uint64_t totout = 0;
+  uint64_t last = 0;
+  bool reader_gone = false;
+  int members = 0;          // Number of members inflated
+  bool member_start = true; // Whether nothing was inflated from the current member yet
+  bool garbage = false;     // Whether trailing garbage was found after the last member
+  int ret = Z_OK;
+  int status = 0;
+  off_t idx_offset = CTAR_ZRAN_HEADER_SIZE;
+
+  while (status == 0 && !garbage)
+  {
+    ssize_t nbytes = read(fd_in, in, CTAR_ZLIB_CHUNK);
+    if (nbytes == -1)
+    {
+      perror("Unable to read compressed file");
+      status = -1;
+      break;
+    }
+
+    if (nbytes == 0)
+    {
+      if (ret != Z_STREAM_END)
+      {
+        fprintf(stderr, "Unexpected end of compressed file\n");
+        status = -1;
+      }
+      break;
+    }
+
+    strm.next_in = in;
+    strm.avail_in = nbytes;
+    while (status == 0 && strm.avail_in != 0)
+    {
+      if (strm.avail_out == 0)
+      {
+        strm.next_out = window;
+        strm.avail_out = CTAR_ZRAN_WINSIZE;
+      }
+
+      if (ret == Z_STREAM_END)
+      {
+        inflateReset(&strm);
+        member_start = true;
+      }
+
+      unsigned char *out = strm.next_out;
+      totin += strm.avail_in;
+      totout += strm.avail_out;
+      ret = inflate(&strm, Z_BLOCK);
+      totin -= strm.avail_in;
+      totout -= strm.avail_out;
+
+      if (ret == Z_DATA_ERROR && member_start && members > 0)
+      {
+        ret = Z_STREAM_END;
+        garbage = true;
+        break;
+      }
+
+      if (ret == Z_STREAM_END)
+      {
+        members++;
+      }
+
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      {
+        fprintf(stderr, "Unable to decompress archive\n");
+        status = -1;
+        break;
+      }
+
+      size_t have = strm.next_out - out;
+      member_start = member_start && have == 0;
+      if (!reader_gone && have > 0 && write_full(fd_out, out, have) == -1)
+      {
+        if (errno != EPIPE)
+        {
+          perror("Unable to write decompressed file");
+          status = -1;
+          break;
+        }
+        reader_gone = true;
+      }
+
+      if (ctar_zran_track(&tracker, &index, out, have) == -1)
+      {
+        status = -1;
+        break;
+      }
+
+      // Record a checkpoint at the end of a block, unless it is the last one of the member
+      if ((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > span))
+      {
+        unsigned char checkpoint[CTAR_ZRAN_META_SIZE + CTAR_ZRAN_WINSIZE];
+        size_t left = strm.avail_out;
+        memcpy(checkpoint + CTAR_ZRAN_META_SIZE, window + CTAR_ZRAN_WINSIZE - left, left);
+        memcpy(checkpoint + CTAR_ZRAN_META_SIZE + left, window, CTAR_ZRAN_WINSIZE - left);
+        if (pwrite(fd_idx, checkpoint, sizeof(checkpoint), idx_offset) != sizeof(checkpoint))
+        {
+          perror("Unable to write checkpoint index");
+          status = -1;
+          break;
+        }
+        idx_offset += sizeof(checkpoint);
+
+        status = ctar_zran_add_checkpoint(&index, totin, strm.data_type & 7, totout);
+        last = totout;
+      }
+    }
+  }
+
+  if (status == 0)
+  {
+    status = ctar_zran_write(fd_idx, &index);
+  }
+
+  inflateEnd(&strm);
+  ctar_zran_free(&index);
+  free(window);
+  close(fd_in);
+
+  if (close(fd_idx) == -1)
+  {
+    perror("Unable to close checkpoint index");
+    return -1;
+  }
+
+  return status;
+}
+
+/**
+ * @return int 0 if successful, 1 if fd_idx is not a checkpoint index, -1 otherwise.
+ */
+static int ctar_zran_load(int fd_idx, ctar_zran_index *index)
+{
+  unsigned char buf[CTAR_ZRAN_HEADER_SIZE];
+  if (pread(fd_idx, buf, sizeof(buf), 0) != sizeof(buf) || memcmp(buf, CTAR_ZRAN_MAGIC, 8) != 0)
+  {
+    return 1;
+  }
+  index->size = get_le64(buf + 24);
+  index->mtime = get_le64(buf + 32);
+  index->trailer = get_le64(buf + 40);
+
+  size_t ncheckpoints = get_le64(buf + 8);
+  size_t nentries = get_le64(buf + 16);
+  off_t offset = sizeof(buf);
+  for (size_t i = 0; i < ncheckpoints; i++)
+  {
+    unsigned char meta[CTAR_ZRAN_META_SIZE];
+    if (pread(fd_idx, meta, sizeof(meta), offset) != sizeof(meta) ||
+        ctar_zran_add_checkpoint(index, get_le64(meta), meta[8], get_le64(meta + 9)) == -1)
+    {
+      fprintf(stderr, "Invalid checkpoint index\n");
+      return -1;
+    }
+    offset += CTAR_ZRAN_META_SIZE + CTAR_ZRAN_WINSIZE;
+  }
+
+  for (size_t i = 0; i < nentries; i++)
+  {
+    unsigned char entry[8 + 1 + CTAR_NAME_SIZE];
+    if (pread(fd_idx, entry, 9, offset) != 9 || entry[8] > CTAR_NAME_SIZE ||
+        pread(fd_idx, entry + 9, entry[8], offset + 9) != entry[8])
+    {
+      fprintf(stderr, "Invalid checkpoint index\n");
+      return -1;
+    }
+    entry[9 + entry[8]] = '\0';
+
+    if (ctar_zran_add_entry(index, get_le64(entry), (char *)entry + 9) == -1)
+    {
+      return -1;
+    }
+    offset += 9 + entry[8];
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Start inflating fd at a checkpoint, or at the beginning of fd if checkpoint is -1.
+ */
+static int ctar_zran_reader_open(ctar_zran_reader *reader, int fd, int fd_idx, ctar_zran_index *index, ssize_t checkpoint)
+{
+  memset(&reader->strm, 0, sizeof(reader->strm));
+  reader->fd = fd;
+  reader->trailer = 0;
+
+  if (checkpoint == -1)
+  {
+    reader->raw = false;
+    reader->in_offset = 0;
+    return inflateInit2(&reader->strm, MAX_WBITS + 16) == Z_OK ? 0 : -1;
+  }
+
+  ctar_zran_checkpoint *cp = &index->checkpoints[checkpoint];
+  reader->raw = true;
+  reader->in_offset = cp->in - (cp->bits ? 1 : 0);
+  if (inflateInit2(&reader->strm, -MAX_WBITS) != Z_OK)
+  {
+    return -1;
+  }
+
+  // Feed the bits of the previous byte belonging to the next block
+  if (cp->bits)
+  {
+    unsigned char byte;
+    if (pread(fd, &byte, 1, reader->in_offset) != 1)
+    {
+      inflateEnd(&reader->strm);
+      return -1;
+    }
+    reader->in_offset++;
+    inflatePrime(&reader->strm, cp->bits, byte >> (8 - cp->bits));
+  }
+
+  unsigned char window[CTAR_ZRAN_WINSIZE];
+  off_t window_offset = CTAR_ZRAN_HEADER_SIZE + checkpoint * (CTAR_ZRAN_META_SIZE + CTAR_ZRAN_WINSIZE) + CTAR_ZRAN_META_SIZE;
+  size_t window_len = cp->out < CTAR_ZRAN_WINSIZE ? cp->out : CTAR_ZRAN_WINSIZE;
+  if (pread(fd_idx, window, sizeof(window), window_offset) != sizeof(window) ||
+      inflateSetDictionary(&reader->strm, window + CTAR_ZRAN_WINSIZE - window_len, window_len) != Z_OK)
+  {
+    inflateEnd(&reader->strm);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @return ssize_t The number of bytes read (less than len only at the end of the archive), -1 on failure.
+ */
+static ssize_t ctar_zran_reader_read(ctar_zran_reader *reader, void *buf, size_t len)
+{
+  z_stream *strm = &reader->strm;
+  strm->next_out = buf;
+  strm->avail_out = len;
+
+  while (strm->avail_out > 0)
+  {
+    if (strm->avail_in == 0)
+    {
+      ssize_t nbytes = pread(reader->fd, reader->in, CTAR_ZLIB_CHUNK, reader->in_offset);
+      if (nbytes == -1)
+      {
+        return -1;
+      }
+
+      if (nbytes == 0)
+      {
+        break;
+      }
+
+      reader->in_offset += nbytes;
+      strm->next_in = reader->in;
+      strm->avail_in = nbytes;
+    }
+
+    if (reader->trailer > 0)
+    {
+      size_t n = reader->trailer < strm->avail_in ? reader->trailer : strm->avail_in;
+      strm->next_in += n;
+      strm->avail_in -= n;
+      reader->trailer -= n;
+      if (reader->trailer == 0 && inflateReset2(strm, MAX_WBITS + 16) != Z_OK)
+      {
+        return -1;
+      }
+      continue;
+    }
+
+    int ret = inflate(strm, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END)
+    {
+      // The next member starts after the trailer of a raw member, and right away otherwise
+      if (reader->raw)
+      {
+        reader->raw = false;
+        reader->trailer = 8;
+      }
+      else if (inflateReset(strm) != Z_OK)
+      {
+        return -1;
+      }
+      continue;
+    }
+
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+      return -1;
+    }
+  }
+
+  return len - strm->avail_out;
+}
+
+/**
+ * @brief Copy the next len bytes of the uncompressed archive into fd_out, or discard them if fd_out is -1.
+ *
+ * @return int 0 if successful, 1 if the reader of fd_out went away, -1 otherwise.
+ */
+static int ctar_zran_reader_copy(ctar_zran_reader *reader, int fd_out, uint64_t len)
+{
+  char buf[CTAR_ZLIB_CHUNK];
+  while (len > 0)
+  {
+    size_t n = len < CTAR_ZLIB_CHUNK ? len : CTAR_ZLIB_CHUNK;
+    if (ctar_zran_reader_read(reader, buf, n) != n)
+    {
+      fprintf(stderr, "Unable to read compressed file\n");
+      return -1;
+    }
+
+    if (fd_out != -1 && write_full(fd_out, buf, n) == -1)
+    {
+      if (errno == EPIPE)
+      {
+        return 1;
+      }
+
+      perror("Unable to write decompressed file");
+      return -1;
+    }
+    len -= n;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Find the last checkpoint before offset.
+ *
+ * @return ssize_t the index of the checkpoint, -1 if offset is before the first checkpoint.
+ */
+static ssize_t ctar_zran_find(ctar_zran_index *index, uint64_t offset)
+{
+  ssize_t low = 0;
+  ssize_t high = index->ncheckpoints - 1;
+  ssize_t found = -1;
+  while (low <= high)
+  {
+    ssize_t mid = (low + high) / 2;
+    if (index->checkpoints[mid].out <= offset)
+    {
+      found = mid;
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid - 1;
+    }
+  }
+  return found;
+}
+
+/**
+ * The output is a tar stream made of the selected entries only, followed by the end of archive.
+ * Consecutive entries are inflated in a single pass, otherwise inflate is resumed at the
+ * last checkpoint before the entry.
+ * An index whose archive was modified since it was built is ignored.
+ *
+ * @note This function will close fd_idx, and fd_in unless it returns 1, in which case fd_in is left untouched.
+ */
+int ctar_zran_decompress(int fd_in, int fd_out, char **files, int fd_idx)
+{
+  if (fd_idx == -1)
+  {
+    return 1;
+  }
+
+  ctar_zran_index index;
+  memset(&index, 0, sizeof(index));
+  int status = ctar_zran_load(fd_idx, &index);
+
+  ctar_zran_index archive;
+  if (status == 0 && (ctar_zran_identify(fd_in, &archive) == -1 || archive.size != index.size ||
+                      archive.mtime != index.mtime || archive.trailer != index.trailer))
+  {
+    fprintf(stderr, "Warning: the checkpoint index was not built from this archive, ignoring it\n");
+    status = 1;
+  }
+
+  if (status != 0)
+  {
+    ctar_zran_free(&index);
+    close(fd_idx);
+    if (status == -1)
+    {
+      close(fd_in);
+    }
+    return status;
+  }
+
+  ctar_zran_reader *reader = malloc(sizeof(ctar_zran_reader));
+  bool reader_open = false;
+  size_t next = index.nentries; // Entry at the current position of reader
+  status = reader == NULL ? -1 : 0;
+
+  for (size_t i = 0; status == 0 && i < index.nentries; i++)
+  {
+    if (!is_name_selected(index.entries[i].name, files))
+    {
+      continue;
+    }
+
+    if (!reader_open || next != i)
+    {
+      if (reader_open)
+      {
+        inflateEnd(&reader->strm);
+      }
+
+      ssize_t checkpoint = ctar_zran_find(&index, index.entries[i].offset);
+      uint64_t out = checkpoint == -1 ? 0 : index.checkpoints[checkpoint].out;
+      reader_open = ctar_zran_reader_open(reader, fd_in, fd_idx, &index, checkpoint) == 0;
+      if (!reader_open)
+      {
+        fprintf(stderr, "Unable to resume decompression\n");
+        status = -1;
+        break;
+      }
+
+      status = ctar_zran_reader_copy(reader, -1, index.entries[i].offset - out);
+      if (status != 0)
+      {
+        break;
+      }
+    }
+
+    ctar_header header;
+    if (ctar_zran_reader_read(reader, &header, sizeof(header)) != sizeof(header))
+    {
+      fprintf(stderr, "Unable to read compressed file\n");
+      status = -1;
+      break;
+    }
+
+    if (write_full(fd_out, &header, sizeof(header)) == -1)
+    {
+      status = errno == EPIPE ? 1 : -1;
+      if (status == -1)
+      {
+        perror("Unable to write decompressed file");
+      }
+      break;
+    }
+
+    status = ctar_zran_reader_copy(reader, fd_out, (uint64_t)get_nblocks(&header) * CTAR_BLOCK_SIZE);
+    next = i + 1;
+  }
+
+  if (reader_open)
+  {
+    inflateEnd(&reader->strm);
+  }
+  free(reader);
+  ctar_zran_free(&index);
+  close(fd_idx);
+  close(fd_in);
+
+  if (status == 0)
+  {
+    char end_of_archive[2 * CTAR_BLOCK_SIZE];
+    memset(end_of_archive, 0, sizeof(end_of_archive));
+    if (write_full(fd_out, end_of_archive, sizeof(end_of_archive)) == -1 && errno != EPIPE)
+    {
+      perror("Unable to write decompressed file");
+      status = -1;
+    }
+  }
+
+  // Status 1 means the reader does not need the rest of the archive
+  return status == -1 ? -1 : 0;
+}
@@ -0,0 +1,176 @@
+#include "ctar_zstd.h"
+
+#ifdef CTAR_ZSTD
+
+#include "utils.h"
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zstd.h>
+
+/**
+ * The archive is compressed with the streaming API of zstd.
+ * If args->threads is greater than 1, zstd compresses in parallel with its own worker threads.
+ *
+ * @note This function will close fd_out but not fd_in.
+ */
+int ctar_zstd_compress(int fd_out, int fd_in, ctar_args *args)
+{
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  size_t in_size = ZSTD_CStreamInSize();
+  size_t out_size = ZSTD_CStreamOutSize();
+  char *buf_in = malloc(in_size);
+  char *buf_out = malloc(out_size);
+  if (cctx == NULL || buf_in == NULL || buf_out == NULL)
+  {
+    fprintf(stderr, "Unable to initialize compression\n");
+    ZSTD_freeCCtx(cctx);
+    free(buf_in);
+    free(buf_out);
+    close(fd_out);
+    return -1;
+  }
+
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, args->level == -1 ? ZSTD_CLEVEL_DEFAULT : args->level);
+  ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+  if (args->threads > 1 && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, args->threads)))
+  {
+    fprintf(stderr, "Warning: zstd was built without multithreading, compressing with a single thread\n");
+  }
+
+  int status = 0;
+  bool last = false;
+  while (status == 0 && !last)
+  {
+    ssize_t nbytes = read_full(fd_in, buf_in, in_size);
+    if (nbytes == -1)
+    {
+      perror("Unable to read uncompressed file");
+      status = -1;
+      break;
+    }
+
+    last = nbytes < in_size;
+    ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+    ZSTD_inBuffer input = {buf_in, nbytes, 0};
+    bool finished = false;
+    while (!finished)
+    {
+      ZSTD_outBuffer output = {buf_out, out_size, 0};
+      size_t remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+      if (ZSTD_isError(remaining))
+      {
+        fprintf(stderr, "Unable to compress archive: %s\n", ZSTD_getErrorName(remaining));
+        status = -1;
+        break;
+      }
+
+      if (write_full(fd_out, buf_out, output.pos) == -1)
+      {
+        perror("Unable to write compressed file");
+        status = -1;
+        break;
+      }
+
+      // The last chunk is done once the frame is flushed, the others once they are consumed
+      finished = last ? remaining == 0 : input.pos == input.size;
+    }
+  }
+
+  ZSTD_freeCCtx(cctx);
+  free(buf_in);
+  free(buf_out);
+
+  if (close(fd_out) == -1)
+  {
+    perror("Unable to close compressed file");
+    return -1;
+  }
+
+  return status;
+}
+
+/**
+ * Concatenated zstd frames are decompressed one after the other.
+ * Checkpoint indexes are specific to gzip, so args->index_span is ignored.
+ *
+ * @note This function will close fd_in but not fd_out.
+ * @note If the reader of fd_out goes away (EPIPE), decompression stops successfully.
+ */
+int ctar_zstd_decompress(int fd_in, int fd_out, ctar_args *args)
+{
+  if (args->index_span > 0)
+  {
+    fprintf(stderr, "Warning: checkpoint indexes are only supported with gzip, not building one\n");
+  }
+
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  size_t in_size = ZSTD_DStreamInSize();
+  size_t out_size = ZSTD_DStreamOutSize();
+  char *buf_in = malloc(in_size);
+  char *buf_out = malloc(out_size);
+  if (dctx == NULL || buf_in == NULL || buf_out == NULL)
+  {
+    fprintf(stderr, "Unable to initialize decompression\n");
+    ZSTD_freeDCtx(dctx);
+    free(buf_in);
+    free(buf_out);
+    close(fd_in);
+    return -1;
+  }
+
+  int status = 0;
+  size_t remaining = 0; // Non zero while a frame is incomplete
+  bool reader_gone = false;
+  ssize_t nbytes;
+  while (status == 0 && !reader_gone && (nbytes = read(fd_in, buf_in, in_size)) > 0)
+  {
+    ZSTD_inBuffer input = {buf_in, nbytes, 0};
+    while (input.pos < input.size)
+    {
+      ZSTD_outBuffer output = {buf_out, out_size, 0};
+      remaining = ZSTD_decompressStream(dctx, &output, &input);
+      if (ZSTD_isError(remaining))
+      {
+        fprintf(stderr, "Unable to decompress archive: %s\n", ZSTD_getErrorName(remaining));
+        status = -1;
+        break;
+      }
+
+      if (write_full(fd_out, buf_out, output.pos) == -1)
+      {
+        if (errno == EPIPE)
+        {
+          // The reader does not need the rest of the archive
+          reader_gone = true;
+          break;
+        }
+
+        perror("Unable to write decompressed file");
+        status = -1;
+        break;
+      }
+    }
+  }
+
+  if (status == 0 && !reader_gone && nbytes == -1)
+  {
+    perror("Unable to read compressed file");
+    status = -1;
+  }
+
+  if (status == 0 && !reader_gone && remaining != 0)
+  {
+    fprintf(stderr, "Unexpected end of compressed file\n");
+    status = -1;
+  }
+
+  ZSTD_freeDCtx(dctx);
+  free(buf_in);
+  free(buf_out);
+  close(fd_in);
+
+  return status;
+}
+
+#endif // CTAR_ZSTD
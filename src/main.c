@@ -1,5 +1,6 @@
 #include "argparse.h"
 #include "ctar.h"
+#include "ctar_shard.h"
 #include <stdio.h>
 
 int main(int argc, char **argv)
@@ -11,6 +12,13 @@ int main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
+  // A set of shards is opened, processed and closed by its own threads
+  int shards = args.create ? (args.shards > 1 ? args.shards : 0) : ctar_shard_count(&args);
+  if (shards != 0)
+  {
+    return shards == -1 || ctar_shard_run(&args, shards) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
   int fd = ctar_open(&args);
   if (fd == -1)
   {
@@ -1,14 +1,33 @@
+#define _GNU_SOURCE // copy_file_range(), splice()
 #include "utils.h"
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
 
-int oct2dec(char *oct, int size)
+/**
+ * Fields too large for octal digits (sizes of 8 GiB or more) are stored in base-256, like GNU tar does:
+ * the high bit of the first byte is set, and the other bytes are the value in big-endian order.
+ */
+long long oct2dec(char *oct, int size)
 {
-  int dec = 0;
+  unsigned char *bytes = (unsigned char *)oct;
+  if (bytes[0] & 0x80)
+  {
+    long long value = bytes[0] & 0x3f;
+    for (int i = 1; i < size; i++)
+    {
+      value = (value << 8) | bytes[i];
+    }
+    return value;
+  }
+
+  long long dec = 0;
   for (int i = 0; i < size; i++)
   {
     if (oct[i] == '\0')
@@ -20,8 +39,34 @@ int oct2dec(char *oct, int size)
   return dec;
 }
 
-void dec2oct(int dec, char *oct, int size)
+long parse_positive(char *str)
+{
+  char *end;
+  errno = 0;
+  long value = strtol(str, &end, 10);
+  if (errno != 0 || end == str || *end != '\0' || value <= 0)
+  {
+    return -1;
+  }
+  return value;
+}
+
+/**
+ * Values that do not fit in size - 1 octal digits are stored in base-256 (see oct2dec()).
+ */
+void dec2oct(long long dec, char *oct, int size)
 {
+  if (dec >= 1LL << (3 * (size - 1)))
+  {
+    for (int i = size - 1; i > 0; i--)
+    {
+      oct[i] = dec & 0xff;
+      dec >>= 8;
+    }
+    oct[0] = (char)0x80;
+    return;
+  }
+
   int i = size - 1;
   oct[i--] = '\0';
   while (dec > 0 && i >= 0)
@@ -49,6 +94,81 @@ bool is_header_blank(ctar_header *header)
   return true;
 }
 
+bool is_selected(char *name, char **files)
+{
+  if (files == NULL)
+  {
+    return true;
+  }
+
+  for (int i = 0; files[i] != NULL; i++)
+  {
+    // Ignore trailing slashes of directories
+    size_t len = strlen(files[i]);
+    while (len > 1 && files[i][len - 1] == '/')
+    {
+      len--;
+    }
+
+    if (strncmp(name, files[i], len) == 0 && (name[len] == '\0' || name[len] == '/'))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool is_header_selected(ctar_header *header, char **files)
+{
+  char name[CTAR_NAME_SIZE + 1];
+  snprintf(name, sizeof(name), "%.*s", CTAR_NAME_SIZE, header->name);
+  return is_selected(name, files);
+}
+
+/**
+ * The real name is only guessed from the name of the entry, the index does not hold the extended headers.
+ */
+bool is_name_selected(char *name, char **files)
+{
+  if (is_selected(name, files))
+  {
+    return true;
+  }
+
+  char *base = strrchr(name, '/');
+  if (base == NULL)
+  {
+    return false;
+  }
+
+  // Directory holding the entry, after the real directory of the file
+  char *parent = base;
+  while (parent > name && parent[-1] != '/')
+  {
+    parent--;
+  }
+
+  size_t len = base - parent;
+  bool sparse = (len == 10 && strncmp(parent, "PaxHeaders", len) == 0) || strncmp(parent, "PaxHeaders.", 11) == 0 ||
+                strncmp(parent, "GNUSparseFile.", 14) == 0;
+  if (!sparse)
+  {
+    return false;
+  }
+
+  char real[CTAR_NAME_SIZE + 1];
+  if (parent == name || (parent - name == 2 && name[0] == '.'))
+  {
+    snprintf(real, sizeof(real), "%s", base + 1);
+  }
+  else
+  {
+    snprintf(real, sizeof(real), "%.*s%s", (int)(parent - name), name, base + 1);
+  }
+  return is_selected(real, files);
+}
+
 int mkdir_recursive(char *path, mode_t mode)
 {
   char *sep = strrchr(path, '/');
@@ -70,18 +190,207 @@ int mkdir_recursive(char *path, mode_t mode)
   return 0;
 }
 
+/**
+ * @note If fd is not seekable (e.g. a pipe), the data blocks are read and discarded.
+ */
 int skip_data_blocks(int fd, ctar_header *header)
 {
-  return lseek(fd, get_nblocks(header) * CTAR_BLOCK_SIZE, SEEK_CUR);
+  off_t nbytes = (off_t)get_nblocks(header) * CTAR_BLOCK_SIZE;
+  off_t offset = lseek(fd, nbytes, SEEK_CUR);
+  if (offset != -1 || errno != ESPIPE)
+  {
+    return offset == -1 ? -1 : 0;
+  }
+
+  char buf[CTAR_BLOCK_SIZE];
+  for (; nbytes > 0; nbytes -= CTAR_BLOCK_SIZE)
+  {
+    ssize_t nread = read_full(fd, buf, CTAR_BLOCK_SIZE);
+    if (nread != CTAR_BLOCK_SIZE)
+    {
+      // A short read means the archive is truncated
+      errno = nread == -1 ? errno : EIO;
+      return -1;
+    }
+  }
+
+  return 0;
 }
 
-int get_nblocks(ctar_header *header)
+/**
+ * copy_file_range() copies between regular files (sharing the data blocks on filesystems
+ * supporting reflinks), splice() moves data out of a pipe (standard input, decompression thread).
+ * If neither applies, the caller copies the rest itself.
+ */
+long copy_in_kernel(int fd_in, int fd_out, long size)
 {
-  int size = oct2dec(header->size, CTAR_SIZE_SIZE);
-  int nblocks = size / CTAR_BLOCK_SIZE + (size % CTAR_BLOCK_SIZE == 0 ? 0 : 1);
+  bool splicing = false;
+  long copied = 0;
+  while (copied < size)
+  {
+    ssize_t nbytes = splicing ? splice(fd_in, NULL, fd_out, NULL, size - copied, SPLICE_F_MOVE)
+                              : copy_file_range(fd_in, NULL, fd_out, NULL, size - copied, 0);
+    if (nbytes == 0)
+    {
+      break;
+    }
+
+    if (nbytes == -1)
+    {
+      // Nothing was copied by the failed call, the next method starts at the same offsets
+      bool unsupported = errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EXDEV;
+      if (!unsupported)
+      {
+        return -1;
+      }
+
+      if (splicing)
+      {
+        break;
+      }
+      splicing = true;
+      continue;
+    }
+
+    copied += nbytes;
+  }
+
+  return copied;
+}
+
+int write_full(int fd, const void *buf, size_t count)
+{
+  for (size_t total = 0; total < count;)
+  {
+    ssize_t nbytes = write(fd, (const char *)buf + total, count - total);
+    if (nbytes == -1)
+    {
+      return -1;
+    }
+    total += nbytes;
+  }
+
+  return 0;
+}
+
+/**
+ * A file system not supporting O_DIRECT may only reject it at the first read or write, with EINVAL.
+ */
+int clear_direct_io(int fd)
+{
+  int err = errno;
+  int flags = err == EINVAL ? fcntl(fd, F_GETFL) : -1;
+  if (flags == -1 || !(flags & O_DIRECT) || fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1)
+  {
+    errno = err;
+    return -1;
+  }
+
+  fprintf(stderr, "Warning: direct I/O is not supported by the file system of the archive, using the page cache\n");
+  return 0;
+}
+
+ssize_t read_full(int fd, void *buf, size_t count)
+{
+  size_t total = 0;
+  while (total < count)
+  {
+    ssize_t nbytes = read(fd, (char *)buf + total, count - total);
+    if (nbytes == -1)
+    {
+      return -1;
+    }
+
+    if (nbytes == 0)
+    {
+      break;
+    }
+
+    total += nbytes;
+  }
+
+  return total;
+}
+
+void put_le64(unsigned char *buf, uint64_t value)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    buf[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+uint64_t get_le64(unsigned char *buf)
+{
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--)
+  {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+long long get_nblocks(ctar_header *header)
+{
+  long long size = oct2dec(header->size, CTAR_SIZE_SIZE);
+  long long nblocks = size / CTAR_BLOCK_SIZE + (size % CTAR_BLOCK_SIZE == 0 ? 0 : 1);
   return nblocks;
 }
 
+/**
+ * Each getpwuid() call reads the user database again (several syscalls),
+ * while the entries of an archive mostly share the same owner.
+ * The last name is remembered per thread, so that the shards of an archive can be created in parallel.
+ */
+const char *get_user_name(uid_t uid)
+{
+  static _Thread_local bool cached = false;
+  static _Thread_local uid_t cached_uid;
+  static _Thread_local char name[CTAR_UNAME_SIZE + 1];
+
+  if (!cached || cached_uid != uid)
+  {
+    struct passwd pwd;
+    struct passwd *pw;
+    char buf[CTAR_PASSWD_BUF_SIZE];
+    if (getpwuid_r(uid, &pwd, buf, sizeof(buf), &pw) != 0 || pw == NULL)
+    {
+      return NULL;
+    }
+    snprintf(name, sizeof(name), "%s", pw->pw_name);
+    cached_uid = uid;
+    cached = true;
+  }
+
+  return name;
+}
+
+/**
+ * Like get_user_name(), for the group database.
+ */
+const char *get_group_name(gid_t gid)
+{
+  static _Thread_local bool cached = false;
+  static _Thread_local gid_t cached_gid;
+  static _Thread_local char name[CTAR_GNAME_SIZE + 1];
+
+  if (!cached || cached_gid != gid)
+  {
+    struct group grp;
+    struct group *gr;
+    char buf[CTAR_PASSWD_BUF_SIZE];
+    if (getgrgid_r(gid, &grp, buf, sizeof(buf), &gr) != 0 || gr == NULL)
+    {
+      return NULL;
+    }
+    snprintf(name, sizeof(name), "%s", gr->gr_name);
+    cached_gid = gid;
+    cached = true;
+  }
+
+  return name;
+}
+
 /**
  * @note The checksum is calculated by taking the sum of the
  * unsigned byte values of the header record with the eight
@@ -104,31 +413,26 @@ void compute_checksum(ctar_header *header)
   header->chksum[CTAR_CHKSUM_SIZE - 1] = ' ';
 }
 
+/**
+ * @note The header is left untouched, so it may be read-only (e.g. mapped from the archive).
+ */
 bool is_checksum_valid(ctar_header *header)
 {
-  // Save the original checksum.
-  char chksum[CTAR_CHKSUM_SIZE];
-  memcpy(chksum, header->chksum, CTAR_CHKSUM_SIZE);
-  
-  // Compute the checksum and compare it with the original one.
-  compute_checksum(header);
-  bool is_valid = memcmp(chksum, header->chksum, CTAR_CHKSUM_SIZE) == 0;
-
-  // Restore the original checksum.
-  memcpy(header->chksum, chksum, CTAR_CHKSUM_SIZE);
-
-  return is_valid;
-}
-
-int ctar_mkstemp()
-{
-  char tmp_archive_path[] = "/tmp/ctar-XXXXXX";
-  int tmp_fd = mkstemp(tmp_archive_path);
-  if (tmp_fd == -1 || unlink(tmp_archive_path) == -1)
+  // Compute the checksum like compute_checksum(), with the checksum bytes taken to be spaces.
+  int sum = 0;
+  for (int i = 0; i < sizeof(ctar_header); i++)
   {
-    perror("Unable to create temporary file");
-    return -1;
+    sum += ((char *)header)[i];
   }
-  
-  return tmp_fd;
+  for (int i = 0; i < CTAR_CHKSUM_SIZE; i++)
+  {
+    sum += ' ' - header->chksum[i];
+  }
+
+  char chksum[CTAR_CHKSUM_SIZE];
+  dec2oct(sum, chksum, CTAR_CHKSUM_SIZE - 1);
+  chksum[CTAR_CHKSUM_SIZE - 2] = '\0';
+  chksum[CTAR_CHKSUM_SIZE - 1] = ' ';
+
+  return memcmp(chksum, header->chksum, CTAR_CHKSUM_SIZE) == 0;
 }